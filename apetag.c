@@ -4,22 +4,85 @@
 #include <stdio.h>
 #include <memory.h>
 #include <string.h>
-#include <fcntl.h>
 #include <unistd.h>
 
-int ReadMP3ID3v1Tag(FILE *fi, unsigned char **tagbuff, long *tag_offset)
+enum
+{
+    TAIL_BLOCK_SIZE = 64 * 1024 //read this much of the end of the file at once
+};
+
+/* The end of the file, read with a single fread. The tail tag readers
+   take their bytes from here instead of seeking around the file. */
+struct TailBlock
 {
-    char tmp[128];
+    FILE *fp;
+    unsigned char *buff;
+    long start; /* file offset of buff[0] */
+    long end;   /* file offset just past the last byte of buff */
+    long size;  /* file size */
+};
+
+/* Widen the block so that it starts at 'start', reading only the part
+   that is not in memory yet */
+static int ExtendTailBlock(struct TailBlock *tail, long start)
+{
+    unsigned char *buff;
+    size_t missing = tail->start - start;
 
-    if (*tag_offset < 128)
+    buff = malloc(tail->end - start);
+    if (buff == NULL)
     {
         return 0;
     }
-    if (fseek(fi, *tag_offset - 128, SEEK_SET))
+    if (fseek(tail->fp, start, SEEK_SET) || fread(buff, 1, missing, tail->fp) != missing)
     {
+        free(buff);
         return 0;
     }
-    if (fread(tmp, 1, 128, fi) != 128)
+    if (tail->buff)
+    {
+        memcpy(buff + missing, tail->buff, tail->end - tail->start);
+        free(tail->buff);
+    }
+    tail->buff = buff;
+    tail->start = start;
+    return 1;
+}
+
+/* Returns the 'len' bytes at file offset 'offset', or NULL if the file
+   does not have them. Tags bigger than TAIL_BLOCK_SIZE cost one more read.
+   The pointer is only good until the next call. */
+static const unsigned char *TailBytes(struct TailBlock *tail, long offset, long len)
+{
+    if (offset < 0 || len < 0 || len > tail->size - offset)
+    {
+        return NULL;
+    }
+    if (offset + len < tail->start || offset + len > tail->end)
+    {
+        /* Past a tag that was skipped without reading it: start a new
+           block that ends here */
+        free(tail->buff);
+        tail->buff = NULL;
+        tail->start = tail->end = offset + len;
+        if (!ExtendTailBlock(tail, offset + len > TAIL_BLOCK_SIZE ? offset + len - TAIL_BLOCK_SIZE : 0))
+        {
+            return NULL;
+        }
+    }
+    if (offset < tail->start && !ExtendTailBlock(tail, offset))
+    {
+        return NULL;
+    }
+    return tail->buff + (offset - tail->start);
+}
+
+static int ReadMP3ID3v1Tag(struct TailBlock *tail, unsigned char **tagbuff, long *tag_offset)
+{
+    const unsigned char *tmp;
+
+    tmp = TailBytes(tail, *tag_offset - 128, 128);
+    if (tmp == NULL)
     {
         return 0;
     }
@@ -74,7 +137,7 @@ struct Lyrics3TagField
 };
 
 // Reads Lyrics3 v2.0 tag
-static int ReadMP3Lyrics3v2Tag(FILE *fp,
+static int ReadMP3Lyrics3v2Tag(struct TailBlock *tail,
                                unsigned char **tagbuff,
                                unsigned long *tagSize,
                                unsigned char **id3tagbuff,
@@ -82,19 +145,12 @@ static int ReadMP3Lyrics3v2Tag(FILE *fp,
 {
     int len;
     struct Lyrics3TagFooterStruct T;
-    char tmpid3[128];
-    char tmp[11];
+    const unsigned char *tmpid3;
+    const unsigned char *tmp;
     long taglen;
 
-    if (*tag_offset < 128)
-    {
-        return 0;
-    }
-    if (fseek(fp, *tag_offset - 128, SEEK_SET))
-    {
-        return 0;
-    }
-    if (fread(tmpid3, 1, 128, fp) != 128)
+    tmpid3 = TailBytes(tail, *tag_offset - 128, 128);
+    if (tmpid3 == NULL)
     {
         return 0;
     }
@@ -110,25 +166,20 @@ static int ReadMP3Lyrics3v2Tag(FILE *fp,
     }
     *id3tagbuff = malloc(128);
     memcpy(*id3tagbuff, tmpid3, 128);
-    if (fseek(fp, *tag_offset - 128 - sizeof(T), SEEK_SET))
-    {
-        return 0;
-    }
-    if (fread(&T, 1, sizeof(T), fp) != sizeof(T))
+    tmp = TailBytes(tail, *tag_offset - 128 - (long)sizeof(T), sizeof(T));
+    if (tmp == NULL)
     {
         return 0;
     }
+    memcpy(&T, tmp, sizeof(T));
     // check for lyrics3 v2.00 tag
     if (memcmp(T.ID, "LYRICS200", sizeof(T.ID)))
     {
         return 0;
     }
     len = Lyrics3GetNumber6(T.Length);
-    if (fseek(fp, *tag_offset - 128 - (int)sizeof(T) - len, SEEK_SET))
-    {
-        return 0;
-    }
-    if (fread(tmp, 1, 11, fp) != 11)
+    tmp = TailBytes(tail, *tag_offset - 128 - (long)sizeof(T) - len, 11);
+    if (tmp == NULL)
     {
         return 0;
     }
@@ -137,7 +188,7 @@ static int ReadMP3Lyrics3v2Tag(FILE *fp,
         return 0;
     }
 
-    taglen = 128 + Lyrics3GetNumber6(T.Length) + sizeof(T);
+    taglen = 128 + len + sizeof(T);
 
     *tag_offset -= taglen;
     if (*tagbuff != NULL)
@@ -145,12 +196,7 @@ static int ReadMP3Lyrics3v2Tag(FILE *fp,
         free(*tagbuff);
     }
     *tagbuff = malloc(taglen);
-    fseek(fp, *tag_offset, SEEK_SET);
-    size_t r = fread(*tagbuff, 1, taglen, fp);
-    if (r != taglen)
-    {
-        abort();
-    }
+    memcpy(*tagbuff, TailBytes(tail, *tag_offset, taglen), taglen);
     *tagSize = taglen;
     return 1;
 }
@@ -192,16 +238,17 @@ unsigned long strlen_max(const char *ptr, unsigned long max)
 }
 
 // Reads APE v1.0/2.0 tag
-int ReadMP3APETag(FILE *fp,  struct MP3GainTagInfo *info, struct APETagStruct **apeTag, long *tag_offset)
+static int ReadMP3APETag(struct TailBlock *tail,  struct MP3GainTagInfo *info, struct APETagStruct **apeTag, long *tag_offset)
 {
     unsigned long               vsize;
     unsigned long               isize;
     unsigned long                           remaining;
-    char                       *buff;
-    char                       *p;
+    const char                 *buff;
+    const char                 *p;
     char                       *value;
     char                       *vp;
-    char                       *end;
+    const char                 *end;
+    const unsigned char        *tmp;
     struct APETagFooterStruct   T;
     unsigned long               TagLen;
     unsigned long               TagCount;
@@ -211,18 +258,12 @@ int ReadMP3APETag(FILE *fp,  struct MP3GainTagInfo *info, struct APETagStruct **
     int                         is_info;
     char                                            tmpString[10];
 
-    if (*tag_offset < (long)(sizeof(T)))
-    {
-        return 0;
-    }
-    if (fseek(fp, *tag_offset - sizeof(T), SEEK_SET))
-    {
-        return 0;
-    }
-    if (fread(&T, 1, sizeof(T), fp) != sizeof(T))
+    tmp = TailBytes(tail, *tag_offset - (long)sizeof(T), sizeof(T));
+    if (tmp == NULL)
     {
         return 0;
     }
+    memcpy(&T, tmp, sizeof(T));
     if (memcmp(T.ID, "APETAGEX", sizeof(T.ID)))
     {
         return 0;
@@ -236,14 +277,22 @@ int ReadMP3APETag(FILE *fp,  struct MP3GainTagInfo *info, struct APETagStruct **
     {
         return 0;
     }
-    if (fseek(fp, *tag_offset - TagLen, SEEK_SET))
+    if (apeTag == NULL)     // only looking for where the tags start
     {
-        return 0;
+        if (Read_LE_Uint32(T.Flags) & (1 << 31))
+        {
+            TagLen += sizeof(T);
+        }
+        if (TagLen > (unsigned long)*tag_offset)
+        {
+            return 0;
+        }
+        *tag_offset -= TagLen;
+        return 1;
     }
-    buff = malloc(TagLen);
-    if (fread(buff, 1, TagLen - sizeof(T), fp) != (TagLen - sizeof(T)))
+    buff = (const char *)TailBytes(tail, *tag_offset - (long)TagLen, TagLen - sizeof(T));
+    if (buff == NULL)
     {
-        free(buff);
         return 0;
     }
 
@@ -384,23 +433,19 @@ int ReadMP3APETag(FILE *fp,  struct MP3GainTagInfo *info, struct APETagStruct **
         p += isize + 1 + vsize;
     }
 
-    free(buff);
-
     *tag_offset -= TagLen;
     (*apeTag)->originalTagSize = TagLen;
 
     if (Read_LE_Uint32(T.Flags) & (1 << 31))     // Tag contains header
     {
-        *tag_offset -= sizeof(T);
-
-        fseek(fp, *tag_offset, SEEK_SET);
-        size_t r = fread(&((*apeTag)->header), 1, sizeof(T), fp);
-        if (r != sizeof(T))
+        tmp = TailBytes(tail, *tag_offset - (long)sizeof(T), sizeof(T));
+        if (tmp != NULL)
         {
-            abort();
+            *tag_offset -= sizeof(T);
+            memcpy(&((*apeTag)->header), tmp, sizeof(T));
+            (*apeTag)->haveHeader = !0;
+            (*apeTag)->originalTagSize += sizeof(T);
         }
-        (*apeTag)->haveHeader = !0;
-        (*apeTag)->originalTagSize += sizeof(T);
     }
 
     if (otherFieldsCount != origTagCount)
@@ -419,20 +464,21 @@ int ReadMP3APETag(FILE *fp,  struct MP3GainTagInfo *info, struct APETagStruct **
 
 int truncate_file(const char *filename, long truncLength)
 {
-    int fd;
+    FILE *file;
 
-    fd = open(filename, O_RDWR);
-    if (fd < 0)
+    file = openFile(filename, "r+b");
+    if (file == NULL)
     {
         return 0;
     }
-    if (ftruncate(fd, truncLength))
+    fflush(file);
+    if (ftruncate(fileno(file), truncLength))
     {
-        close(fd);
+        closeFile(file);
         passError(2, "Could not truncate ", filename);
         return 0;
     }
-    close(fd);
+    closeFile(file);
 
     return 1;
 }
@@ -443,15 +489,23 @@ int truncate_file(const char *filename, long truncLength)
  * Look for an APE tag at the end of the MP3 file, and extract
  * gain information from it. Any ID3v1 or Lyrics3v2 tags at the end
  * of the file are read and stored, but not processed.
+ *
+ * The end of the file is read once and all three tag formats are
+ * parsed from memory; only a tag bigger than TAIL_BLOCK_SIZE needs
+ * a second read.
+ *
+ * With info == NULL only fileTags->tagOffset, where the tags start, is
+ * wanted: the APE tag is skipped by its footer without being read.
  */
 int ReadMP3GainAPETag(const char *filename,
                       struct MP3GainTagInfo *info,
                       struct FileTagsStruct *fileTags)
 {
     FILE *fi;
+    struct TailBlock tail;
     long tag_offset, offs_bk;
 
-    fi = fopen(filename, "rb");
+    fi = openFile(filename, "rb");
     if (fi == NULL)
     {
         return 0;
@@ -459,21 +513,28 @@ int ReadMP3GainAPETag(const char *filename,
 
     fseek(fi, 0, SEEK_END);
     tag_offset = ftell(fi);
+    fileTags->fileSize = tag_offset;
+
+    tail.fp = fi;
+    tail.buff = NULL;
+    tail.start = tail.end = tail.size = tag_offset;
+    ExtendTailBlock(&tail, tag_offset > TAIL_BLOCK_SIZE ? tag_offset - TAIL_BLOCK_SIZE : 0);
 
     fileTags->lyrics3TagSize = 0;
 
     do
     {
         offs_bk = tag_offset;
-        ReadMP3APETag(fi, info, &(fileTags->apeTag), &tag_offset);
-        ReadMP3Lyrics3v2Tag(fi, &(fileTags->lyrics3tag), &(fileTags->lyrics3TagSize), &(fileTags->id31tag), &tag_offset);
-        ReadMP3ID3v1Tag(fi, &(fileTags->id31tag), &tag_offset);
+        ReadMP3APETag(&tail, info, info ? &(fileTags->apeTag) : NULL, &tag_offset);
+        ReadMP3Lyrics3v2Tag(&tail, &(fileTags->lyrics3tag), &(fileTags->lyrics3TagSize), &(fileTags->id31tag), &tag_offset);
+        ReadMP3ID3v1Tag(&tail, &(fileTags->id31tag), &tag_offset);
     }
     while (offs_bk != tag_offset);
 
     fileTags->tagOffset = tag_offset;
 
-    fclose(fi);
+    free(tail.buff);
+    closeFile(fi);
 
     return 1;
 }
@@ -740,7 +801,7 @@ int WriteMP3GainAPETag(const char *filename,
         mp3gainTagData += 8;
     }
 
-    outputFile = fopen(filename, "r+b");
+    outputFile = openFile(filename, "r+b");
     if (outputFile == NULL)
     {
         passError(3, "Can't open ", filename, " for modifying");
@@ -762,7 +823,7 @@ int WriteMP3GainAPETag(const char *filename,
         fwrite(fileTags->id31tag, 1, 128, outputFile); //so only write id3 tag alone if
     }                                                  //no Lyrics3 tag
 
-    fclose(outputFile);
+    closeFile(outputFile);
 
     if (saveTimeStamp)
     {
@@ -67,6 +67,7 @@ struct APETagStruct
 
 struct FileTagsStruct
 {
+    long fileSize; /* when the tags were read */
     long tagOffset;
     struct APETagStruct *apeTag;
     unsigned char *lyrics3tag;
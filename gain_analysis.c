@@ -71,6 +71,16 @@
  *        fprintf ("Recommended dB change for song %2d: %+6.2f dB\n", i, GetTitleGain() );
  *    }
  *    fprintf ("Recommended dB change for whole album: %+6.2f dB\n", GetAlbumGain() );
+ *
+ *  The functions above use a default context (one per thread). To analyze
+ *  several streams at once, give each its own context from
+ *  CreateGainAnalysis() and use the ...Ctx() versions. Songs of the same
+ *  album analyzed in different contexts are combined with
+ *
+ *    MergeAlbumGain ( album_ctx, song_ctx );
+ *
+ *  after GetTitleGainCtx ( song_ctx ), then GetAlbumGainCtx ( album_ctx ).
+ *  Free a context with FreeGainAnalysis().
  */
 
 /*
@@ -94,6 +104,7 @@
 #include <math.h>
 
 #include "gain_analysis.h"
+#include "mpglibDBL_common.h"
 
 typedef unsigned short  Uint16_t;
 typedef signed short    Int16_t;
@@ -120,27 +131,36 @@ typedef signed int      Int32_t;
 #define MAX_SAMPLES_PER_WINDOW  (MAX_SAMP_FREQ_kHz * RMS_WINDOW_TIME_ms + 1)      // max. Samples per Time slice
 #define PINK_REF                64.82 //298640883795                              // calibration value
 
-Float_t          linprebuf [MAX_ORDER * 2];
-Float_t         *linpre;                                          // left input samples, with pre-buffer
-Float_t          lstepbuf  [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
-Float_t         *lstep;                                           // left "first step" (i.e. post first filter) samples
-Float_t          loutbuf   [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
-Float_t         *lout;                                            // left "out" (i.e. post second filter) samples
-Float_t          rinprebuf [MAX_ORDER * 2];
-Float_t         *rinpre;                                          // right input samples ...
-Float_t          rstepbuf  [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
-Float_t         *rstep;
-Float_t          routbuf   [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
-Float_t         *rout;
-long
-sampleWindow;                                    // number of samples required to reach number of milliseconds required for RMS window
-long             totsamp;
-double           lsum;
-double           rsum;
-int              freqindex;
-int              first;
-static Uint32_t  A [(size_t)(STEPS_per_dB_int * MAX_dB_int)];
-static Uint32_t  B [(size_t)(STEPS_per_dB_int * MAX_dB_int)];
+// runs both filters over nSamples of both channels, and adds the squared
+// output to lsum and rsum
+typedef void (*filterFunc)(GainAnalysis *ctx, const Float_t *left, const Float_t *right, long nSamples);
+
+struct GainAnalysis
+{
+    filterFunc  filter;                                 // chosen for this CPU
+    Float_t   linprebuf [MAX_ORDER * 2];
+    Float_t  *linpre;                                     // left input samples, with pre-buffer
+    Float_t   lstepbuf  [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
+    Float_t  *lstep;                                      // left "first step" (i.e. post first filter) samples
+    Float_t   loutbuf   [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
+    Float_t  *lout;                                       // left "out" (i.e. post second filter) samples
+    Float_t   rinprebuf [MAX_ORDER * 2];
+    Float_t  *rinpre;                                     // right input samples ...
+    Float_t   rstepbuf  [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
+    Float_t  *rstep;
+    Float_t   routbuf   [MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
+    Float_t  *rout;
+    long      sampleWindow;                               // number of samples required to reach number of milliseconds required for RMS window
+    long      totsamp;
+    double    lsum;
+    double    rsum;
+    int       freqindex;
+    Uint32_t  A [(size_t)(STEPS_per_dB_int * MAX_dB_int)];   // loudness histogram of the current title
+    Uint32_t  B [(size_t)(STEPS_per_dB_int * MAX_dB_int)];   // ... of all titles so far
+};
+
+// context behind the old single-stream functions; one per thread, so -j works
+static _Thread_local GainAnalysis  defaultContext;
 
 // for each filter:
 // [0] 48 kHz, [1] 44.1 kHz, [2] 32 kHz, [3] 24 kHz, [4] 22050 Hz, [5] 16 kHz, [6] 12 kHz, [7] is 11025 Hz, [8] 8 kHz
@@ -230,105 +250,396 @@ static void filterButter(const Float_t *input, Float_t *output, size_t nSamples,
     }
 }
 
+static __inline double fsqr(const double d)
+{
+    return d * d;
+}
+
+// The straightforward version, one channel and one filter at a time
+
+static void filterScalar(GainAnalysis *ctx, const Float_t *curleft, const Float_t *curright, long cursamples)
+{
+    long  i;
+
+    YULE_FILTER(curleft, ctx->lstep + ctx->totsamp, cursamples, ABYule[ctx->freqindex]);
+    YULE_FILTER(curright, ctx->rstep + ctx->totsamp, cursamples, ABYule[ctx->freqindex]);
+
+    BUTTER_FILTER(ctx->lstep + ctx->totsamp, ctx->lout + ctx->totsamp, cursamples, ABButter[ctx->freqindex]);
+    BUTTER_FILTER(ctx->rstep + ctx->totsamp, ctx->rout + ctx->totsamp, cursamples, ABButter[ctx->freqindex]);
+
+    curleft = ctx->lout + ctx->totsamp;                   // Get the squared values
+    curright = ctx->rout + ctx->totsamp;
+
+    i = cursamples % 16;
+    while (i--)
+    {
+        ctx->lsum += fsqr(*curleft++);
+        ctx->rsum += fsqr(*curright++);
+    }
+    i = cursamples / 16;
+    while (i--)
+    {
+        ctx->lsum += fsqr(curleft[0])
+                     + fsqr(curleft[1])
+                     + fsqr(curleft[2])
+                     + fsqr(curleft[3])
+                     + fsqr(curleft[4])
+                     + fsqr(curleft[5])
+                     + fsqr(curleft[6])
+                     + fsqr(curleft[7])
+                     + fsqr(curleft[8])
+                     + fsqr(curleft[9])
+                     + fsqr(curleft[10])
+                     + fsqr(curleft[11])
+                     + fsqr(curleft[12])
+                     + fsqr(curleft[13])
+                     + fsqr(curleft[14])
+                     + fsqr(curleft[15]);
+        curleft += 16;
+        ctx->rsum += fsqr(curright[0])
+                     + fsqr(curright[1])
+                     + fsqr(curright[2])
+                     + fsqr(curright[3])
+                     + fsqr(curright[4])
+                     + fsqr(curright[5])
+                     + fsqr(curright[6])
+                     + fsqr(curright[7])
+                     + fsqr(curright[8])
+                     + fsqr(curright[9])
+                     + fsqr(curright[10])
+                     + fsqr(curright[11])
+                     + fsqr(curright[12])
+                     + fsqr(curright[13])
+                     + fsqr(curright[14])
+                     + fsqr(curright[15]);
+        curright += 16;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+// SSE2: left and right in the two lanes of one register, both filters and the
+// squares in one pass.  Every sum is done in the same order as in
+// filterScalar, so the results are bit for bit the same.
+
+#define LR(l, r)    _mm_set_pd((r), (l))
+
+static void filterSSE2(GainAnalysis *ctx, const Float_t *curleft, const Float_t *curright, long cursamples)
+{
+    const Float_t  *ky = ABYule[ctx->freqindex];
+    const Float_t  *kb = ABButter[ctx->freqindex];
+    Float_t        *lstep = ctx->lstep + ctx->totsamp;
+    Float_t        *rstep = ctx->rstep + ctx->totsamp;
+    Float_t        *lout = ctx->lout + ctx->totsamp;
+    Float_t        *rout = ctx->rout + ctx->totsamp;
+    __m128d         x[YULE_ORDER + 1];      // Yule input, x[k] is sample n-k
+    __m128d         y[YULE_ORDER + 1];      // Yule output
+    __m128d         o[BUTTER_ORDER + 1];    // Butterworth output
+    __m128d         k[2 * YULE_ORDER + 1];
+    __m128d         sum = LR(ctx->lsum, ctx->rsum);
+    __m128d         block = _mm_setzero_pd();
+    long            n, single = cursamples % 16;
+    int             j;
+
+    for (j = 0; j <= 2 * YULE_ORDER; j++)
+    {
+        k[j] = _mm_set1_pd(ky[j]);
+    }
+    for (j = 1; j <= YULE_ORDER; j++)
+    {
+        x[j] = LR(curleft[-j], curright[-j]);
+        y[j] = LR(lstep[-j], rstep[-j]);
+    }
+    for (j = 1; j <= BUTTER_ORDER; j++)
+    {
+        o[j] = LR(lout[-j], rout[-j]);
+    }
+
+    for (n = 0; n < cursamples; n++)
+    {
+        __m128d  acc;
+
+        x[0] = LR(curleft[n], curright[n]);
+        acc = _mm_add_pd(_mm_set1_pd(1e-10), _mm_mul_pd(x[0], k[0]));
+        for (j = 1; j <= YULE_ORDER; j++)
+        {
+            acc = _mm_sub_pd(acc, _mm_mul_pd(y[j], k[2 * j - 1]));
+            acc = _mm_add_pd(acc, _mm_mul_pd(x[j], k[2 * j]));
+        }
+        y[0] = acc;
+
+        acc = _mm_mul_pd(y[0], _mm_set1_pd(kb[0]));
+        acc = _mm_sub_pd(acc, _mm_mul_pd(o[1], _mm_set1_pd(kb[1])));
+        acc = _mm_add_pd(acc, _mm_mul_pd(y[1], _mm_set1_pd(kb[2])));
+        acc = _mm_sub_pd(acc, _mm_mul_pd(o[2], _mm_set1_pd(kb[3])));
+        acc = _mm_add_pd(acc, _mm_mul_pd(y[2], _mm_set1_pd(kb[4])));
+        o[0] = acc;
+
+        _mm_storel_pd(lstep + n, y[0]);
+        _mm_storeh_pd(rstep + n, y[0]);
+        _mm_storel_pd(lout + n, o[0]);
+        _mm_storeh_pd(rout + n, o[0]);
+
+        // the squares: one by one at first, then in blocks of 16
+        if (n < single)
+        {
+            sum = _mm_add_pd(sum, _mm_mul_pd(o[0], o[0]));
+        }
+        else if ((n - single) % 16 == 0)
+        {
+            block = _mm_mul_pd(o[0], o[0]);
+        }
+        else
+        {
+            block = _mm_add_pd(block, _mm_mul_pd(o[0], o[0]));
+            if ((n - single) % 16 == 15)
+            {
+                sum = _mm_add_pd(sum, block);
+            }
+        }
+
+        for (j = YULE_ORDER; j > 0; j--)
+        {
+            x[j] = x[j - 1];
+            y[j] = y[j - 1];
+        }
+        o[2] = o[1];
+        o[1] = o[0];
+    }
+
+    _mm_storel_pd(&ctx->lsum, sum);
+    _mm_storeh_pd(&ctx->rsum, sum);
+}
+
+// AVX2 with FMA: first the non-recursive part of the Yule filter, four
+// samples at a time for each channel, into lout/rout.  Then the recursive
+// parts of both filters and the squares, left and right in two lanes.  The
+// sums are reordered so that each output waits on just one multiply-add
+// with the previous one, which changes the last bits of the result.
+
+__attribute__((target("avx2,fma")))
+static void filterAVX2(GainAnalysis *ctx, const Float_t *curleft, const Float_t *curright, long cursamples)
+{
+    const Float_t  *ky = ABYule[ctx->freqindex];
+    const Float_t  *kb = ABButter[ctx->freqindex];
+    Float_t        *lstep = ctx->lstep + ctx->totsamp;
+    Float_t        *rstep = ctx->rstep + ctx->totsamp;
+    Float_t        *lout = ctx->lout + ctx->totsamp;
+    Float_t        *rout = ctx->rout + ctx->totsamp;
+    __m128d         y[YULE_ORDER + 1];
+    __m128d         s[BUTTER_ORDER + 1];    // Butterworth input (Yule output)
+    __m128d         o[BUTTER_ORDER + 1];
+    __m128d         a[YULE_ORDER + 1];
+    __m128d         sum = LR(ctx->lsum, ctx->rsum);
+    long            n;
+    int             j, c;
+
+    for (c = 0; c < 2; c++)
+    {
+        const Float_t  *in = c ? curright : curleft;
+        Float_t        *fir = c ? rout : lout;
+
+        for (n = 0; n + 4 <= cursamples; n += 4)
+        {
+            __m256d  acc0 = _mm256_mul_pd(_mm256_loadu_pd(in + n), _mm256_set1_pd(ky[0]));
+            __m256d  acc1 = _mm256_mul_pd(_mm256_loadu_pd(in + n - 1), _mm256_set1_pd(ky[2]));
+
+            for (j = 2; j <= YULE_ORDER; j += 2)
+            {
+                acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(in + n - j), _mm256_set1_pd(ky[2 * j]), acc0);
+                if (j < YULE_ORDER)
+                {
+                    acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(in + n - j - 1), _mm256_set1_pd(ky[2 * j + 2]), acc1);
+                }
+            }
+            _mm256_storeu_pd(fir + n, _mm256_add_pd(acc0, acc1));
+        }
+        for (; n < cursamples; n++)
+        {
+            Float_t  acc = 0.;
+
+            for (j = 0; j <= YULE_ORDER; j++)
+            {
+                acc += in[n - j] * ky[2 * j];
+            }
+            fir[n] = acc;
+        }
+    }
+
+    for (j = 1; j <= YULE_ORDER; j++)
+    {
+        a[j] = _mm_set1_pd(ky[2 * j - 1]);
+        y[j] = LR(lstep[-j], rstep[-j]);
+    }
+    for (j = 1; j <= BUTTER_ORDER; j++)
+    {
+        s[j] = y[j];
+        o[j] = LR(lout[-j], rout[-j]);
+    }
+
+    for (n = 0; n < cursamples; n++)
+    {
+        __m128d  older = _mm_mul_pd(y[YULE_ORDER], a[YULE_ORDER]);
+        __m128d  acc;
+
+        for (j = YULE_ORDER - 1; j > 1; j--)
+        {
+            older = _mm_fmadd_pd(y[j], a[j], older);
+        }
+        acc = _mm_sub_pd(_mm_add_pd(LR(lout[n], rout[n]), _mm_set1_pd(1e-10)), older);
+        y[0] = _mm_fnmadd_pd(y[1], a[1], acc);
+
+        acc = _mm_mul_pd(y[0], _mm_set1_pd(kb[0]));
+        acc = _mm_fmadd_pd(s[1], _mm_set1_pd(kb[2]), acc);
+        acc = _mm_fmadd_pd(s[2], _mm_set1_pd(kb[4]), acc);
+        acc = _mm_fnmadd_pd(o[2], _mm_set1_pd(kb[3]), acc);
+        o[0] = _mm_fnmadd_pd(o[1], _mm_set1_pd(kb[1]), acc);
+
+        _mm_storel_pd(lstep + n, y[0]);
+        _mm_storeh_pd(rstep + n, y[0]);
+        _mm_storel_pd(lout + n, o[0]);
+        _mm_storeh_pd(rout + n, o[0]);
+        sum = _mm_fmadd_pd(o[0], o[0], sum);
+
+        for (j = YULE_ORDER; j > 0; j--)
+        {
+            y[j] = y[j - 1];
+        }
+        s[2] = s[1];
+        s[1] = y[1];
+        o[2] = o[1];
+        o[1] = o[0];
+    }
+
+    _mm_storel_pd(&ctx->lsum, sum);
+    _mm_storeh_pd(&ctx->rsum, sum);
+}
+
+#endif // HAVE_X86_SIMD
+
+// The same version as the decoder, from simd_level(), so that MP3GAIN_SIMD
+// picks both.  The AVX2 filter does not give the scalar results bit for bit,
+// so it is only used when MP3GAIN_SIMD=avx2 asks for it; by default an AVX2
+// machine runs the SSE2 filter.
+
+static filterFunc selectFilter(void)
+{
+    switch (simd_level())
+    {
+#ifdef HAVE_X86_SIMD
+    case SIMD_AVX2:
+    {
+        const char *simd = getenv("MP3GAIN_SIMD");
+
+        if (simd != NULL && strcmp(simd, "avx2") == 0 && __builtin_cpu_supports("fma"))
+        {
+            return filterAVX2;
+        }
+        return filterSSE2;
+    }
+    case SIMD_SSE2:
+        return filterSSE2;
+#endif
+    default:
+        return filterScalar;
+    }
+}
+
 // returns a INIT_GAIN_ANALYSIS_OK if successful, INIT_GAIN_ANALYSIS_ERROR if not
 
-int ResetSampleFrequency(long samplefreq)
+int ResetSampleFrequencyCtx(GainAnalysis *ctx, long samplefreq)
 {
     int  i;
 
     // zero out initial values
     for (i = 0; i < MAX_ORDER; i++)
     {
-        linprebuf[i] = lstepbuf[i] = loutbuf[i] = rinprebuf[i] = rstepbuf[i] = routbuf[i] = 0.;
+        ctx->linprebuf[i] = ctx->lstepbuf[i] = ctx->loutbuf[i] = ctx->rinprebuf[i] = ctx->rstepbuf[i] = ctx->routbuf[i] = 0.;
     }
 
     switch ((int)(samplefreq))
     {
     case 96000:
-        freqindex = 0;
+        ctx->freqindex = 0;
         break;
     case 88200:
-        freqindex = 1;
+        ctx->freqindex = 1;
         break;
     case 64000:
-        freqindex = 2;
+        ctx->freqindex = 2;
         break;
     case 48000:
-        freqindex = 3;
+        ctx->freqindex = 3;
         break;
     case 44100:
-        freqindex = 4;
+        ctx->freqindex = 4;
         break;
     case 32000:
-        freqindex = 5;
+        ctx->freqindex = 5;
         break;
     case 24000:
-        freqindex = 6;
+        ctx->freqindex = 6;
         break;
     case 22050:
-        freqindex = 7;
+        ctx->freqindex = 7;
         break;
     case 16000:
-        freqindex = 8;
+        ctx->freqindex = 8;
         break;
     case 12000:
-        freqindex = 9;
+        ctx->freqindex = 9;
         break;
     case 11025:
-        freqindex = 10;
+        ctx->freqindex = 10;
         break;
     case  8000:
-        freqindex = 11;
+        ctx->freqindex = 11;
         break;
     default:
         return INIT_GAIN_ANALYSIS_ERROR;
     }
 
-    sampleWindow = (int) ceil(samplefreq * RMS_WINDOW_TIME);
+    ctx->sampleWindow = (int) ceil(samplefreq * RMS_WINDOW_TIME);
 
-    lsum         = 0.;
-    rsum         = 0.;
-    totsamp      = 0;
+    ctx->lsum         = 0.;
+    ctx->rsum         = 0.;
+    ctx->totsamp      = 0;
 
-    memset(A, 0, sizeof(A));
+    memset(ctx->A, 0, sizeof(ctx->A));
 
     return INIT_GAIN_ANALYSIS_OK;
 }
 
-int InitGainAnalysis(long samplefreq)
+int InitGainAnalysisCtx(GainAnalysis *ctx, long samplefreq)
 {
-    if (ResetSampleFrequency(samplefreq) != INIT_GAIN_ANALYSIS_OK)
+    if (ResetSampleFrequencyCtx(ctx, samplefreq) != INIT_GAIN_ANALYSIS_OK)
     {
         return INIT_GAIN_ANALYSIS_ERROR;
     }
 
-    linpre       = linprebuf + MAX_ORDER;
-    rinpre       = rinprebuf + MAX_ORDER;
-    lstep        = lstepbuf  + MAX_ORDER;
-    rstep        = rstepbuf  + MAX_ORDER;
-    lout         = loutbuf   + MAX_ORDER;
-    rout         = routbuf   + MAX_ORDER;
+    ctx->filter = selectFilter();
 
-    memset(B, 0, sizeof(B));
+    ctx->linpre       = ctx->linprebuf + MAX_ORDER;
+    ctx->rinpre       = ctx->rinprebuf + MAX_ORDER;
+    ctx->lstep        = ctx->lstepbuf  + MAX_ORDER;
+    ctx->rstep        = ctx->rstepbuf  + MAX_ORDER;
+    ctx->lout         = ctx->loutbuf   + MAX_ORDER;
+    ctx->rout         = ctx->routbuf   + MAX_ORDER;
+
+    memset(ctx->B, 0, sizeof(ctx->B));
 
     return INIT_GAIN_ANALYSIS_OK;
 }
 
 // returns GAIN_ANALYSIS_OK if successful, GAIN_ANALYSIS_ERROR if not
 
-static __inline double fsqr(const double d)
-{
-    return d * d;
-}
-
-int AnalyzeSamples(const Float_t *left_samples, const Float_t *right_samples, size_t num_samples, int num_channels)
+int AnalyzeSamplesCtx(GainAnalysis *ctx, const Float_t *left_samples, const Float_t *right_samples, size_t num_samples, int num_channels)
 {
     const Float_t  *curleft;
     const Float_t  *curright;
     long            batchsamples;
     long            cursamples;
     long            cursamplepos;
-    int             i;
 
     if (num_samples == 0)
     {
@@ -350,22 +661,22 @@ int AnalyzeSamples(const Float_t *left_samples, const Float_t *right_samples, si
 
     if (num_samples < MAX_ORDER)
     {
-        memcpy(linprebuf + MAX_ORDER, left_samples, num_samples * sizeof(Float_t));
-        memcpy(rinprebuf + MAX_ORDER, right_samples, num_samples * sizeof(Float_t));
+        memcpy(ctx->linprebuf + MAX_ORDER, left_samples, num_samples * sizeof(Float_t));
+        memcpy(ctx->rinprebuf + MAX_ORDER, right_samples, num_samples * sizeof(Float_t));
     }
     else
     {
-        memcpy(linprebuf + MAX_ORDER, left_samples,  MAX_ORDER   * sizeof(Float_t));
-        memcpy(rinprebuf + MAX_ORDER, right_samples, MAX_ORDER   * sizeof(Float_t));
+        memcpy(ctx->linprebuf + MAX_ORDER, left_samples,  MAX_ORDER   * sizeof(Float_t));
+        memcpy(ctx->rinprebuf + MAX_ORDER, right_samples, MAX_ORDER   * sizeof(Float_t));
     }
 
     while (batchsamples > 0)
     {
-        cursamples = batchsamples > sampleWindow - totsamp  ?  sampleWindow - totsamp  :  batchsamples;
+        cursamples = batchsamples > ctx->sampleWindow - ctx->totsamp  ?  ctx->sampleWindow - ctx->totsamp  :  batchsamples;
         if (cursamplepos < MAX_ORDER)
         {
-            curleft  = linpre + cursamplepos;
-            curright = rinpre + cursamplepos;
+            curleft  = ctx->linpre + cursamplepos;
+            curright = ctx->rinpre + cursamplepos;
             if (cursamples > MAX_ORDER - cursamplepos)
             {
                 cursamples = MAX_ORDER - cursamplepos;
@@ -377,106 +688,54 @@ int AnalyzeSamples(const Float_t *left_samples, const Float_t *right_samples, si
             curright = right_samples + cursamplepos;
         }
 
-        YULE_FILTER(curleft, lstep + totsamp, cursamples, ABYule[freqindex]);
-        YULE_FILTER(curright, rstep + totsamp, cursamples, ABYule[freqindex]);
-
-        BUTTER_FILTER(lstep + totsamp, lout + totsamp, cursamples, ABButter[freqindex]);
-        BUTTER_FILTER(rstep + totsamp, rout + totsamp, cursamples, ABButter[freqindex]);
-
-        curleft = lout + totsamp;                   // Get the squared values
-        curright = rout + totsamp;
-
-        i = cursamples % 16;
-        while (i--)
-        {
-            lsum += fsqr(*curleft++);
-            rsum += fsqr(*curright++);
-        }
-        i = cursamples / 16;
-        while (i--)
-        {
-            lsum += fsqr(curleft[0])
-                    + fsqr(curleft[1])
-                    + fsqr(curleft[2])
-                    + fsqr(curleft[3])
-                    + fsqr(curleft[4])
-                    + fsqr(curleft[5])
-                    + fsqr(curleft[6])
-                    + fsqr(curleft[7])
-                    + fsqr(curleft[8])
-                    + fsqr(curleft[9])
-                    + fsqr(curleft[10])
-                    + fsqr(curleft[11])
-                    + fsqr(curleft[12])
-                    + fsqr(curleft[13])
-                    + fsqr(curleft[14])
-                    + fsqr(curleft[15]);
-            curleft += 16;
-            rsum += fsqr(curright[0])
-                    + fsqr(curright[1])
-                    + fsqr(curright[2])
-                    + fsqr(curright[3])
-                    + fsqr(curright[4])
-                    + fsqr(curright[5])
-                    + fsqr(curright[6])
-                    + fsqr(curright[7])
-                    + fsqr(curright[8])
-                    + fsqr(curright[9])
-                    + fsqr(curright[10])
-                    + fsqr(curright[11])
-                    + fsqr(curright[12])
-                    + fsqr(curright[13])
-                    + fsqr(curright[14])
-                    + fsqr(curright[15]);
-            curright += 16;
-        }
+        ctx->filter(ctx, curleft, curright, cursamples);
 
         batchsamples -= cursamples;
         cursamplepos += cursamples;
-        totsamp      += cursamples;
-        if (totsamp == sampleWindow)      // Get the Root Mean Square (RMS) for this set of samples
+        ctx->totsamp      += cursamples;
+        if (ctx->totsamp == ctx->sampleWindow)      // Get the Root Mean Square (RMS) for this set of samples
         {
-            double  val  = STEPS_per_dB * 10. * log10((lsum + rsum) / totsamp * 0.5 + 1.e-37);
+            double  val  = STEPS_per_dB * 10. * log10((ctx->lsum + ctx->rsum) / ctx->totsamp * 0.5 + 1.e-37);
             int     ival = (int) val;
             if (ival <                     0)
             {
                 ival = 0;
             }
-            if (ival >= (int)(sizeof(A) / sizeof(*A)))
+            if (ival >= (int)(sizeof(ctx->A) / sizeof(*ctx->A)))
             {
-                ival = sizeof(A) / sizeof(*A) - 1;
+                ival = sizeof(ctx->A) / sizeof(*ctx->A) - 1;
             }
-            A [ival]++;
-            lsum = rsum = 0.;
-            memmove(loutbuf, loutbuf  + totsamp, MAX_ORDER * sizeof(Float_t));
-            memmove(routbuf, routbuf  + totsamp, MAX_ORDER * sizeof(Float_t));
-            memmove(lstepbuf, lstepbuf + totsamp, MAX_ORDER * sizeof(Float_t));
-            memmove(rstepbuf, rstepbuf + totsamp, MAX_ORDER * sizeof(Float_t));
-            totsamp = 0;
+            ctx->A [ival]++;
+            ctx->lsum = ctx->rsum = 0.;
+            memmove(ctx->loutbuf, ctx->loutbuf  + ctx->totsamp, MAX_ORDER * sizeof(Float_t));
+            memmove(ctx->routbuf, ctx->routbuf  + ctx->totsamp, MAX_ORDER * sizeof(Float_t));
+            memmove(ctx->lstepbuf, ctx->lstepbuf + ctx->totsamp, MAX_ORDER * sizeof(Float_t));
+            memmove(ctx->rstepbuf, ctx->rstepbuf + ctx->totsamp, MAX_ORDER * sizeof(Float_t));
+            ctx->totsamp = 0;
         }
-        if (totsamp >
-            sampleWindow)     // somehow I really screwed up: Error in programming! Contact author about totsamp > sampleWindow
+        if (ctx->totsamp >
+            ctx->sampleWindow)     // somehow I really screwed up: Error in programming! Contact author about totsamp > sampleWindow
         {
             return GAIN_ANALYSIS_ERROR;
         }
     }
     if (num_samples < MAX_ORDER)
     {
-        memmove(linprebuf,                           linprebuf + num_samples, (MAX_ORDER - num_samples) * sizeof(Float_t));
-        memmove(rinprebuf,                           rinprebuf + num_samples, (MAX_ORDER - num_samples) * sizeof(Float_t));
-        memcpy(linprebuf + MAX_ORDER - num_samples, left_samples,          num_samples             * sizeof(Float_t));
-        memcpy(rinprebuf + MAX_ORDER - num_samples, right_samples,         num_samples             * sizeof(Float_t));
+        memmove(ctx->linprebuf,                           ctx->linprebuf + num_samples, (MAX_ORDER - num_samples) * sizeof(Float_t));
+        memmove(ctx->rinprebuf,                           ctx->rinprebuf + num_samples, (MAX_ORDER - num_samples) * sizeof(Float_t));
+        memcpy(ctx->linprebuf + MAX_ORDER - num_samples, left_samples,          num_samples             * sizeof(Float_t));
+        memcpy(ctx->rinprebuf + MAX_ORDER - num_samples, right_samples,         num_samples             * sizeof(Float_t));
     }
     else
     {
-        memcpy(linprebuf, left_samples  + num_samples - MAX_ORDER, MAX_ORDER * sizeof(Float_t));
-        memcpy(rinprebuf, right_samples + num_samples - MAX_ORDER, MAX_ORDER * sizeof(Float_t));
+        memcpy(ctx->linprebuf, left_samples  + num_samples - MAX_ORDER, MAX_ORDER * sizeof(Float_t));
+        memcpy(ctx->rinprebuf, right_samples + num_samples - MAX_ORDER, MAX_ORDER * sizeof(Float_t));
     }
 
     return GAIN_ANALYSIS_OK;
 }
 
-static Float_t analyzeResult(Uint32_t *Array, size_t len)
+static Float_t analyzeResult(const Uint32_t *Array, size_t len)
 {
     Uint32_t  elems;
     Int32_t   upper;
@@ -504,32 +763,124 @@ static Float_t analyzeResult(Uint32_t *Array, size_t len)
     return (Float_t)((Float_t)PINK_REF - (Float_t)i / (Float_t)STEPS_per_dB);
 }
 
-Float_t GetTitleGain(void)
+Float_t GetTitleGainCtx(GainAnalysis *ctx)
 {
     Float_t  retval;
     int    i;
 
-    retval = analyzeResult(A, sizeof(A) / sizeof(*A));
+    retval = analyzeResult(ctx->A, sizeof(ctx->A) / sizeof(*ctx->A));
 
-    for (i = 0; i < (int)(sizeof(A) / sizeof(*A)); i++)
+    for (i = 0; i < (int)(sizeof(ctx->A) / sizeof(*ctx->A)); i++)
     {
-        B[i] += A[i];
-        A[i]  = 0;
+        ctx->B[i] += ctx->A[i];
+        ctx->A[i]  = 0;
     }
 
     for (i = 0; i < MAX_ORDER; i++)
     {
-        linprebuf[i] = lstepbuf[i] = loutbuf[i] = rinprebuf[i] = rstepbuf[i] = routbuf[i] = 0.f;
+        ctx->linprebuf[i] = ctx->lstepbuf[i] = ctx->loutbuf[i] = ctx->rinprebuf[i] = ctx->rstepbuf[i] = ctx->routbuf[i] = 0.f;
     }
 
-    totsamp = 0;
-    lsum    = rsum = 0.;
+    ctx->totsamp = 0;
+    ctx->lsum    = ctx->rsum = 0.;
     return retval;
 }
 
+Float_t GetAlbumGainCtx(const GainAnalysis *ctx)
+{
+    return analyzeResult(ctx->B, sizeof(ctx->B) / sizeof(*ctx->B));
+}
+
+// adds src's album histogram (every title finished with GetTitleGainCtx) to dst's,
+// so streams analyzed in separate contexts can share one album gain
+
+void MergeAlbumGain(GainAnalysis *dst, const GainAnalysis *src)
+{
+    size_t  i;
+
+    for (i = 0; i < sizeof(dst->B) / sizeof(*dst->B); i++)
+    {
+        dst->B[i] += src->B[i];
+    }
+}
+
+// adds src's histogram of the current title to dst's, for one title analyzed
+// in pieces; each piece must have covered whole, distinct RMS windows
+
+void MergeTitleGain(GainAnalysis *dst, const GainAnalysis *src)
+{
+    size_t  i;
+
+    for (i = 0; i < sizeof(dst->A) / sizeof(*dst->A); i++)
+    {
+        dst->A[i] += src->A[i];
+    }
+}
+
+// forgets the RMS windows of the current title, including a partial one, but
+// keeps the filter history: the next sample starts a new window
+
+void RestartWindowsCtx(GainAnalysis *ctx)
+{
+    if (ctx->totsamp > 0)
+    {
+        memmove(ctx->loutbuf, ctx->loutbuf  + ctx->totsamp, MAX_ORDER * sizeof(Float_t));
+        memmove(ctx->routbuf, ctx->routbuf  + ctx->totsamp, MAX_ORDER * sizeof(Float_t));
+        memmove(ctx->lstepbuf, ctx->lstepbuf + ctx->totsamp, MAX_ORDER * sizeof(Float_t));
+        memmove(ctx->rstepbuf, ctx->rstepbuf + ctx->totsamp, MAX_ORDER * sizeof(Float_t));
+    }
+    ctx->totsamp = 0;
+    ctx->lsum = ctx->rsum = 0.;
+    memset(ctx->A, 0, sizeof(ctx->A));
+}
+
+// samples per RMS window at the current sample frequency
+
+long WindowSamplesCtx(const GainAnalysis *ctx)
+{
+    return ctx->sampleWindow;
+}
+
+GainAnalysis *CreateGainAnalysis(void)
+{
+    return calloc(1, sizeof(GainAnalysis));
+}
+
+void FreeGainAnalysis(GainAnalysis *ctx)
+{
+    free(ctx);
+}
+
+GainAnalysis *DefaultGainAnalysis(void)
+{
+    return &defaultContext;
+}
+
+// the single-stream interface, on the calling thread's default context
+
+int ResetSampleFrequency(long samplefreq)
+{
+    return ResetSampleFrequencyCtx(&defaultContext, samplefreq);
+}
+
+int InitGainAnalysis(long samplefreq)
+{
+    return InitGainAnalysisCtx(&defaultContext, samplefreq);
+}
+
+int AnalyzeSamples(const Float_t *left_samples, const Float_t *right_samples, size_t num_samples, int num_channels)
+{
+    return AnalyzeSamplesCtx(&defaultContext, left_samples, right_samples, num_samples, num_channels);
+}
+
+Float_t GetTitleGain(void)
+{
+    return GetTitleGainCtx(&defaultContext);
+}
+
 Float_t GetAlbumGain(void)
 {
-    return analyzeResult(B, sizeof(B) / sizeof(*B));
+    return GetAlbumGainCtx(&defaultContext);
 }
 
 /* end of gain_analysis.c */
@@ -38,8 +38,25 @@
 
 typedef double  Float_t;         // Type used for filtering
 
+typedef struct GainAnalysis GainAnalysis;   // state of one analyzed stream
+
 int     InitGainAnalysis(long samplefreq);
 int     AnalyzeSamples(const Float_t *left_samples, const Float_t *right_samples, size_t num_samples, int num_channels);
 int             ResetSampleFrequency(long samplefreq);
 Float_t   GetTitleGain(void);
 Float_t   GetAlbumGain(void);
+
+// The functions above work on a default context of the calling thread.
+// Use these to analyze several streams at once.
+GainAnalysis *CreateGainAnalysis(void);
+void      FreeGainAnalysis(GainAnalysis *ctx);
+GainAnalysis *DefaultGainAnalysis(void);
+int     InitGainAnalysisCtx(GainAnalysis *ctx, long samplefreq);
+int     AnalyzeSamplesCtx(GainAnalysis *ctx, const Float_t *left_samples, const Float_t *right_samples, size_t num_samples, int num_channels);
+int             ResetSampleFrequencyCtx(GainAnalysis *ctx, long samplefreq);
+Float_t   GetTitleGainCtx(GainAnalysis *ctx);
+Float_t   GetAlbumGainCtx(const GainAnalysis *ctx);
+void      MergeAlbumGain(GainAnalysis *dst, const GainAnalysis *src);
+void      MergeTitleGain(GainAnalysis *dst, const GainAnalysis *src);
+void      RestartWindowsCtx(GainAnalysis *ctx);
+long      WindowSamplesCtx(const GainAnalysis *ctx);
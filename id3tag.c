@@ -36,14 +36,24 @@
  * rare case). If the original file had only an ID3v1 tag, it is copied
  * to a new ID3v2 tag and the ID3v1 tag is left as it was.
  *
+ * A new tag that fits in the old one's length is written over it in place.
+ * A tag that has to grow gets gID3Padding bytes of padding beyond its
+ * frames, so that later updates fit in place. Room for it is made with
+ * fallocate(FALLOC_FL_INSERT_RANGE) where the file system supports that;
+ * only otherwise is the whole file copied.
+ *
  * See: http://www.id3.org/id3v2.4.0-structure
  *      http://www.id3.org/id3v2.4.0-frames
  */
 
+#define _GNU_SOURCE     /* fallocate() */
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "apetag.h"
 #include "id3tag.h"
 #include "mp3gain.h"
@@ -63,6 +73,9 @@
 #define FRAMEFL_UNSYNC          (0x0002)
 #define FRAMEFL_DLEN            (0x0001)
 #define SYNCSAFE_INT_BAD        (0xffffffff)
+#define LAZY_FRAME_SIZE         (4096)  /* leave frames this big in the file */
+
+unsigned long gID3Padding = 1024;
 
 struct ID3v2TagStruct
 {
@@ -81,6 +94,22 @@ struct ID3v2FrameStruct
     unsigned long len;                                      /* length of frame, excluding header */
     unsigned long hskip;                            /* length of flag parameters */
     unsigned char *data;                            /* pointer to data, excluding header */
+    unsigned long offset;                           /* file offset of data, if data == NULL */
+    unsigned long outlen;                           /* unsynchronized length, if data == NULL */
+    int unsynced;                                           /* unsynchronization changed the data */
+    int verbatim;                                           /* written as it is in the file, if data == NULL */
+    int in_place;                                           /* left where it is in the file, if data == NULL */
+};
+
+/* Where id3_parse_v2_tag takes the tag bytes from: either the whole tag
+   read into memory, or the file itself, one frame at a time. */
+struct ID3v2TagSource
+{
+    FILE *f;
+    unsigned long base;                                     /* file offset of tag data */
+    unsigned long pos;                                      /* offset in tag data of file position */
+    unsigned char *data;                            /* whole tag data, or NULL */
+    unsigned char buf[10];
 };
 
 struct upgrade_id3v22_struct
@@ -625,9 +654,52 @@ static int id3_decode_mp3gain_frame(const struct ID3v2FrameStruct *frame, struct
     return 0;
 }
 
+/**
+ * Copy n bytes at offset p of the tag data into dest.
+ * Return 1 on success, 0 if the file is too short.
+ */
+static int id3_tag_read(struct ID3v2TagSource *src, unsigned long p, unsigned char *dest, unsigned long n)
+{
+    if (src->data)
+    {
+        memcpy(dest, src->data + p, n);
+        return 1;
+    }
+    if (p != src->pos && fseek(src->f, src->base + p, SEEK_SET))
+    {
+        return 0;
+    }
+    if (fread(dest, 1, n, src->f) != n)
+    {
+        return 0;
+    }
+    src->pos = p + n;
+    return 1;
+}
+
+/**
+ * Return a pointer to n <= 10 bytes at offset p of the tag data,
+ * or NULL if the file is too short. The pointer is valid until the
+ * next call.
+ */
+static const unsigned char *id3_tag_bytes(struct ID3v2TagSource *src, unsigned long p, unsigned long n)
+{
+    if (src->data)
+    {
+        return src->data + p;
+    }
+    return id3_tag_read(src, p, src->buf, n) ? src->buf : NULL;
+}
+
 /**
  * Read an ID3v2 tag from the current position in the MP3 file.
  *
+ * Frames other than RVA2 and TXXX that are LAZY_FRAME_SIZE or bigger
+ * (typically APIC or GEOB) are not read; the file is seeked past them
+ * and they are copied through from the file when the tag is rewritten.
+ * ID3v2.2 tags and unsynchronized ID3v2.3 tags must be decoded as a
+ * whole, so these are read into memory completely.
+ *
  * Return 1 on success, 0 if no tag is found, or a negative error code
  * if the tag can not be processed.
  */
@@ -636,7 +708,8 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
     unsigned char buf[12], frameid[4];
     unsigned int fflags;
     unsigned long dlen, flen, fhskip, p, k;
-    unsigned char *tagdata;
+    const unsigned char *hdr, *pic;
+    struct ID3v2TagSource src;
     struct ID3v2FrameStruct *frame, **pframe;
 
     /* Read header */
@@ -694,17 +767,35 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
 
     DBG(("  version=%04x length=%lu flags=%02x\n", tag->version, tag->length, tag->flags));
 
-    /* Read rest of the tag. */
-    tagdata = malloc(dlen);
-    if (fread(tagdata, 1, dlen, f) != dlen)
+    src.f    = f;
+    src.base = tag->offset + 10;
+    src.pos  = 0;
+    src.data = NULL;
+
+    if ((tag->version >> 8) == 2 || ((tag->version >> 8) == 3 && (tag->flags & TAGFL_UNSYNC) != 0))
     {
-        goto badtag;
-    }
+        /* Read rest of the tag. */
+        src.data = malloc(dlen);
+        if (fread(src.data, 1, dlen, f) != dlen)
+        {
+            goto badtag;
+        }
 
-    /* If this is an unsynced v2.2 or v2.3 tag, decode it now. */
-    if ((tag->version >> 8) != 4 && (tag->flags & TAGFL_UNSYNC) != 0)
+        /* If this is an unsynced v2.2 or v2.3 tag, decode it now. */
+        if ((tag->version >> 8) != 4 && (tag->flags & TAGFL_UNSYNC) != 0)
+        {
+            dlen = id3_get_unsync_data(src.data, src.data, dlen);
+        }
+    }
+    else
     {
-        dlen = id3_get_unsync_data(tagdata, tagdata, dlen);
+        /* Make sure the file holds the whole tag, as the frames
+           we skip are not read now. */
+        if (fseek(f, 0, SEEK_END) || (unsigned long)ftell(f) < src.base + dlen ||
+            fseek(f, src.base, SEEK_SET))
+        {
+            goto badtag;
+        }
     }
 
     /* Skip extended header. */
@@ -712,14 +803,14 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
     if ((tag->flags & TAGFL_EXTHDR) != 0)
     {
         DBG(("  skip extended header\n"));
-        if (p + 6 > dlen)
+        if (p + 6 > dlen || (hdr = id3_tag_bytes(&src, p, 4)) == NULL)
         {
             goto badtag;
         }
         if ((tag->version >> 8) == 4)
         {
             /* Skip ID3v2.4 extended header */
-            k = id3_get_syncsafe_int(tagdata + p);
+            k = id3_get_syncsafe_int(hdr);
             if (k == SYNCSAFE_INT_BAD || k > dlen)
             {
                 goto badtag;
@@ -729,7 +820,7 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
         else if ((tag->version >> 8) == 3)
         {
             /* Skip ID3v2.3 extended header */
-            k = id3_get_int32(tagdata + p);
+            k = id3_get_int32(hdr);
             if (k > dlen)
             {
                 goto badtag;
@@ -740,8 +831,17 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
 
     /* Scan frames. */
     pframe = &(tag->frames);
-    while (p < dlen && tagdata[p] != '\0')
+    while (p < dlen)
     {
+        hdr = id3_tag_bytes(&src, p, dlen - p < 10 ? dlen - p : 10);
+        if (hdr == NULL)
+        {
+            goto badtag;
+        }
+        if (hdr[0] == '\0')
+        {
+            break;
+        }
 
         /* Decode frame header. */
         switch (tag->version >> 8)
@@ -755,13 +855,13 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
             memset(frameid, 0, 4);
             for (k = 0; upgrade_id3v22_table[k].id_new[0]; k++)
             {
-                if (memcmp(tagdata + p, upgrade_id3v22_table[k].id_v22, 3) == 0)
+                if (memcmp(hdr, upgrade_id3v22_table[k].id_v22, 3) == 0)
                 {
                     memcpy(frameid, upgrade_id3v22_table[k].id_new, 4);
                     break;
                 }
             }
-            flen   = (tagdata[p + 3] << 16) | (tagdata[p + 4] << 8) | tagdata[p + 5];
+            flen   = (hdr[3] << 16) | (hdr[4] << 8) | hdr[5];
             fflags = 0;
             if (flen > dlen)
             {
@@ -775,22 +875,22 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
             {
                 goto badtag;
             }
-            memcpy(frameid, tagdata + p, 4);
-            flen   = id3_get_int32(tagdata + p + 4);
-            fflags = (tagdata[p + 8] << 7) & 0xff00;
-            if (tagdata[p + 9] & 0x80)
+            memcpy(frameid, hdr, 4);
+            flen   = id3_get_int32(hdr + 4);
+            fflags = (hdr[8] << 7) & 0xff00;
+            if (hdr[9] & 0x80)
             {
                 fflags |= FRAMEFL_COMPR | FRAMEFL_DLEN;
             }
-            if (tagdata[p + 9] & 0x40)
+            if (hdr[9] & 0x40)
             {
                 fflags |= FRAMEFL_CRYPT;
             }
-            if (tagdata[p + 9] & 0x20)
+            if (hdr[9] & 0x20)
             {
                 fflags |= FRAMEFL_GROUP;
             }
-            if (tagdata[p + 9] & 0x1f)
+            if (hdr[9] & 0x1f)
             {
                 fflags |= FRAMEFL_BAD;
             }
@@ -806,9 +906,9 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
             {
                 goto badtag;
             }
-            memcpy(frameid, tagdata + p, 4);
-            flen   = id3_get_syncsafe_int(tagdata + p + 4);
-            fflags = (tagdata[p + 8] << 8) | tagdata[p + 9];
+            memcpy(frameid, hdr, 4);
+            flen   = id3_get_syncsafe_int(hdr + 4);
+            fflags = (hdr[8] << 8) | hdr[9];
             if (flen == SYNCSAFE_INT_BAD || flen > dlen)
             {
                 goto badtag;
@@ -889,37 +989,55 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
         pframe = &(frame->next);
 
         /* Copy frame data. */
-        if ((tag->version >> 8) == 4 && (fflags & FRAMEFL_UNSYNC) != 0)
+        if (src.data == NULL && flen >= LAZY_FRAME_SIZE &&
+            memcmp(frameid, "RVA2", 4) != 0 &&
+            memcmp(frameid, "TXXX", 4) != 0 &&
+            (fflags & FRAMEFL_DLEN) == 0)
+        {
+            /* We have no use for this frame; leave it in the file. */
+            DBG(("  skip frame data\n"));
+            frame->data = NULL;
+            frame->offset = src.base + p;
+            frame->len = flen;
+            frame->in_place = 0;
+            p += flen;
+        }
+        else if ((tag->version >> 8) == 4 && (fflags & FRAMEFL_UNSYNC) != 0)
         {
             /* This frame is unsynchronized; decode it now. */
             frame->data = malloc(flen);
-            k = id3_get_unsync_data(frame->data, tagdata + p, flen);
+            if (!id3_tag_read(&src, p, frame->data, flen))
+            {
+                goto badtag;
+            }
+            k = id3_get_unsync_data(frame->data, frame->data, flen);
             frame->len = k;
             p += flen;
         }
         else if ((tag->version >> 8) == 2 && memcmp(frameid, "APIC", 4) == 0)
         {
             /* APIC frame format differs from PIC frame format */
+            pic = src.data + p;
             frame->data = malloc(flen + 12);
-            frame->data[0] = tagdata[p];
+            frame->data[0] = pic[0];
             k = 1;
-            if (memcmp(tagdata + p + 1, "PNG", 3) == 0)
+            if (memcmp(pic + 1, "PNG", 3) == 0)
             {
                 memcpy(frame->data + k, "image/png", strlen("image/png") + 1);
                 k += strlen("image/png") + 1;
             }
-            else if (memcmp(tagdata + p + 1, "JPG", 3) == 0)
+            else if (memcmp(pic + 1, "JPG", 3) == 0)
             {
                 memcpy(frame->data + k, "image/jpeg", strlen("image/jpeg") + 1);
                 k += strlen("image/jpeg") + 1;
             }
-            else if (tagdata[p + 1] == '\0')
+            else if (pic[1] == '\0')
             {
-                memcpy(frame->data + k, tagdata + p + 1, 3);
+                memcpy(frame->data + k, pic + 1, 3);
                 frame->data[k + 3] = '\0';
                 k += 4;
             }
-            memcpy(frame->data + k, tagdata + p + 4, flen - 4);
+            memcpy(frame->data + k, pic + 4, flen - 4);
             frame->len = k + flen - 4;
             p += flen;
         }
@@ -927,7 +1045,10 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
         {
             /* Normal case, just copy the data. */
             frame->data = malloc(flen);
-            memcpy(frame->data, tagdata + p, flen);
+            if (!id3_tag_read(&src, p, frame->data, flen))
+            {
+                goto badtag;
+            }
             frame->len = flen;
             p += flen;
         }
@@ -954,30 +1075,161 @@ static int id3_parse_v2_tag(FILE *f, struct ID3v2TagStruct *tag)
         goto badtag;
     }
 
-    free(tagdata);
+    free(src.data);
     return 1;
 
 badtag:
-    free(tagdata);
+    free(src.data);
     id3_release_frames(tag->frames);
     return M3G_ERR_TAGFORMAT;
 }
 
+/**
+ * Copy the data of a frame that was left in the input file inf to the
+ * current position in outf. The frame's own unsynchronization is decoded
+ * and the data are unsynchronized again, as id3_put_unsync_data() does.
+ * Store the number of bytes written in *outlen, whether any bytes
+ * had to be unsynchronized in *unsynced, and whether the bytes written are
+ * the ones in the file in *verbatim.
+ *
+ * If outf == NULL, nothing is written but *outlen, *unsynced and
+ * *verbatim are still computed.
+ *
+ * Return 1 on success, otherwise a negative error code.
+ */
+static int id3_copy_frame(FILE *inf, const struct ID3v2FrameStruct *frame, FILE *outf,
+                          unsigned long *outlen, int *unsynced, int *verbatim)
+{
+    unsigned char in[4096], out[2 * sizeof(in) + 1];
+    unsigned long remaining;
+    size_t n, i, j;
+    int decode, skip, pend, dropped;
+
+    *outlen = 0;
+    *unsynced = 0;
+    *verbatim = 1;
+    if (fseek(inf, frame->offset, SEEK_SET))
+    {
+        return M3G_ERR_READ;
+    }
+
+    decode = (frame->flags & FRAMEFL_UNSYNC) != 0;
+    skip = 0;       /* next 0x00 is the frame's own unsync byte */
+    pend = 0;       /* last byte written was 0xff */
+    dropped = 0;    /* an unsync byte was dropped, and not put back yet */
+    remaining = frame->len;
+    while (remaining > 0)
+    {
+        n = remaining < sizeof(in) ? remaining : sizeof(in);
+        if (fread(in, 1, n, inf) != n)
+        {
+            return M3G_ERR_READ;
+        }
+        remaining -= n;
+
+        j = 0;
+        for (i = 0; i < n; i++)
+        {
+            if (skip && in[i] == 0x00)
+            {
+                skip = 0;
+                dropped = 1;
+                continue;
+            }
+            if (pend && (in[i] == 0x00 || (in[i] & 0xe0) == 0xe0))
+            {
+                out[j++] = 0x00;
+                *unsynced = 1;
+                *verbatim &= dropped;
+            }
+            else if (dropped)
+            {
+                *verbatim = 0;
+            }
+            dropped = 0;
+            out[j++] = in[i];
+            pend = in[i] == 0xff;
+            skip = decode && pend;
+        }
+        if (remaining == 0 && pend)
+        {
+            out[j++] = 0x00;
+            *unsynced = 1;
+            *verbatim &= dropped;
+        }
+
+        if (outf != NULL && fwrite(out, 1, j, outf) != j)
+        {
+            return M3G_ERR_WRITE;
+        }
+        *outlen += j;
+    }
+
+    return 1;
+}
+
+/**
+ * Compute the raw length of the tag as id3_write_tag() writes it,
+ * without padding. Frames that were left in the input file inf are read
+ * to find their unsynchronized length.
+ *
+ * Return the length, or a negative error code.
+ */
+static long id3_measure_tag(FILE *inf, struct ID3v2TagStruct *tag)
+{
+    unsigned long dlen;
+    int ret;
+    struct ID3v2FrameStruct *frame;
+
+    dlen = 10;                              /* tag header */
+    for (frame = tag->frames; frame; frame = frame->next)
+    {
+        dlen += 10;
+        if (frame->data != NULL)
+        {
+            dlen += id3_put_unsync_data(NULL, frame->data, frame->len);
+        }
+        else
+        {
+            ret = id3_copy_frame(inf, frame, NULL, &(frame->outlen), &(frame->unsynced),
+                                 &(frame->verbatim));
+            if (ret < 0)
+            {
+                return ret;
+            }
+            dlen += frame->outlen;
+        }
+    }
+
+    return dlen;
+}
+
 /**
  * Write an ID3v2 tag at the current position in the MP3 file.
  *
  * Tags are always written in ID3v2.4 format.
  * Tags are always written completely unsynchronized,
- * without extended header, padded up to an integer multiple of 2 KB.
- * We don't write a tag footer (not supported by QuodLibet).
+ * without extended header. We don't write a tag footer
+ * (not supported by QuodLibet).
+ *
+ * dlen is the length from id3_measure_tag(). If the frames fit in minlen
+ * bytes the tag is padded to exactly minlen, so that it can replace an
+ * old tag of that length. Otherwise it is padded with at least
+ * gID3Padding bytes, up to minlen plus a multiple of align.
+ *
+ * Frames that were left in the input file inf are copied through from
+ * there, except that the data of in_place frames is not written at all.
  *
  * Return 1 on success, 0 if the tag contains no frames,
  * or a negative error code.
  */
-static int id3_write_tag(FILE *f, struct ID3v2TagStruct *tag)
+static int id3_write_tag(FILE *inf, FILE *f, struct ID3v2TagStruct *tag, unsigned long dlen,
+                         unsigned long minlen, unsigned long align)
 {
-    unsigned long dlen, p, k;
-    unsigned char *tagdata;
+    unsigned long k, pad;
+    unsigned char hdr[10];
+    unsigned char *fdata;
+    int ret, verbatim;
     struct ID3v2FrameStruct *frame;
 
     DBG(("DEBUG: Writing ID3v2 tag\n"));
@@ -988,56 +1240,82 @@ static int id3_write_tag(FILE *f, struct ID3v2TagStruct *tag)
         return 0;
     }
 
-    /* Compute raw total length of tag. */
-    dlen = 10;                              /* tag header */
-    for (frame = tag->frames; frame; frame = frame->next)
+    /* Padding */
+    if (dlen <= minlen)
     {
-        dlen += 10;
-        dlen += id3_put_unsync_data(NULL, frame->data, frame->len);
+        pad = minlen - dlen;
+    }
+    else
+    {
+        pad = minlen + (dlen + gID3Padding - minlen + align - 1) / align * align - dlen;
     }
-    dlen = (dlen + 2047) & (~2047);         /* padding */
-
-    DBG(("  length=%lu\n", dlen));
 
-    /* Allocate buffer and fill with zeros. */
-    tagdata = calloc(dlen, sizeof(unsigned char));
+    DBG(("  length=%lu\n", dlen + pad));
 
-    /* Prepare tag header. */
-    tagdata[0] = 'I';
-    tagdata[1] = 'D';
-    tagdata[2] = '3';
-    tagdata[3] = 4;
-    tagdata[4] = 0;
-    tagdata[5] = TAGFL_UNSYNC | (tag->flags & TAGFL_EXPR);
-    id3_put_syncsafe_int(tagdata + 6, dlen - 10);
-    p = 10;
+    /* Write tag header. */
+    hdr[0] = 'I';
+    hdr[1] = 'D';
+    hdr[2] = '3';
+    hdr[3] = 4;
+    hdr[4] = 0;
+    hdr[5] = TAGFL_UNSYNC | (tag->flags & TAGFL_EXPR);
+    id3_put_syncsafe_int(hdr + 6, dlen + pad - 10);
+    if (fwrite(hdr, 1, 10, f) != 10)
+    {
+        return M3G_ERR_WRITE;
+    }
 
-    /* Prepare frames. */
+    /* Write frames. */
     for (frame = tag->frames; frame; frame = frame->next)
     {
         unsigned long fflags = frame->flags & (~FRAMEFL_UNSYNC);
-        memcpy(tagdata + p, frame->frameid, 4);
-        k = id3_put_unsync_data(tagdata + p + 10, frame->data, frame->len);
-        id3_put_syncsafe_int(tagdata + p + 4, k);
-        if (k != frame->len)
+        memcpy(hdr, frame->frameid, 4);
+        if (frame->data != NULL)
         {
-            fflags |= FRAMEFL_UNSYNC;
+            k = id3_put_unsync_data(NULL, frame->data, frame->len);
+            fdata = malloc(k + 1);
+            id3_put_unsync_data(fdata, frame->data, frame->len);
+            if (k != frame->len)
+            {
+                fflags |= FRAMEFL_UNSYNC;
+            }
+        }
+        else
+        {
+            fdata = NULL;
+            k = frame->outlen;
+            if (frame->unsynced)
+            {
+                fflags |= FRAMEFL_UNSYNC;
+            }
+        }
+        id3_put_syncsafe_int(hdr + 4, k);
+        hdr[8] = (fflags >> 8) & 0xff;
+        hdr[9] = fflags & 0xff;
+        ret = fwrite(hdr, 1, 10, f) == 10 ? 1 : M3G_ERR_WRITE;
+        if (ret == 1 && fdata != NULL)
+        {
+            ret = fwrite(fdata, 1, k, f) == k ? 1 : M3G_ERR_WRITE;
+        }
+        else if (ret == 1 && !frame->in_place)
+        {
+            /* Frame left in the input file; copy it from there. */
+            ret = id3_copy_frame(inf, frame, f, &k, &(frame->unsynced), &verbatim);
+        }
+        free(fdata);
+        if (ret < 0)
+        {
+            return ret;
         }
-        tagdata[p + 8] = (fflags >> 8) & 0xff;
-        tagdata[p + 9] = fflags & 0xff;
-        p += 10 + k;
         DBG(("  write frameid=%.4s length=%lu\n", frame->frameid, 10 + k));
     }
 
-    /* Write the whole thing. */
-    if (fwrite(tagdata, 1, dlen, f) != dlen)
-    {
-        free(tagdata);
-        return M3G_ERR_WRITE;
-    }
+    /* Write padding. */
+    fdata = calloc(pad + 1, sizeof(unsigned char));
+    ret = fwrite(fdata, 1, pad, f) == pad ? 1 : M3G_ERR_WRITE;
+    free(fdata);
 
-    free(tagdata);
-    return 1;
+    return ret;
 }
 
 /**
@@ -1323,6 +1601,170 @@ static int id3_copy_data(FILE *inf, FILE *outf, long offset, long count)
     return ret;
 }
 
+/**
+ * Write the tag over the first oldlen bytes of the file f. If it does not
+ * fit there, first insert room for it at the start of the file.
+ *
+ * When it fits, frames that were left in the file and would be written
+ * unchanged at the same offset stay where they are, and of the rest only
+ * the bytes from the first to the last one that differ from the file are
+ * written. So updating the ReplayGain frames of a tag with a big picture
+ * reads the picture once, and neither copies nor writes it.
+ *
+ * Return 1 if the tag was written in place, 2 if room was inserted for it,
+ * 0 if the file has to be copied instead, or a negative error code.
+ */
+static int id3_write_tag_in_place(const char *filename, FILE *f, struct ID3v2TagStruct *tag,
+                                  unsigned long oldlen)
+{
+    struct stat st;
+    struct ID3v2FrameStruct *frame;
+    struct fileRange *ranges;
+    unsigned char *old;
+    char *tagdata = NULL;
+    size_t len = 0;
+    FILE *mem;
+    unsigned long pos, run, end, c, a, b;
+    long dlen;
+    int nstay = 0;
+    int nranges = 0;
+    int ret;
+
+    if (fstat(fileno(f), &st))
+    {
+        return 0;
+    }
+    dlen = id3_measure_tag(f, tag);
+    if (dlen < 0)
+    {
+        return dlen;
+    }
+
+    /* Frames that stay, when the tag fits. */
+    pos = 10;
+    for (frame = tag->frames; frame; frame = frame->next)
+    {
+        if (frame->data == NULL)
+        {
+            frame->in_place = (unsigned long)dlen <= oldlen && frame->verbatim &&
+                              frame->offset == pos + 10;
+            nstay += frame->in_place;
+            pos += 10 + frame->outlen;
+        }
+        else
+        {
+            pos += 10 + id3_put_unsync_data(NULL, frame->data, frame->len);
+        }
+    }
+
+    /* Inserted room must be a whole number of file system blocks. */
+    ret = 0;
+    if ((mem = open_memstream(&tagdata, &len)) != NULL)
+    {
+        ret = id3_write_tag(f, mem, tag, dlen, oldlen, st.st_blksize > 0 ? st.st_blksize : 4096);
+        fclose(mem);
+    }
+
+    /* The runs of tag bytes between the frames that stay, trimmed to the
+       bytes that differ from the file. */
+    ranges = malloc(sizeof(*ranges) * (nstay + 1));
+    if (ret > 0 && len > oldlen)
+    {
+        ranges[nranges].offset = 0;
+        ranges[nranges].data = (unsigned char *)tagdata;
+        ranges[nranges++].len = len;
+    }
+    else if (ret > 0)
+    {
+        frame = tag->frames;
+        run = 0;    /* offset in the file */
+        c = 0;      /* offset in tagdata, which lacks the frames that stay */
+        while (ret > 0 && run < oldlen)
+        {
+            /* up to the data of the next frame that stays, or the end */
+            while (frame != NULL && !(frame->data == NULL && frame->in_place))
+            {
+                frame = frame->next;
+            }
+            end = frame != NULL ? frame->offset : oldlen;
+
+            old = malloc(end - run + 1);
+            if (pread(fileno(f), old, end - run, run) != (ssize_t)(end - run))
+            {
+                ret = M3G_ERR_READ;
+            }
+            else
+            {
+                for (a = 0; a < end - run && old[a] == (unsigned char)tagdata[c + a]; a++)
+                {
+                }
+                for (b = end - run; b > a && old[b - 1] == (unsigned char)tagdata[c + b - 1]; b--)
+                {
+                }
+                if (a < b)
+                {
+                    ranges[nranges].offset = run + a;
+                    ranges[nranges].data = (unsigned char *)tagdata + c + a;
+                    ranges[nranges++].len = b - a;
+                }
+            }
+            free(old);
+
+            c += end - run;
+            run = end;
+            if (frame != NULL)
+            {
+                run += frame->outlen;
+                frame = frame->next;
+            }
+        }
+    }
+
+    /* Neither the insert nor the write is atomic, so the changes are
+       journaled first; without a journal the caller copies the file. */
+    if (ret > 0 && nranges > 0 &&
+        !journalTagWrite(filename, st.st_size, st.st_size + (len > oldlen ? len - oldlen : 0),
+                         ranges, nranges))
+    {
+        ret = 0;
+    }
+    if (ret > 0 && len > oldlen)
+    {
+#ifdef FALLOC_FL_INSERT_RANGE
+        ret = fallocate(fileno(f), FALLOC_FL_INSERT_RANGE, 0, len - oldlen) ? 0 : 2;
+#else
+        ret = 0;
+#endif
+        if (ret == 0)
+        {
+            endTagJournal(filename, -1);    /* nothing was changed */
+        }
+    }
+    for (int i = 0; ret > 0 && i < nranges; i++)
+    {
+        if (pwrite(fileno(f), ranges[i].data, ranges[i].len, ranges[i].offset) != (ssize_t)ranges[i].len)
+        {
+            ret = M3G_ERR_WRITE;    /* the journal stays, for the next run */
+        }
+    }
+    if (ret > 0 && nranges > 0)
+    {
+        endTagJournal(filename, fileno(f));
+    }
+
+    if (ret == 0)
+    {
+        /* the copy writes every frame */
+        for (frame = tag->frames; frame; frame = frame->next)
+        {
+            frame->in_place = 0;
+        }
+    }
+    free(ranges);
+    free(tagdata);
+    return ret;
+}
+
 /**
  * Read gain information from an ID3v2 tag.
  */
@@ -1333,7 +1775,7 @@ int ReadMP3GainID3Tag(const char *filename, struct MP3GainTagInfo *info)
     struct ID3v2FrameStruct *frame;
     int ret;
 
-    f = fopen(filename, "rb");
+    f = openFile(filename, "rb");
     if (f == NULL)
     {
         passError(2, "Could not open ", filename);
@@ -1341,7 +1783,7 @@ int ReadMP3GainID3Tag(const char *filename, struct MP3GainTagInfo *info)
     }
 
     ret = id3_search_tag(f, &tag);
-    fclose(f);
+    closeFile(f);
 
     if (ret == M3G_ERR_READ)
     {
@@ -1373,9 +1815,12 @@ int ReadMP3GainID3Tag(const char *filename, struct MP3GainTagInfo *info)
  * copying basic fields from an ID3v1 tag if present.
  * If the file contains an ID3v2.2 or ID3v2.3 tag, it is rewritten as ID3v2.4.
  *
- * Since modifications are made at the beginning of the file, the entire
- * file is rewritten to a temporary file and then moved in place of the
- * old file.
+ * Since modifications are made at the beginning of the file, the new tag
+ * is written in place only if it fits in the old one, or if room can be
+ * inserted for it, and it is journaled first so that an interrupted write
+ * is completed by the next run. A tag written over the old one only
+ * writes the bytes that change. Otherwise the entire file is rewritten to
+ * a temporary file and then moved in place of the old file.
  */
 int WriteMP3GainID3Tag(const char *filename,
                        struct MP3GainTagInfo *info,
@@ -1386,14 +1831,20 @@ int WriteMP3GainID3Tag(const char *filename,
     FILE *f, *outf;
     struct ID3v2TagStruct tag;
     struct ID3v2FrameStruct *frame, **pframe;
-    int ret, need_update;
+    long dlen;
+    int ret, need_update, writable;
 
     if (saveTimeStamp)
     {
         fileTime(filename, storeTime);
     }
 
-    f = fopen(filename, "rb");
+    f = openFile(filename, "r+b");
+    writable = f != NULL;
+    if (f == NULL)
+    {
+        f = openFile(filename, "rb");
+    }
     if (f == NULL)
     {
         passError(2, "Could not open ", filename);
@@ -1414,7 +1865,7 @@ int WriteMP3GainID3Tag(const char *filename,
     if (ret < 0)
     {
         /* Error. */
-        fclose(f);
+        closeFile(f);
         return ret;
     }
 
@@ -1532,11 +1983,35 @@ int WriteMP3GainID3Tag(const char *filename,
     if (!need_update)
     {
         /* No need to change MP3 file. */
-        fclose(f);
+        closeFile(f);
         id3_release_frames(tag.frames);
         return 0;
     }
 
+    /* Write the new tag over the old one at the start of the file,
+       or in room inserted there for it. */
+    if (writable && (tag.version == 0 || tag.offset == 0))
+    {
+        ret = id3_write_tag_in_place(filename, f, &tag, tag.version == 0 ? 0 : tag.length);
+        if (ret != 0)
+        {
+            closeFile(f);
+            id3_release_frames(tag.frames);
+            if (ret < 0)
+            {
+                passError(2, "Error writing ", filename);
+                return ret;
+            }
+            statsLine("%s: ID3v2 tag written %s\n", filename,
+                      ret == 1 ? "in place" : "in inserted blocks");
+            if (saveTimeStamp)
+            {
+                fileTime(filename, setStoredTime);
+            }
+            return 1;
+        }
+    }
+
     /* Create temporary file. */
     tmpfilename = malloc(strlen(filename) + 5);
     strcpy(tmpfilename, filename);
@@ -1545,14 +2020,15 @@ int WriteMP3GainID3Tag(const char *filename,
     if (outf == NULL)
     {
         passError(2, "Cannot create temporary file ", tmpfilename);
-        fclose(f);
+        closeFile(f);
         free(tmpfilename);
         id3_release_frames(tag.frames);
         return M3G_ERR_CANT_MAKE_TMP;
     }
 
     /* Write new ID3v2 tag. */
-    ret = id3_write_tag(outf, &tag);
+    dlen = id3_measure_tag(f, &tag);
+    ret = dlen < 0 ? dlen : id3_write_tag(f, outf, &tag, dlen, 0, 2048);
 
     /* Write rest of MP3 file. */
     if (ret >= 0)
@@ -1575,7 +2051,7 @@ int WriteMP3GainID3Tag(const char *filename,
     }
 
     fclose(outf);
-    fclose(f);
+    closeFile(f);
     id3_release_frames(tag.frames);
 
     switch (ret)
@@ -1598,7 +2074,7 @@ int WriteMP3GainID3Tag(const char *filename,
 
     /* Replace original file. */
     ret = 1;
-    if (rename(tmpfilename, filename))
+    if (replaceFile(tmpfilename, filename))
     {
         remove(tmpfilename);
         passError(4, "Cannot rename ", tmpfilename, " to ", filename);
@@ -1606,6 +2082,7 @@ int WriteMP3GainID3Tag(const char *filename,
     }
     else
     {
+        statsLine("%s: ID3v2 tag written by copying the file\n", filename);
         if (saveTimeStamp)
         {
             fileTime(filename, setStoredTime);
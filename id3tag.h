@@ -1,5 +1,8 @@
 #pragma once
 
+/* Padding left for later updates when an ID3v2 tag has to grow */
+extern unsigned long gID3Padding;
+
 int ReadMP3GainID3Tag(const char *filename, struct MP3GainTagInfo *info);
 
 int WriteMP3GainID3Tag(const char *filename, struct MP3GainTagInfo *info,
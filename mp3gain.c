@@ -33,25 +33,57 @@
  *  Additional tweaks by Artur Polaczynski, Mark Armbrust, and others
  */
 
+#define _GNU_SOURCE     /* copy_file_range() */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <math.h>
 #include "apetag.h"
 #include "id3tag.h"
 #include <sys/stat.h>
-#include <utime.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "mpglibDBL_interface.h"
+#include "mpglibDBL_VbrTag.h"
 #include "gain_analysis.h"
 #include "mp3gain.h"
 
 #define HEADERSIZE 4
+#define SIDEINFO_MAX 40     /* header, CRC and side info, and a byte to spare */
+#define LAME_EXT_SIZE 36    /* encoder version through the tag CRC */
+#define XING_HEADER_MAX 156 /* side info and a Xing header with every field */
+#define XING_PROBE 4096     /* read to find the first frame of a file */
 
 #define BUFFERSIZE 3000000
 #define WRITEBUFFERSIZE 100000
+#define WRITE_GAP 4096      /* patches closer than this are written as one run */
+#define WRITE_IOVECS 256
+
+#define JOURNAL_SUFFIX ".mp3gain-journal"
+#define JOURNAL_MAGIC "MP3GJNL1"
+#define JOURNAL_HEADER 16   /* magic, size of the file */
+#define JOURNAL_RECORD 12   /* offset, old bytes, new bytes */
+#define JOURNAL_LAST 1      /* flag of the batch that completes a change */
+#define TAG_JOURNAL_MAGIC "MP3GTAG1"
+#define TAG_JOURNAL_HEADER 32   /* magic, old and new size of the file, number of ranges */
+#define TAG_JOURNAL_RANGE  16   /* offset and length, followed by the bytes */
+
+#define INDEX_SUFFIX ".mp3gain-index"
+#define INDEX_MAGIC "MP3GIDX1"
+#define INDEX_HEADER 48     /* magic, size and mtime of the file, frames, hash */
+#define INDEX_ENTRY 18      /* offset, gain fields, CRC length, bit positions */
+#define INDEX_HASH_SEED 14695981039346656037u
 
 #define FULL_RECALC 1
 #define AMP_RECALC 2
@@ -61,18 +93,56 @@ typedef struct
 {
     unsigned long fileposition;
     unsigned char val[2];
+    unsigned char old[2];
 } wbuffer;
 
-static wbuffer writebuffer[WRITEBUFFERSIZE];
-static unsigned long writebuffercnt;
-static unsigned char buffer[BUFFERSIZE];
+/* where the global_gain fields of a frame are, for --index */
+typedef struct
+{
+    unsigned long offset;
+    unsigned char ngains;
+    unsigned char crclen;       /* bytes covered by the CRC, 0 if none */
+    unsigned short bitpos[4];   /* from the start of the frame */
+} frameIndex;
+
+/* State of the file being read or written.  Each -j worker thread handles
+   its own file, so all of this is per thread. */
+static _Thread_local wbuffer *writebuffer;
+static _Thread_local unsigned long writebuffercnt;
+static _Thread_local unsigned char *buffer;        /* readbuffer or mapping */
+static _Thread_local unsigned char *readbuffer;
+static _Thread_local unsigned char *mapping;
+static _Thread_local size_t mappingSize;
+static _Thread_local bool gNowWriting = false;
+static _Thread_local double lastfreq = -1.0;
+static _Thread_local int firstAnalysis = 1;
+static _Thread_local bool gBadLayer = false;
+static _Thread_local int LayerSet = 0;
+static _Thread_local long inbuffer;
+static _Thread_local unsigned long bitidx;
+static _Thread_local unsigned char *wrdpntr;
+static _Thread_local unsigned char *curframe;
+static _Thread_local const char *curfilename;
+static _Thread_local FILE *inf;
+static _Thread_local FILE *outf;
+static _Thread_local unsigned long filepos;
+static _Thread_local unsigned long audioEnd;    /* where the trailing tags start */
+static _Thread_local const struct FileTagsStruct *curTags;  /* as main() read them */
+static _Thread_local int journalfd = -1;
+static _Thread_local char *journalName;
+static _Thread_local bool journalOk;
+static _Thread_local unsigned long statPatches;
+static _Thread_local unsigned long statWrites;
+static _Thread_local frameIndex *indexEntries;
+static _Thread_local unsigned long indexCount;
+static _Thread_local unsigned long indexAlloc;
+static _Thread_local bool analysisIndexed;
+static _Thread_local struct stat analysisStat;
+static _Thread_local uint64_t analysisHash;
+
 static bool gQuiet = false;
 static bool gUsingTemp = false;
-static bool gNowWriting = false;
-static double lastfreq = -1.0;
 static int whichChannel = 0;
-static bool gBadLayer = false;
-static int LayerSet = 0;
 static int Reckless = 0;
 static int wrapGain = 0;
 static int undoChanges = 0;
@@ -82,17 +152,37 @@ static bool gForceRecalculateTag = false;
 static bool gForceUpdateTag = false;
 static bool gCheckTagOnly = false;
 static bool gUseId3 = false;
-static bool gSuccess;
-static long inbuffer;
-static unsigned long bitidx;
-static unsigned char *wrdpntr;
-static unsigned char *curframe;
-static const char *curfilename;
-static FILE *inf;
-static FILE *outf;
+static atomic_bool gSuccess;
 static bool gSaveTime;
-static unsigned long filepos;
 static const char *gProgramName;
+static int gJobs = 1;
+static int gBlocks = 1;
+static bool gStats = false;
+static bool gUseIndex = false;
+static bool gVerifyCrc = false;
+static bool gLameTag = false;
+static atomic_int lameTagFiles;     /* files analyzed from their LAME tag */
+
+static int ignoreClipWarning = 0;
+static int autoClip = 0;
+static bool applyTrack = false;
+static bool applyAlbum = false;
+static int analysisTrack = 0;
+static int databaseFormat = 0;
+static bool directGain = false;
+static bool directSingleChannelGain = false;
+static int directGainVal = 0;
+static int mp3GainMod = 0;
+static double dBGainMod = 0;
+static int albumRecalc;
+static int albumGainChange;
+
+/* per-file results, indexed like argv */
+static char **fileNames;
+static int *fileok;
+static struct MP3GainTagInfo *tagInfo;
+static struct FileTagsStruct *fileTags;
+static long *fileFrames;    /* estimateFrames(), 0 if not known */
 
 static const double bitrate[4][16] =
 {
@@ -110,29 +200,498 @@ static const double frequency[4][4] =
     {   44.1, 48, 32,  1 }
 };
 
-static long arrbytesinframe[16];
+static _Thread_local long arrbytesinframe[16];
+
+static int compareWriteBuff(const void *a, const void *b)
+{
+    unsigned long posa = ((const wbuffer *)a)->fileposition;
+    unsigned long posb = ((const wbuffer *)b)->fileposition;
+
+    return posa < posb ? -1 : posa > posb;
+}
+
+/* the bytes at file offset pos, if they are still in memory */
+static const unsigned char *bytesInMemory(unsigned long pos, unsigned long len)
+{
+    if (mapping != NULL)
+    {
+        return pos + len <= mappingSize ? mapping + pos : NULL;
+    }
+    if (pos >= filepos - inbuffer && pos + len <= filepos)
+    {
+        return buffer + (pos - (filepos - inbuffer));
+    }
+    return NULL;
+}
+
+static void addIovec(struct iovec *iov, int *iovcnt, const unsigned char *p, size_t len)
+{
+    struct iovec *last = iov + *iovcnt - 1;
+
+    if (*iovcnt > 0 && (const unsigned char *)last->iov_base + last->iov_len == p)
+    {
+        last->iov_len += len;
+    }
+    else
+    {
+        iov[*iovcnt].iov_base = (void *)p;
+        iov[*iovcnt].iov_len = len;
+        (*iovcnt)++;
+    }
+}
+
+static bool writeRun(struct iovec *iov, int iovcnt, unsigned long pos)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t written = pwritev(fileno(gUsingTemp ? outf : inf), iov, iovcnt, (off_t)pos);
+
+        statWrites++;
+        if (written <= 0)
+        {
+            return false;
+        }
+        pos += written;
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/*
+ * In-place changes are journaled.  Before a batch of patches reaches the
+ * file, the old and new bytes of each are appended to <file>.mp3gain-journal
+ * and synced.  Once the whole file is patched and synced the journal is
+ * removed.  If mp3gain is killed in between, the next run finds the journal
+ * and rolls the change back, or completes it if its last batch was
+ * journaled.  Every batch carries a checksum, so a batch cut short by the
+ * crash (whose patches were never applied) is ignored.
+ */
+static void putLE(unsigned char *p, uint64_t val, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        p[i] = (unsigned char)(val >> (8 * i));
+    }
+}
+
+static uint64_t getLE(const unsigned char *p, int bytes)
+{
+    uint64_t val = 0;
+
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        val = (val << 8) | p[i];
+    }
+    return val;
+}
+
+static uint64_t getBE(const unsigned char *p, int bytes)
+{
+    uint64_t val = 0;
+
+    for (int i = 0; i < bytes; i++)
+    {
+        val = (val << 8) | p[i];
+    }
+    return val;
+}
+
+static uint32_t journalChecksum(const unsigned char *p, size_t len)
+{
+    uint32_t hash = 2166136261u;   /* FNV-1a */
+
+    while (len--)
+    {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+    return hash;
+}
+
+static char *sidecarFileName(const char *filename, const char *suffix)
+{
+    char *name = malloc(strlen(filename) + strlen(suffix) + 1);
+
+    strcpy(name, filename);
+    strcat(name, suffix);
+    return name;
+}
+
+static void openJournal(const char *filename, unsigned long filesize)
+{
+    unsigned char header[JOURNAL_HEADER];
+
+    journalName = sidecarFileName(filename, JOURNAL_SUFFIX);
+    journalfd = open(journalName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    memcpy(header, JOURNAL_MAGIC, 8);
+    putLE(header + 8, filesize, 8);
+    journalOk = journalfd >= 0 && write(journalfd, header, sizeof(header)) == sizeof(header);
+    if (!journalOk)
+    {
+        fprintf(stderr, "%s: can't write %s, changing %s without a journal\n",
+                gProgramName, journalName, filename);
+        if (journalfd >= 0)
+        {
+            close(journalfd);
+            unlink(journalName);
+        }
+        journalfd = -1;
+        free(journalName);
+        journalName = NULL;
+    }
+}
+
+/* append the patches in writebuffer to the journal and sync it */
+static bool journalBatch(bool last)
+{
+    size_t len = 8 + writebuffercnt * JOURNAL_RECORD + 4;
+    unsigned char *batch = malloc(len);
+    unsigned char *p = batch + 8;
+
+    putLE(batch, writebuffercnt, 4);
+    putLE(batch + 4, last ? JOURNAL_LAST : 0, 4);
+    for (unsigned long i = 0; i < writebuffercnt; i++, p += JOURNAL_RECORD)
+    {
+        putLE(p, writebuffer[i].fileposition, 8);
+        memcpy(p + 8, writebuffer[i].old, 2);
+        memcpy(p + 10, writebuffer[i].val, 2);
+    }
+    putLE(p, journalChecksum(batch, len - 4), 4);
+
+    if (journalOk && (write(journalfd, batch, len) != (ssize_t)len || fsync(journalfd) != 0))
+    {
+        passError(3, "Can't write the journal, stopped changing ", curfilename,
+                  "\nThe next run will roll back what was changed\n");
+        journalOk = false;
+    }
+    free(batch);
+    return journalOk;
+}
+
+/* the change is complete: sync the file, then drop the journal */
+static void closeJournal(void)
+{
+    if (journalfd < 0)
+    {
+        return;
+    }
+    close(journalfd);
+    journalfd = -1;
+    if (journalOk && fsync(fileno(inf)) == 0)
+    {
+        unlink(journalName);
+    }
+    free(journalName);
+    journalName = NULL;
+}
+
+/*
+ * A tag written over the start of the file is journaled: the size of the
+ * file before and after (room may be inserted for the tag) and the ranges
+ * of tag bytes that change go to the same <file>.mp3gain-journal, and are
+ * synced before the file is touched.  An interrupted write is always
+ * completed: if the file has the new size, the ranges are written again.
+ * If it still has the old size, no room was inserted yet and the old tag
+ * is intact.
+ */
+bool journalTagWrite(const char *filename, unsigned long oldsize, unsigned long newsize,
+                     const struct fileRange *ranges, int nranges)
+{
+    char *name = sidecarFileName(filename, JOURNAL_SUFFIX);
+    size_t total = TAG_JOURNAL_HEADER + 4;
+    unsigned char *journal;
+    unsigned char *p;
+    int fd;
+    bool ok;
+
+    for (int i = 0; i < nranges; i++)
+    {
+        total += TAG_JOURNAL_RANGE + ranges[i].len;
+    }
+    journal = malloc(total);
+    memcpy(journal, TAG_JOURNAL_MAGIC, 8);
+    putLE(journal + 8, oldsize, 8);
+    putLE(journal + 16, newsize, 8);
+    putLE(journal + 24, nranges, 8);
+    p = journal + TAG_JOURNAL_HEADER;
+    for (int i = 0; i < nranges; i++)
+    {
+        putLE(p, ranges[i].offset, 8);
+        putLE(p + 8, ranges[i].len, 8);
+        memcpy(p + TAG_JOURNAL_RANGE, ranges[i].data, ranges[i].len);
+        p += TAG_JOURNAL_RANGE + ranges[i].len;
+    }
+    putLE(journal + total - 4, journalChecksum(journal, total - 4), 4);
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 && write(fd, journal, total) == (ssize_t)total && fsync(fd) == 0;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (!ok)
+    {
+        unlink(name);
+    }
+    free(journal);
+    free(name);
+    return ok;
+}
+
+/* The tag write journaled by journalTagWrite() is complete, or never
+   started: sync the file (if fd >= 0) and drop the journal */
+void endTagJournal(const char *filename, int fd)
+{
+    char *name = sidecarFileName(filename, JOURNAL_SUFFIX);
+
+    if (fd < 0 || fsync(fd) == 0)
+    {
+        unlink(name);
+    }
+    free(name);
+}
+
+static bool recoverTagJournal(const char *filename, const unsigned char *journal,
+                              size_t size, unsigned long filesize, bool *completed)
+{
+    uint64_t nranges = size >= TAG_JOURNAL_HEADER + 4 ? getLE(journal + 24, 8) : 0;
+    size_t pos = TAG_JOURNAL_HEADER;
+    int fd;
+    bool ok = true;
+
+    *completed = false;
+    for (uint64_t i = 0; i < nranges && pos + TAG_JOURNAL_RANGE <= size; i++)
+    {
+        pos += TAG_JOURNAL_RANGE + getLE(journal + pos + 8, 8);
+    }
+    if (size < TAG_JOURNAL_HEADER + 4 || pos != size - 4 ||
+        getLE(journal + size - 4, 4) != journalChecksum(journal, size - 4))
+    {
+        return true;    /* cut short, so the file was never touched */
+    }
+    if (getLE(journal + 16, 8) != filesize)
+    {
+        /* the old size: no room was inserted, the old tag is still there */
+        return getLE(journal + 8, 8) == filesize;
+    }
+
+    fd = open(filename, O_WRONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    pos = TAG_JOURNAL_HEADER;
+    for (uint64_t i = 0; i < nranges; i++)
+    {
+        uint64_t offset = getLE(journal + pos, 8);
+        uint64_t len = getLE(journal + pos + 8, 8);
+
+        ok = pwrite(fd, journal + pos + TAG_JOURNAL_RANGE, len, offset) == (ssize_t)len && ok;
+        pos += TAG_JOURNAL_RANGE + len;
+    }
+    ok = fsync(fd) == 0 && ok;
+    close(fd);
+    *completed = true;
+    return ok;
+}
+
+/* finish or undo a change that was interrupted, before the file is read */
+static void recoverJournal(const char *filename)
+{
+    char *name = sidecarFileName(filename, JOURNAL_SUFFIX);
+    int fd = open(name, O_RDONLY);
+    unsigned char *journal = NULL;
+    struct stat st, filest;
+    size_t pos = JOURNAL_HEADER;
+    size_t nbatches = 0;
+    size_t *batches = NULL;
+    bool last = false;
+    bool ok = true;
+    bool loaded;
+    bool completed;
+    int filefd;
+
+    if (fd < 0)
+    {
+        free(name);
+        return;
+    }
+    loaded = fstat(fd, &st) == 0 && stat(filename, &filest) == 0 &&
+             st.st_size >= JOURNAL_HEADER && (journal = malloc(st.st_size)) != NULL &&
+             read(fd, journal, st.st_size) == st.st_size;
+    close(fd);
+
+    if (loaded && memcmp(journal, TAG_JOURNAL_MAGIC, 8) == 0)
+    {
+        if (recoverTagJournal(filename, journal, st.st_size, filest.st_size, &completed))
+        {
+            unlink(name);
+            if (completed)
+            {
+                fprintf(stderr, "%s: completed an interrupted tag update of %s\n",
+                        gProgramName, filename);
+            }
+        }
+        else
+        {
+            passError(3, "Can't recover an interrupted tag update of ", filename, "\n");
+        }
+        free(journal);
+        free(name);
+        return;
+    }
+    if (!loaded || memcmp(journal, JOURNAL_MAGIC, 8) != 0 ||
+        getLE(journal + 8, 8) != (uint64_t)filest.st_size)
+    {
+        fprintf(stderr, "%s: %s does not match %s, leaving both alone\n",
+                gProgramName, name, filename);
+        free(journal);
+        free(name);
+        return;
+    }
+
+    /* the batches that made it to disk whole */
+    batches = malloc(sizeof(*batches) * (st.st_size / (8 + 4) + 1));
+    while (pos + 8 + 4 <= (size_t)st.st_size && !last)
+    {
+        uint64_t count = getLE(journal + pos, 4);
+        size_t len = 8 + count * JOURNAL_RECORD + 4;
+
+        if (pos + len > (size_t)st.st_size ||
+            getLE(journal + pos + len - 4, 4) != journalChecksum(journal + pos, len - 4))
+        {
+            break;
+        }
+        batches[nbatches++] = pos;
+        last = getLE(journal + pos + 4, 4) & JOURNAL_LAST;
+        pos += len;
+    }
+
+    filefd = open(filename, O_WRONLY);
+    if (filefd < 0)
+    {
+        passError(3, "Can't open ", filename, " to recover an interrupted change\n");
+        free(batches);
+        free(journal);
+        free(name);
+        return;
+    }
+
+    /* complete in order, or undo from the last patch back */
+    for (size_t b = 0; b < nbatches && ok; b++)
+    {
+        size_t batch = batches[last ? b : nbatches - 1 - b];
+        uint64_t count = getLE(journal + batch, 4);
+
+        for (uint64_t i = 0; i < count && ok; i++)
+        {
+            const unsigned char *rec = journal + batch + 8 +
+                                       (last ? i : count - 1 - i) * JOURNAL_RECORD;
+            uint64_t offset = getLE(rec, 8);
+
+            ok = offset + 2 > (uint64_t)filest.st_size ||
+                 pwrite(filefd, rec + (last ? 10 : 8), 2, (off_t)offset) == 2;
+        }
+    }
+    ok = fsync(filefd) == 0 && ok;
+    close(filefd);
+
+    if (ok)
+    {
+        unlink(name);
+        fprintf(stderr, "%s: %s an interrupted gain change to %s\n",
+                gProgramName, last ? "completed" : "rolled back", filename);
+    }
+    else
+    {
+        passError(3, "Can't recover an interrupted change to ", filename, "\n");
+    }
+    free(batches);
+    free(journal);
+    free(name);
+}
 
-/* instead of writing each byte change, I buffer them up */
-static void flushWriteBuff()
+/* Instead of writing each byte change, I buffer them up.  They are sorted
+   and merged into runs, filling the gaps between them from memory while the
+   bytes are still there (always, for a mapped file), so a gain change takes
+   a few large pwritev() calls instead of a seek and a write per field */
+static void flushWriteBuff(bool last)
 {
-    for (unsigned long i = 0; i < writebuffercnt; i++)
+    struct iovec iov[WRITE_IOVECS];
+    int iovcnt = 0;
+    unsigned long start = 0;
+    unsigned long end = 0;
+    bool ok = true;
+
+    if (journalfd >= 0 && (writebuffercnt > 0 || last) && !journalBatch(last))
+    {
+        writebuffercnt = 0;
+        return;
+    }
+
+    qsort(writebuffer, writebuffercnt, sizeof(wbuffer), compareWriteBuff);
+    for (unsigned long i = 0; i < writebuffercnt && ok; i++)
+    {
+        unsigned long pos = writebuffer[i].fileposition;
+        const unsigned char *vals = bytesInMemory(pos, 2);
+        const unsigned char *gap = NULL;
+
+        if (vals != NULL && memcmp(vals, writebuffer[i].val, 2) != 0)
+        {
+            vals = NULL;    /* patched elsewhere, as from the index */
+        }
+        if (iovcnt > 0 && pos > end && pos - end <= WRITE_GAP)
+        {
+            gap = bytesInMemory(end, pos - end);
+        }
+        if (iovcnt > 0 && ((pos != end && gap == NULL) || iovcnt + 2 > WRITE_IOVECS))
+        {
+            ok = writeRun(iov, iovcnt, start);
+            iovcnt = 0;
+        }
+        if (iovcnt == 0)
+        {
+            start = pos;
+        }
+        else if (gap != NULL)
+        {
+            addIovec(iov, &iovcnt, gap, pos - end);
+        }
+        addIovec(iov, &iovcnt, vals != NULL ? vals : writebuffer[i].val, 2);
+        end = pos + 2;
+    }
+    if (ok && iovcnt > 0)
+    {
+        ok = writeRun(iov, iovcnt, start);
+    }
+    if (!ok)
     {
-        fseek(inf, writebuffer[i].fileposition, SEEK_SET);
-        fwrite(writebuffer[i].val, 1, 2, inf);
+        passError(3, "Error writing to ", curfilename, "\n");
     }
+
+    statPatches += writebuffercnt;
     writebuffercnt = 0;
 }
 
-static void addWriteBuff(unsigned long pos, unsigned char *vals)
+static void addWriteBuff(unsigned long pos, unsigned char *vals, const unsigned char *old)
 {
     if (writebuffercnt >= WRITEBUFFERSIZE)
     {
-        flushWriteBuff();
-        fseek(inf, filepos, SEEK_SET);
+        flushWriteBuff(false);
     }
     writebuffer[writebuffercnt].fileposition = pos;
     writebuffer[writebuffercnt].val[0] = *vals;
     writebuffer[writebuffercnt].val[1] = vals[1];
+    writebuffer[writebuffercnt].old[0] = old[0];
+    writebuffer[writebuffercnt].old[1] = old[1];
     writebuffercnt++;
 }
 
@@ -142,6 +701,7 @@ static unsigned long fillBuffer(long savelastbytes)
     unsigned long i;
     unsigned long skip;
     unsigned long skipbuf;
+    unsigned long want;
 
     skip = 0;
     if (savelastbytes < 0)
@@ -150,12 +710,16 @@ static unsigned long fillBuffer(long savelastbytes)
         savelastbytes = 0;
     }
 
-    if (gUsingTemp && gNowWriting)
+    if (writebuffercnt > 0)   /* while the bytes around the patches are here */
     {
-        if (fwrite(buffer, 1, inbuffer - savelastbytes, outf) != (size_t)(inbuffer - savelastbytes))
-        {
-            return 0;
-        }
+        flushWriteBuff(false);
+    }
+
+    if (mapping != NULL)   /* the whole file is mapped, just move along */
+    {
+        buffer += inbuffer - savelastbytes;
+        inbuffer = savelastbytes;
+        return 0;
     }
 
     if (savelastbytes != 0) /* save some of the bytes at the end of the buffer */
@@ -163,7 +727,12 @@ static unsigned long fillBuffer(long savelastbytes)
         memmove(buffer, (buffer + inbuffer - savelastbytes), savelastbytes);
     }
 
-    while (skip > 0)   /* skip some bytes from the input file */
+    if (skip > 0 && fseek(inf, skip, SEEK_CUR) == 0)
+    {
+        filepos += skip;
+        skip = 0;
+    }
+    while (skip > 0)   /* skip some bytes from a pipe */
     {
         skipbuf = skip > BUFFERSIZE ? BUFFERSIZE : skip;
 
@@ -172,24 +741,132 @@ static unsigned long fillBuffer(long savelastbytes)
         {
             return 0;
         }
-
-        if (gUsingTemp && gNowWriting)
-        {
-            if (fwrite(buffer, 1, skipbuf, outf) != skipbuf)
-            {
-                return 0;
-            }
-        }
         filepos += i;
         skip -= skipbuf;
     }
-    i = fread(buffer + savelastbytes, 1, BUFFERSIZE - savelastbytes, inf);
+    want = BUFFERSIZE - savelastbytes;
+    if (filepos + want > audioEnd)   /* the trailing tags are not audio */
+    {
+        want = filepos < audioEnd ? audioEnd - filepos : 0;
+    }
+    i = want > 0 ? fread(buffer + savelastbytes, 1, want, inf) : 0;
 
     filepos = filepos + i;
     inbuffer = i + savelastbytes;
     return i;
 }
 
+static void stopReading(void)
+{
+    if (mapping != NULL)
+    {
+        munmap(mapping, mappingSize);
+        mapping = NULL;
+    }
+    buffer = readbuffer;
+}
+
+/* The length of the ID3v2 tag whose header is h, or 0 if h is not one */
+static unsigned long id3v2Length(const unsigned char *h)
+{
+    /*
+     *  An ID3v2 tag can be detected with the following pattern:
+     *    $49 44 33 yy yy xx zz zz zz zz
+     *  Where yy is less than $FF, xx is the 'flags' byte and zz is less than
+     *  $80.
+     */
+    if (h[0] == 'I' && h[1] == 'D' && h[2] == '3' && h[3] < 0xFF && h[4] < 0xFF)
+    {
+        return ((unsigned long)h[9] | ((unsigned long)h[8] << 7) |
+                ((unsigned long)h[7] << 14) | ((unsigned long)h[6] << 21)) + 10;
+    }
+    return 0;
+}
+
+/* Where the APE, Lyrics3 and ID3v1 tags at the end of the file start.  The
+   offset main() read is used while the file still has the size it had;
+   after a tag was rewritten the tags are read again. */
+static unsigned long findAudioEnd(const char *filename, unsigned long size)
+{
+    struct FileTagsStruct tags;
+    long end;
+
+    if (curTags != NULL && curTags->fileSize == (long)size)
+    {
+        end = curTags->tagOffset;
+    }
+    else
+    {
+        memset(&tags, 0, sizeof(tags));
+        end = ReadMP3GainAPETag(filename, NULL, &tags) ? tags.tagOffset : (long)size;
+        free(tags.lyrics3tag);
+        free(tags.id31tag);
+    }
+    return end >= 0 && (unsigned long)end <= size ? (unsigned long)end : size;
+}
+
+/* Start reading inf at its audio: after the ID3v2 tag at the start, and up
+   to the tags at the end, so that frameSearch() never looks at tag bytes.
+   A regular file is mapped whole, so frames are scanned and decoded where
+   they lie; pipes, empty files and anything else mmap() refuses are read
+   through readbuffer with fread().
+   The mapping is private: set8Bits() may scribble on it, and the changes
+   reach the file through addWriteBuff() or the temp file as before.
+   Returns false if there is nothing to read */
+static bool startReading(const char *filename)
+{
+    struct stat st;
+    unsigned char head[10];
+    unsigned long start = 0;
+
+    stopReading();
+    inbuffer = 0;
+    filepos = 0;
+    bitidx = 0;
+    audioEnd = ULONG_MAX;
+
+    if (fstat(fileno(inf), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        /* a pipe can't be read ahead of time: look for the ID3v2 tag in
+           what the first read brought in, and read past it */
+        if (fillBuffer(0) >= sizeof(head) && (start = id3v2Length(buffer)) > 0)
+        {
+            fillBuffer(inbuffer - (long)start);
+        }
+        return inbuffer != 0;
+    }
+
+    audioEnd = findAudioEnd(filename, (unsigned long)st.st_size);
+    if (pread(fileno(inf), head, sizeof(head), 0) == sizeof(head))
+    {
+        start = id3v2Length(head);
+    }
+    if (start > audioEnd)
+    {
+        start = audioEnd;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fileno(inf), 0);
+    if (map != MAP_FAILED)
+    {
+        madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+        mapping = map;
+        mappingSize = (size_t)st.st_size;
+        buffer = mapping + start;
+        inbuffer = audioEnd - start;
+        filepos = audioEnd;
+        return true;
+    }
+
+    if (fseek(inf, start, SEEK_SET) != 0)
+    {
+        return false;
+    }
+    filepos = start;
+    return fillBuffer(0) != 0;
+}
+
 static const unsigned char maskLeft8bits[8] =
 {
     0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE
@@ -202,16 +879,15 @@ static const unsigned char maskRight8bits[8] =
 
 static void set8Bits(unsigned short val)
 {
+    unsigned char old[2] = { wrdpntr[0], wrdpntr[1] };
+
     val <<= (8 - bitidx);
     wrdpntr[0] &= maskLeft8bits[bitidx];
     wrdpntr[0] |= (val  >> 8);
     wrdpntr[1] &= maskRight8bits[bitidx];
     wrdpntr[1] |= (val  & 0xFF);
 
-    if (!gUsingTemp)
-    {
-        addWriteBuff(filepos - (inbuffer - (wrdpntr - buffer)), wrdpntr);
-    }
+    addWriteBuff(filepos - (inbuffer - (wrdpntr - buffer)), wrdpntr, old);
 }
 
 static void skipBits(int nbits)
@@ -233,39 +909,6 @@ static unsigned char peek8Bits()
     return (rval & 0xFF);
 }
 
-static bool skipID3v2()
-{
-    /*
-     *  An ID3v2 tag can be detected with the following pattern:
-     *    $49 44 33 yy yy xx zz zz zz zz
-     *  Where yy is less than $FF, xx is the 'flags' byte and zz is less than
-     *  $80.
-     */
-    unsigned long ID3Size;
-
-    bool ok = true;
-
-    if (wrdpntr[0] == 'I' && wrdpntr[1] == 'D' && wrdpntr[2] == '3'
-        && wrdpntr[3] < 0xFF && wrdpntr[4] < 0xFF)
-    {
-
-        ID3Size = (long)(wrdpntr[9]) | ((long)(wrdpntr[8]) << 7) |
-                  ((long)(wrdpntr[7]) << 14) | ((long)(wrdpntr[6]) << 21);
-
-        ID3Size += 10;
-
-        wrdpntr = wrdpntr + ID3Size;
-
-        if ((wrdpntr + HEADERSIZE - buffer) > inbuffer)
-        {
-            ok = fillBuffer(inbuffer - (wrdpntr - buffer)) != 0;
-            wrdpntr = buffer;
-        }
-    }
-
-    return ok;
-}
-
 void passError(int numStrings, ...)
 {
     va_list marker;
@@ -292,15 +935,185 @@ void passError(int numStrings, ...)
     free(errstr);
 }
 
+void statsLine(const char *format, ...)
+{
+    va_list marker;
+
+    if (gStats)
+    {
+        va_start(marker, format);
+        vfprintf(stderr, format, marker);
+        va_end(marker);
+    }
+}
+
+/* Where the next 11-bit frame sync (0xFF, then a byte with the top three
+   bits set) is at p..last, or somewhere past last if there is none */
+typedef const unsigned char *(*syncScanFunc)(const unsigned char *p, const unsigned char *last);
+
+static const unsigned char *syncScanScalar(const unsigned char *p, const unsigned char *last)
+{
+    for (; p <= last; p++)
+    {
+        if (p[0] == 0xFF && (p[1] & 0xE0) == 0xE0)
+        {
+            break;
+        }
+    }
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+
+static const unsigned char *syncScanSSE2(const unsigned char *p, const unsigned char *last)
+{
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+    const __m128i e0 = _mm_set1_epi8((char)0xE0);
+
+    for (; p + 16 <= last; p += 16)
+    {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)p);
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b0, ff),
+                                     _mm_cmpeq_epi8(_mm_and_si128(b1, e0), e0)));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return syncScanScalar(p, last);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *syncScanAVX2(const unsigned char *p, const unsigned char *last)
+{
+    const __m256i ff = _mm256_set1_epi8((char)0xFF);
+    const __m256i e0 = _mm256_set1_epi8((char)0xE0);
+
+    for (; p + 32 <= last; p += 32)
+    {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(b0, ff),
+                            _mm256_cmpeq_epi8(_mm256_and_si256(b1, e0), e0)));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return syncScanSSE2(p, last);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static syncScanFunc syncScan = syncScanScalar;
+
+static void selectSyncScan(void)
+{
+    switch (simd_level())
+    {
+#ifdef HAVE_X86_SIMD
+    case SIMD_AVX2:
+        syncScan = syncScanAVX2;
+        break;
+    case SIMD_SSE2:
+        syncScan = syncScanSSE2;
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+/* kbit/s for layers I and II: MPEG 1, then MPEG 2 and 2.5 */
+static const double bitrateLayer1[2][16] =
+{
+    { 1, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 1 },
+    { 1, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256, 1 }
+};
+
+static const double bitrateLayer2[2][16] =
+{
+    { 1, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384, 1 },
+    { 1,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160, 1 }
+};
+
+/* Bytes in the frame whose header is at hdr, for any layer */
+static long frameLength(const unsigned char *hdr)
+{
+    long mpegver = (hdr[1] >> 3) & 0x03;
+    int bitidx = hdr[2] >> 4;
+    double freq = frequency[mpegver][(hdr[2] >> 2) & 0x03];
+    long padding = (hdr[2] >> 1) & 0x01;
+
+    switch (hdr[1] & 0x06)
+    {
+    case 0x06: /* Layer I counts in 4-byte slots */
+        return ((long)floor(12.0 * bitrateLayer1[mpegver != 3][bitidx] / freq) + padding) * 4;
+    case 0x04:
+        return (long)floor(144.0 * bitrateLayer2[mpegver != 3][bitidx] / freq) + padding;
+    default:
+        return (long)floor(floor(((mpegver == 3 ? 1152.0 : 576.0) * bitrate[mpegver][bitidx]) /
+                                 freq) / 8.0) + padding;
+    }
+}
+
+/* Is hdr a frame header of the same MPEG version, layer and sample
+   frequency as first? */
+static bool sameHeader(const unsigned char *hdr, const unsigned char *first)
+{
+    return hdr[0] == 0xFF && (hdr[1] & 0xFE) == (first[1] & 0xFE)
+           && (hdr[2] & 0x0C) == (first[2] & 0x0C)
+           && (hdr[2] & 0xF0) != 0xF0
+           && (hdr[2] & 0xF0) != 0x00;
+}
+
+/* A lone 0xFFE sync turns up in junk and tag data often enough to be
+   worth a second opinion: the frames that follow the candidate, as far as
+   they are in the buffer, must have headers of the same kind.  Running
+   into the end of the data or a tag also counts. */
+#define SYNC_LOOKAHEAD 2
+
+static bool confirmFrame(const unsigned char *first)
+{
+    const unsigned char *hdr = first;
+    const unsigned char *end = buffer + inbuffer;
+
+    for (int n = 0; n < SYNC_LOOKAHEAD; n++)
+    {
+        hdr += frameLength(hdr);
+        if (hdr + HEADERSIZE > end)
+        {
+            return true;
+        }
+        if (memcmp(hdr, "TAG", 3) == 0 || memcmp(hdr, "ID3", 3) == 0
+            || (hdr + 8 <= end && memcmp(hdr, "APETAGEX", 8) == 0)
+            || (hdr + 6 <= end && memcmp(hdr, "LYRICS", 6) == 0))
+        {
+            return true;
+        }
+        if (!sameHeader(hdr, first))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 static bool frameSearch(int startup)
 {
-    static int startfreq;
-    static int startmpegver;
+    static pthread_once_t syncOnce = PTHREAD_ONCE_INIT;
+    unsigned char *start;
+    bool skipped = false;
+    static _Thread_local int startfreq;
+    static _Thread_local int startmpegver;
     long tempmpegver;
     double bitbase;
     bool done = false;
     bool ok = true;
 
+    pthread_once(&syncOnce, selectSyncScan);
+
     if ((wrdpntr + HEADERSIZE - buffer) > inbuffer)
     {
         ok = fillBuffer(inbuffer - (wrdpntr - buffer)) != 0;
@@ -316,15 +1129,23 @@ static bool frameSearch(int startup)
 
         done = true;
 
-        if ((wrdpntr[0] & 0xFF) != 0xFF)
-        {
-            done = false;    /* first 8 bits must be '1' */
-        }
-        else if ((wrdpntr[1] & 0xE0) != 0xE0)
+        /* jump to the next place the first 11 bits are all '1' */
+        start = wrdpntr;
+        wrdpntr = (unsigned char *)syncScan(wrdpntr, buffer + inbuffer - HEADERSIZE);
+        skipped = skipped || wrdpntr != start;
+        if ((wrdpntr + HEADERSIZE - buffer) > inbuffer)
         {
-            done = false;    /* next 3 bits are also '1' */
+            ok = fillBuffer(inbuffer - (wrdpntr - buffer)) != 0;
+            wrdpntr = buffer;
+            if (!ok)
+            {
+                break;
+            }
+            done = false;
+            continue;
         }
-        else if ((wrdpntr[1] & 0x18) == 0x08)
+
+        if ((wrdpntr[1] & 0x18) == 0x08)
         {
             done = false;    /* invalid MPEG version */
         }
@@ -340,6 +1161,10 @@ static bool frameSearch(int startup)
         {
             done = false;    /* bad sample frequency */
         }
+        else if ((startup || skipped) && !confirmFrame(wrdpntr))
+        {
+            done = false;    /* the frames after it don't fit, a false sync */
+        }
         else if ((wrdpntr[1] & 0x06) != 0x02)   /* not Layer III */
         {
             if (!LayerSet)
@@ -405,6 +1230,7 @@ static bool frameSearch(int startup)
         if (!done)
         {
             wrdpntr++;
+            skipped = true;
         }
 
         if ((wrdpntr + HEADERSIZE - buffer) > inbuffer)
@@ -433,84 +1259,326 @@ static bool frameSearch(int startup)
 
 #define CRC16_POLYNOMIAL 0x8005
 
-static int crcUpdate(int value, int crc)
+/* crcTable[0] is the CRC-16 of each byte; crcTable[k] is the same byte
+   followed by k zero bytes, so that crcBlock() takes eight bytes per step */
+static uint16_t crcTable[8][256];
+
+static void initCrcTables(void)
 {
-    value <<= 8;
-    for (int i = 0; i < 8; i++)
+    for (int b = 0; b < 256; b++)
     {
-        value <<= 1;
-        crc <<= 1;
-
-        if (((crc ^ value) & 0x10000))
+        uint16_t crc = b << 8;
+        for (int i = 0; i < 8; i++)
         {
-            crc ^= CRC16_POLYNOMIAL;
+            crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLYNOMIAL : crc << 1;
+        }
+        crcTable[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            uint16_t prev = crcTable[k - 1][b];
+            crcTable[k][b] = (prev << 8) ^ crcTable[0][prev >> 8];
         }
     }
-    return crc;
 }
 
-static void crcWriteHeader(int headerlength, char *header)
+static uint16_t crcBlock(uint16_t crc, const unsigned char *p, int len)
 {
-    int crc = 0xffff; /* (jo) init crc16 for error_protection */
-    crc = crcUpdate(((unsigned char *)header)[2], crc);
-    crc = crcUpdate(((unsigned char *)header)[3], crc);
-    for (int i = 6; i < headerlength; i++)
+    for (; len >= 8; p += 8, len -= 8)
     {
-        crc = crcUpdate(((unsigned char *)header)[i], crc);
+        crc = crcTable[7][p[0] ^ (crc >> 8)] ^ crcTable[6][p[1] ^ (crc & 0xFF)] ^
+              crcTable[5][p[2]] ^ crcTable[4][p[3]] ^
+              crcTable[3][p[4]] ^ crcTable[2][p[5]] ^
+              crcTable[1][p[6]] ^ crcTable[0][p[7]];
     }
+    for (; len > 0; p++, len--)
+    {
+        crc = (crc << 8) ^ crcTable[0][p[0] ^ (crc >> 8)];
+    }
+    return crc;
+}
+
+/* The CRC of a protected frame: the last two bytes of its header and the
+   side info after the CRC field, headerlength bytes from the frame start */
+static uint16_t frameCrc(const unsigned char *header, int headerlength)
+{
+    uint16_t crc = 0xffff; /* (jo) init crc16 for error_protection */
+    crc = crcBlock(crc, header + 2, 2);
+    return crcBlock(crc, header + 6, headerlength - 6);
+}
+
+static void crcWriteHeader(int headerlength, char *header)
+{
+    uint16_t crc = frameCrc((unsigned char *)header, headerlength);
 
     header[4] = crc >> 8;
     header[5] = crc & 255;
 }
 
-static long getSizeOfFile(const char *filename)
+/* Start the temp file as a copy of the original, to be patched like the
+   original is without -t: a reflink where the filesystem can share the
+   blocks, else copy_file_range(), else pread() and pwrite() */
+static bool copyFile(int infd, int outfd)
+{
+    struct stat st;
+    off_t pos = 0;
+
+    if (fstat(infd, &st) != 0)
+    {
+        return false;
+    }
+    if (ioctl(outfd, FICLONE, infd) == 0)
+    {
+        return true;
+    }
+    while (pos < st.st_size)
+    {
+        off_t outpos = pos;
+
+        if (copy_file_range(infd, &pos, outfd, &outpos, (size_t)(st.st_size - pos), 0) <= 0)
+        {
+            break;
+        }
+    }
+    while (pos < st.st_size)
+    {
+        ssize_t len = pread(infd, readbuffer, BUFFERSIZE, pos);
+
+        if (len <= 0 || pwrite(outfd, readbuffer, (size_t)len, pos) != len)
+        {
+            return false;
+        }
+        pos += len;
+    }
+    return true;
+}
+
+/*
+ * Each job works on one file in a session.  Reading its tags, the
+ * analysis, the gain change, keeping its timestamp and writing its tags
+ * all share one descriptor, opened on first use, and one fstat() of it,
+ * kept until something writes to the file.  On a network filesystem every
+ * open and stat is a round trip.  Other files (temp files, sidecars) are
+ * opened as before.
+ */
+struct fileSession
 {
-    long size = 0;
+    const char *name;
     FILE *file;
+    FILE *readFile;         /* the read-only open file was upgraded from,
+                               kept for whoever still holds it */
+    bool writable;
+    bool writeTried;        /* the file was opened read-write, or tried */
+    bool writing;           /* handed out for writing; uses may nest, so
+                               every close from then on drops the stat */
+    bool statValid;
+    struct stat st;
+    unsigned long opens;
+    unsigned long stats;
+    double overhead;        /* seconds in open, fstat, futimens and close */
+};
+
+static _Thread_local struct fileSession session;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void startSession(const char *filename)
+{
+    memset(&session, 0, sizeof(session));
+    session.name = filename;
+}
+
+static void dropSessionFile(void)
+{
+    if (session.file != NULL || session.readFile != NULL)
+    {
+        double start = now();
 
-    file = fopen(filename, "rb");
-    if (file)
+        if (session.file != NULL)
+        {
+            fclose(session.file);
+        }
+        if (session.readFile != NULL)
+        {
+            fclose(session.readFile);
+        }
+        session.file = NULL;
+        session.readFile = NULL;
+        session.writable = false;
+        session.writeTried = false;
+        session.overhead += now() - start;
+    }
+    session.statValid = false;
+}
+
+static void endSession(void)
+{
+    dropSessionFile();
+    if (gStats && session.opens > 0)
     {
-        fseek(file, 0, SEEK_END);
-        size = ftell(file);
-        fclose(file);
+        fprintf(stderr, "%s: %lu opens, %lu fstat calls, %.3f ms of open/stat overhead\n",
+                session.name, session.opens, session.stats, session.overhead * 1e3);
     }
+    memset(&session, 0, sizeof(session));
+}
 
-    return size;
+static bool inSession(const char *filename)
+{
+    return session.name != NULL && strcmp(filename, session.name) == 0;
 }
 
-static int deleteFile(const char *filename)
+/* The session's file.  It is opened read-only, and reopened read-write
+   the first time something is to be written, so that a file that is only
+   read is never opened for writing (which costs a second open() for a
+   read-only file, and tells inotify watchers that it was written) */
+static FILE *sessionFile(bool update)
 {
-    return remove(filename);
+    if (session.file == NULL || (update && !session.writeTried))
+    {
+        double start = now();
+        FILE *file = fopen(session.name, update ? "r+b" : "rb");
+
+        session.opens++;
+        session.writeTried |= update;
+        if (file != NULL)
+        {
+            if (session.file != NULL)
+            {
+                session.readFile = session.file;
+            }
+            session.file = file;
+            session.writable = update;
+        }
+        session.overhead += now() - start;
+    }
+    return session.file;
+}
+
+/* fopen() for reading or updating a file, from its session if it has one */
+FILE *openFile(const char *filename, const char *mode)
+{
+    bool update = strchr(mode, '+') != NULL;
+    FILE *file;
+
+    if (mode[0] == 'r' && inSession(filename))
+    {
+        file = sessionFile(update);
+        if (file == NULL || (update && !session.writable))
+        {
+            return NULL;
+        }
+        if (update)
+        {
+            session.writing = true;
+            session.statValid = false;
+        }
+        rewind(file);
+        return file;
+    }
+    return fopen(filename, mode);
+}
+
+/* fclose() of a file from openFile() */
+void closeFile(FILE *file)
+{
+    if (file != NULL && (file == session.file || file == session.readFile))
+    {
+        fflush(file);
+        if (session.writing)
+        {
+            session.statValid = false;
+        }
+        return;
+    }
+    fclose(file);
+}
+
+/* stat(), from the session if the file has one */
+static int sessionStat(const char *filename, struct stat *st)
+{
+    if (!inSession(filename) || sessionFile(false) == NULL)
+    {
+        return stat(filename, st);
+    }
+    if (!session.statValid)
+    {
+        double start = now();
+
+        session.statValid = fstat(fileno(session.file), &session.st) == 0;
+        session.stats++;
+        session.overhead += now() - start;
+        if (!session.statValid)
+        {
+            return -1;
+        }
+    }
+    *st = session.st;
+    return 0;
 }
 
-static int moveFile(const char *currentfilename, const char *newfilename)
+/* rename() a temp file over the original, which then has to be reopened */
+int replaceFile(const char *tmpfilename, const char *filename)
 {
-    return rename(currentfilename, newfilename);
+    int ret = rename(tmpfilename, filename);
+
+    if (ret == 0 && inSession(filename))
+    {
+        dropSessionFile();
+    }
+    return ret;
+}
+
+static long getSizeOfFile(const char *filename)
+{
+    struct stat st;
+
+    return sessionStat(filename, &st) == 0 ? (long)st.st_size : 0;
+}
+
+static int deleteFile(const char *filename)
+{
+    return remove(filename);
 }
 
 /* Get File size and datetime stamp */
 
 void fileTime(const char *filename, timeAction action)
 {
-    static int timeSaved = 0;
-    static struct stat savedAttributes;
+    static _Thread_local int timeSaved = 0;
+    static _Thread_local struct stat savedAttributes;
 
     if (action == storeTime)
     {
-        timeSaved = (stat(filename, &savedAttributes) == 0);
+        timeSaved = (sessionStat(filename, &savedAttributes) == 0);
     }
     else
     {
         if (timeSaved)
         {
-            struct utimbuf setTime;
+            struct timespec times[2] = { savedAttributes.st_atim, savedAttributes.st_mtim };
 
-            setTime.actime = savedAttributes.st_atime;
-            setTime.modtime = savedAttributes.st_mtime;
             timeSaved = 0;
+            if (inSession(filename) && sessionFile(false) != NULL)
+            {
+                double start = now();
 
-            utime(filename, &setTime);
+                fflush(session.file);
+                futimens(fileno(session.file), times);
+                session.statValid = false;
+                session.overhead += now() - start;
+            }
+            else
+            {
+                utimensat(AT_FDCWD, filename, times, 0);
+            }
         }
     }
 }
@@ -518,13 +1586,18 @@ void fileTime(const char *filename, timeAction action)
 static unsigned long reportPercentWritten(unsigned long percent,
         unsigned long bytes)
 {
+    if (gJobs > 1)   /* several files at once, a progress line would be garbled */
+    {
+        return 1;
+    }
     fprintf(stderr, "                                                \r"
             " %2lu%% of %lu bytes written\r",
             percent, bytes);
     return 1;
 }
 
-static int numFiles, totFiles;
+static atomic_int numFiles;
+static int totFiles;
 
 static unsigned long reportPercentAnalyzed(unsigned long percent,
         unsigned long bytes)
@@ -532,6 +1605,11 @@ static unsigned long reportPercentAnalyzed(unsigned long percent,
     char fileDivFiles[21];
     fileDivFiles[0] = '\0';
 
+    if (gJobs > 1)
+    {
+        return 1;
+    }
+
     if (totFiles - 1)   /* if 1 file then don't show [x/n] */
     {
         sprintf(fileDivFiles, "[%d/%d]", numFiles, totFiles);
@@ -627,34 +1705,323 @@ static void scanFrameGain()
     }
 }
 
-static int changeGain(const char *filename,
-                      int leftgainchange,
-                      int rightgainchange)
+/* gain + change, wrapped around with -w, else held to 0..255 (0 stays 0) */
+static unsigned char adjustGain(unsigned char gain, int change)
 {
-    int mode;
-    int crcflag;
-    unsigned char *Xingcheck;
-    int nchan;
-    unsigned char gain;
-    int bitridx;
-    long bytesinframe;
-    int sideinfo_len;
-    int mpegver;
-    long gFilesize = 0;
-    int gainchange[2];
-    int singlechannel;
-    long outlength, inlength; /* size checker when using Temp files */
-
-    char *outfilename = NULL;
-    unsigned long frame = 0;
-    gBadLayer = false;
-    LayerSet = Reckless;
-
-    gNowWriting = true;
-
-    if (leftgainchange == 0 && rightgainchange == 0)
+    if (wrapGain)
     {
-        return 0;
+        return gain + (unsigned char)change;
+    }
+    if (gain == 0)
+    {
+        return 0;
+    }
+    if ((int)gain + change > 255)
+    {
+        return 255;
+    }
+    if ((int)gain + change < 0)
+    {
+        return 0;
+    }
+    return gain + (unsigned char)change;
+}
+
+/*
+ * --index keeps <file>.mp3gain-index next to each file it changes, listing
+ * the offset of every frame and the bit positions of its global_gain
+ * fields.  The next change patches those directly instead of searching
+ * the file for frames.  The index is trusted as is if the size and mtime
+ * of the file are the ones it recorded.  Otherwise (a tag was written
+ * since, say) it is used only if the frame headers it points at hash to
+ * what they did and no frame follows the last one.
+ */
+static void hashHeader(uint64_t *hash, const unsigned char *hdr)
+{
+    for (int i = 0; i < HEADERSIZE; i++)
+    {
+        *hash = (*hash ^ hdr[i]) * 1099511628211u;   /* FNV-1a */
+    }
+}
+
+/* The global_gain fields of the frame at hdr, where the walk through its
+   side info in changeGain() finds them: 59 bits apart for each granule and
+   channel of MPEG 1, 63 for MPEG 2 and 2.5 */
+static void indexFrame(frameIndex *entry, const unsigned char *hdr)
+{
+    int mode = (hdr[3] >> 6) & 0x03;
+    int nchan = (mode == 3) ? 1 : 2;
+    bool crc = !(hdr[1] & 0x01);
+    int bit = (crc ? 6 : 4) * 8;
+
+    if (((hdr[1] >> 3) & 0x03) == 3)
+    {
+        bit += 9 + (mode == 3 ? 5 : 3) + nchan * 4; /* main_data_begin, private, scfsi */
+        entry->ngains = 2 * nchan;
+        for (int i = 0; i < entry->ngains; i++)
+        {
+            entry->bitpos[i] = bit + 21 + 59 * i;
+        }
+        entry->crclen = !crc ? 0 : nchan == 1 ? 23 : 38;
+    }
+    else
+    {
+        bit += 8 + (mode == 3 ? 1 : 2);     /* main_data_begin, private */
+        entry->ngains = nchan;
+        for (int i = 0; i < entry->ngains; i++)
+        {
+            entry->bitpos[i] = bit + 21 + 63 * i;
+        }
+        entry->crclen = !crc ? 0 : nchan == 1 ? 15 : 23;
+    }
+}
+
+static frameIndex *newIndexEntry(unsigned long offset)
+{
+    frameIndex *entry;
+
+    if (indexCount == indexAlloc)
+    {
+        indexAlloc = indexAlloc == 0 ? 4096 : indexAlloc * 2;
+        indexEntries = realloc(indexEntries, sizeof(frameIndex) * indexAlloc);
+    }
+    entry = indexEntries + indexCount++;
+    entry->offset = offset;
+    entry->ngains = 0;
+    entry->crclen = 0;
+    return entry;
+}
+
+/*
+ * With -r the analysis notes where it finds each frame, so that the
+ * change that follows it patches the file straight from indexEntries
+ * instead of searching it for frames a second time.
+ */
+static void startAnalysisIndex(bool wanted)
+{
+    indexCount = 0;
+    analysisHash = INDEX_HASH_SEED;
+    analysisIndexed = wanted && mapping != NULL && fstat(fileno(inf), &analysisStat) == 0;
+}
+
+static void indexAnalyzedFrame(void)
+{
+    if (!analysisIndexed)
+    {
+        return;
+    }
+    if (curframe + SIDEINFO_MAX > mapping + mappingSize)
+    {
+        analysisIndexed = false;    /* let changeGain() deal with the stub */
+        return;
+    }
+    indexFrame(newIndexEntry(curframe - mapping), curframe);
+    hashHeader(&analysisHash, curframe);
+}
+
+/* is inf still the file the analysis indexed? */
+static bool analysisIndexFits(void)
+{
+    struct stat st;
+
+    return analysisIndexed && indexCount > 0 && mapping != NULL && fstat(fileno(inf), &st) == 0 &&
+           st.st_dev == analysisStat.st_dev && st.st_ino == analysisStat.st_ino &&
+           st.st_size == analysisStat.st_size &&
+           st.st_mtim.tv_sec == analysisStat.st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == analysisStat.st_mtim.tv_nsec;
+}
+
+/* read <file>.mp3gain-index into indexEntries, if it still fits the mapped
+   file, and the hash of the frame headers it recorded */
+static bool loadIndex(const char *filename, uint64_t *hash)
+{
+    char *name = sidecarFileName(filename, INDEX_SUFFIX);
+    int fd = open(name, O_RDONLY);
+    unsigned char *data = NULL;
+    struct stat st, filest;
+    uint64_t count = 0;
+    uint64_t headers = INDEX_HASH_SEED;
+    bool ok;
+
+    indexCount = 0;
+    ok = fd >= 0 && fstat(fd, &st) == 0 && fstat(fileno(inf), &filest) == 0 &&
+         st.st_size > INDEX_HEADER && (data = malloc(st.st_size)) != NULL &&
+         read(fd, data, st.st_size) == st.st_size &&
+         memcmp(data, INDEX_MAGIC, 8) == 0 &&
+         (st.st_size - INDEX_HEADER) % INDEX_ENTRY == 0 &&
+         (count = getLE(data + 32, 8)) == (uint64_t)(st.st_size - INDEX_HEADER) / INDEX_ENTRY;
+
+    for (uint64_t i = 0; ok && i < count; i++)
+    {
+        const unsigned char *p = data + INDEX_HEADER + i * INDEX_ENTRY;
+        frameIndex *entry = newIndexEntry(getLE(p, 8));
+
+        entry->ngains = p[8];
+        entry->crclen = p[9];
+        ok = entry->ngains <= 4 && entry->crclen <= SIDEINFO_MAX &&
+             entry->offset + 6 + entry->crclen <= mappingSize;
+        for (int g = 0; ok && g < entry->ngains; g++)
+        {
+            entry->bitpos[g] = getLE(p + 10 + 2 * g, 2);
+            ok = (entry->bitpos[g] >> 3) + 2 <= SIDEINFO_MAX &&
+                 entry->offset + (entry->bitpos[g] >> 3) + 2 <= mappingSize;
+        }
+    }
+
+    if (ok && (getLE(data + 8, 8) != (uint64_t)filest.st_size ||
+               getLE(data + 16, 8) != (uint64_t)filest.st_mtim.tv_sec ||
+               getLE(data + 24, 8) != (uint64_t)filest.st_mtim.tv_nsec))
+    {
+        const unsigned char *first = mapping + indexEntries[0].offset;
+        const unsigned char *last = mapping + indexEntries[count - 1].offset;
+        const unsigned char *next = last + frameLength(last);
+
+        for (uint64_t i = 0; i < count; i++)
+        {
+            hashHeader(&headers, mapping + indexEntries[i].offset);
+        }
+        ok = headers == getLE(data + 40, 8) &&
+             !(next + HEADERSIZE <= mapping + mappingSize && sameHeader(next, first));
+    }
+
+    if (ok)
+    {
+        *hash = getLE(data + 40, 8);
+    }
+    else
+    {
+        indexCount = 0;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(data);
+    free(name);
+    return ok;
+}
+
+/* write indexEntries to <file>.mp3gain-index, stamped with the file as it is now */
+static void saveIndex(const char *filename, uint64_t hash)
+{
+    char *name = sidecarFileName(filename, INDEX_SUFFIX);
+    size_t len = INDEX_HEADER + indexCount * INDEX_ENTRY;
+    unsigned char *data = calloc(1, len);
+    unsigned char *p = data + INDEX_HEADER;
+    struct stat st;
+    int fd;
+
+    if (sessionStat(filename, &st) != 0)
+    {
+        free(data);
+        free(name);
+        return;
+    }
+    memcpy(data, INDEX_MAGIC, 8);
+    putLE(data + 8, st.st_size, 8);
+    putLE(data + 16, st.st_mtim.tv_sec, 8);
+    putLE(data + 24, st.st_mtim.tv_nsec, 8);
+    putLE(data + 32, indexCount, 8);
+    putLE(data + 40, hash, 8);
+    for (unsigned long i = 0; i < indexCount; i++, p += INDEX_ENTRY)
+    {
+        putLE(p, indexEntries[i].offset, 8);
+        p[8] = indexEntries[i].ngains;
+        p[9] = indexEntries[i].crclen;
+        for (int g = 0; g < indexEntries[i].ngains; g++)
+        {
+            putLE(p + 10 + 2 * g, indexEntries[i].bitpos[g], 2);
+        }
+    }
+
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data, len) != (ssize_t)len)
+    {
+        fprintf(stderr, "%s: can't write %s\n", gProgramName, name);
+        if (fd >= 0)
+        {
+            unlink(name);
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(data);
+    free(name);
+}
+
+/* The frame loop of changeGain(), with the frames taken from the index.
+   The fields are changed in a copy of the start of each frame, so the
+   mapping stays untouched and its pages are never copied on write */
+static bool changeGainFromIndex(const char *filename, const int *gainchange, bool singlechannel)
+{
+    for (unsigned long i = 0; i < indexCount; i++)
+    {
+        const frameIndex *entry = indexEntries + i;
+        unsigned char side[SIDEINFO_MAX];
+        int nchan;
+
+        curframe = mapping + entry->offset;
+        nchan = ((curframe[3] >> 6) & 0x03) == 3 ? 1 : 2;
+        if (singlechannel && ((curframe[3] >> 6) & 0x01))
+        {
+            passError(2, filename,
+                      ": Can't adjust single channel for mono or joint stereo");
+            return false;
+        }
+        memcpy(side, curframe, entry->offset + SIDEINFO_MAX <= mappingSize ?
+               SIDEINFO_MAX : mappingSize - entry->offset);
+        for (int g = 0; g < entry->ngains; g++)
+        {
+            unsigned char *p = side + (entry->bitpos[g] >> 3);
+            int idx = entry->bitpos[g] & 7;
+            unsigned short val = adjustGain((((p[0] << 8) | p[1]) >> (8 - idx)) & 0xFF,
+                                            gainchange[g % nchan]);
+
+            val <<= (8 - idx);
+            p[0] = (p[0] & maskLeft8bits[idx]) | (val >> 8);
+            p[1] = (p[1] & maskRight8bits[idx]) | (val & 0xFF);
+            addWriteBuff(entry->offset + (p - side), p, curframe + (p - side));
+        }
+        if (entry->crclen != 0)
+        {
+            crcWriteHeader(entry->crclen, (char *)side);
+            addWriteBuff(entry->offset + 4, side + 4, curframe + 4);
+        }
+    }
+    return true;
+}
+
+static int changeGain(const char *filename,
+                      int leftgainchange,
+                      int rightgainchange)
+{
+    int mode;
+    int crcflag;
+    unsigned char *Xingcheck;
+    int nchan;
+    int bitridx;
+    long bytesinframe;
+    int sideinfo_len;
+    int mpegver;
+    long gFilesize = 0;
+    int gainchange[2];
+    int singlechannel;
+    long outlength, inlength; /* size checker when using Temp files */
+
+    char *outfilename = NULL;
+    unsigned long frame = 0;
+    bool indexed = false;       /* indexEntries covers the whole file */
+    uint64_t hash = INDEX_HASH_SEED;
+    gBadLayer = false;
+    LayerSet = Reckless;
+
+    gNowWriting = true;
+
+    if (leftgainchange == 0 && rightgainchange == 0)
+    {
+        return 0;
     }
 
     gainchange[0] = leftgainchange;
@@ -687,7 +2054,7 @@ static int changeGain(const char *filename,
             outfilename[outlength - 1] = 'P';
         }
 
-        inf = fopen(filename, "r+b");
+        inf = openFile(filename, "r+b");
 
         if (inf != NULL)
         {
@@ -695,7 +2062,7 @@ static int changeGain(const char *filename,
 
             if (outf == NULL)
             {
-                fclose(inf);
+                closeFile(inf);
                 inf = NULL;
                 passError(3, "Can't open ", outfilename, " for writing");
                 gNowWriting = false;
@@ -703,11 +2070,24 @@ static int changeGain(const char *filename,
                 return M3G_ERR_CANT_MAKE_TMP;
             }
 
+            if (!copyFile(fileno(inf), fileno(outf)))
+            {
+                fclose(outf);
+                closeFile(inf);
+                outf = NULL;
+                inf = NULL;
+                deleteFile(outfilename);
+                passError(3, "Not enough temp space on disk to modify ", filename,
+                          "\nEither free some space, or do not use \"temp file\" option\n");
+                gNowWriting = false;
+                free(outfilename);
+                return M3G_ERR_NOT_ENOUGH_TMP_SPACE;
+            }
         }
     }
     else
     {
-        inf = fopen(filename, "r+b");
+        inf = openFile(filename, "r+b");
     }
 
     if (inf == NULL)
@@ -725,18 +2105,29 @@ static int changeGain(const char *filename,
     else
     {
         writebuffercnt = 0;
-        inbuffer = 0;
-        filepos = 0;
-        bitidx = 0;
-        bool ok = fillBuffer(0);
-        if (ok)
+        statPatches = 0;
+        statWrites = 0;
+        if (!gUsingTemp)
+        {
+            openJournal(filename, gFilesize);
+        }
+        bool ok = startReading(filename);
+        if (ok && analysisIndexFits())
         {
+            indexed = changeGainFromIndex(filename, gainchange, singlechannel);
+            hash = analysisHash;
+        }
+        else if (ok && gUseIndex && mapping != NULL && loadIndex(filename, &hash))
+        {
+            indexed = changeGainFromIndex(filename, gainchange, singlechannel);
+        }
+        else if (ok)
+        {
+            indexCount = 0;
+            indexed = gUseIndex;
 
             wrdpntr = buffer;
 
-            ok = skipID3v2();
-            // TODO: why are we ignoring `ok` here?
-
             ok = frameSearch(true);
             if (!ok)
             {
@@ -778,6 +2169,7 @@ static int changeGain(const char *filename,
                         passError(2, filename,
                                   " is free format (not currently supported)");
                         ok = false;
+                        indexed = false;
                     }
                     else
                     {
@@ -805,15 +2197,22 @@ static int changeGain(const char *filename,
                         passError(2, filename,
                                   ": Can't adjust single channel for mono or joint stereo");
                         ok = false;
+                        indexed = false;
                     }
                 }
                 if (bitridx == 0)
                 {
                     passError(2, filename, " is free format (not currently supported)");
                     ok = false;
+                    indexed = false;
                 }
                 if (ok)
                 {
+                    if (gUseIndex)
+                    {
+                        indexFrame(newIndexEntry(filepos - (inbuffer - (curframe - buffer))), curframe);
+                        hashHeader(&hash, curframe);
+                    }
                     mpegver = (curframe[1] >> 3) & 0x03;
                     crcflag = curframe[1] & 0x01;
 
@@ -851,34 +2250,13 @@ static int changeGain(const char *filename,
                             for (int ch = 0; ch < nchan; ch++)
                             {
                                 skipBits(21);
-                                gain = peek8Bits();
-                                if (wrapGain)
-                                {
-                                    gain += (unsigned char)(gainchange[ch]);
-                                }
-                                else
-                                {
-                                    if (gain != 0)
-                                    {
-                                        if ((int)(gain) + gainchange[ch] > 255)
-                                        {
-                                            gain = 255;
-                                        }
-                                        else if ((int)gain + gainchange[ch] < 0)
-                                        {
-                                            gain = 0;
-                                        }
-                                        else
-                                        {
-                                            gain += (unsigned char)(gainchange[ch]);
-                                        }
-                                    }
-                                }
-                                set8Bits(gain);
+                                set8Bits(adjustGain(peek8Bits(), gainchange[ch]));
                                 skipBits(38);
                             }
                         if (!crcflag)
                         {
+                            unsigned char oldcrc[2] = { curframe[4], curframe[5] };
+
                             if (nchan == 1)
                             {
                                 crcWriteHeader(23, (char *)curframe);
@@ -888,10 +2266,7 @@ static int changeGain(const char *filename,
                                 crcWriteHeader(38, (char *)curframe);
                             }
                             /* WRITETOFILE */
-                            if (!gUsingTemp)
-                            {
-                                addWriteBuff(filepos - (inbuffer - (curframe + 4 - buffer)), curframe + 4);
-                            }
+                            addWriteBuff(filepos - (inbuffer - (curframe + 4 - buffer)), curframe + 4, oldcrc);
                         }
                     }
                     else   /* mpegver != 3 */
@@ -911,34 +2286,13 @@ static int changeGain(const char *filename,
                         for (int ch = 0; ch < nchan; ch++)
                         {
                             skipBits(21);
-                            gain = peek8Bits();
-                            if (wrapGain)
-                            {
-                                gain += (unsigned char)(gainchange[ch]);
-                            }
-                            else
-                            {
-                                if (gain != 0)
-                                {
-                                    if ((int)(gain) + gainchange[ch] > 255)
-                                    {
-                                        gain = 255;
-                                    }
-                                    else if ((int)gain + gainchange[ch] < 0)
-                                    {
-                                        gain = 0;
-                                    }
-                                    else
-                                    {
-                                        gain += (unsigned char)(gainchange[ch]);
-                                    }
-                                }
-                            }
-                            set8Bits(gain);
+                            set8Bits(adjustGain(peek8Bits(), gainchange[ch]));
                             skipBits(42);
                         }
                         if (!crcflag)
                         {
+                            unsigned char oldcrc[2] = { curframe[4], curframe[5] };
+
                             if (nchan == 1)
                             {
                                 crcWriteHeader(15, (char *)curframe);
@@ -948,10 +2302,7 @@ static int changeGain(const char *filename,
                                 crcWriteHeader(23, (char *)curframe);
                             }
                             /* WRITETOFILE */
-                            if (!gUsingTemp)
-                            {
-                                addWriteBuff(filepos - (inbuffer - (curframe + 4 - buffer)), curframe + 4);
-                            }
+                            addWriteBuff(filepos - (inbuffer - (curframe + 4 - buffer)), curframe + 4, oldcrc);
                         }
 
                     }
@@ -979,16 +2330,24 @@ static int changeGain(const char *filename,
             fprintf(stderr, "                                                   \r");
         }
         fflush(stdout);
+        flushWriteBuff(true);
+        closeJournal();
+        stopReading();
+        if (gStats)
+        {
+            fprintf(stderr, "%s: %lu patches written with %lu pwritev calls\n",
+                    filename, statPatches, statWrites);
+        }
         if (gUsingTemp)
         {
-            while (fillBuffer(0));
-            fflush(outf);
+            /* the copy must be on disk before it replaces the original */
+            fsync(fileno(outf));
             fseek(outf, 0, SEEK_END);
             fseek(inf, 0, SEEK_END);
             outlength = ftell(outf);
             inlength = ftell(inf);
             fclose(outf);
-            fclose(inf);
+            closeFile(inf);
             inf = NULL;
             outf = NULL;
 
@@ -1002,15 +2361,8 @@ static int changeGain(const char *filename,
             }
             else
             {
-
-                if (deleteFile(filename))
-                {
-                    deleteFile(outfilename); //try to delete tmp file
-                    passError(3, "Can't open ", filename, " for modifying");
-                    gNowWriting = false;
-                    return M3G_ERR_CANT_MODIFY_FILE;
-                }
-                if (moveFile(outfilename, filename))
+                /* rename() replaces the original in one step */
+                if (replaceFile(outfilename, filename))
                 {
                     passError(9, "Problem re-naming ", outfilename, " to ", filename,
                               "\nThe mp3 was correctly modified, but you will "
@@ -1029,16 +2381,20 @@ static int changeGain(const char *filename,
         }
         else
         {
-            flushWriteBuff();
-            fclose(inf);
+            closeFile(inf);
             inf = NULL;
             if (gSaveTime)
             {
                 fileTime(filename, setStoredTime);
             }
         }
+        if (gUseIndex && indexed && indexCount > 0)
+        {
+            saveIndex(filename, hash);
+        }
     }
 
+    analysisIndexed = false;
     gNowWriting = false;
 
     return 0;
@@ -1166,8 +2522,12 @@ static void changeGainAndTag(const char *filename,
     }// if (leftgainchange !=0 ...
 }
 
-static int queryUserForClipping(char *argv_mainloop, int intGainChange)
+static int queryUserForClipping(const char *argv_mainloop, int intGainChange)
 {
+    /* only one worker at a time gets to ask */
+    static pthread_mutex_t promptLock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&promptLock);
     fprintf(stderr, "%s: WARNING: %s may clip with mp3 gain change %d\n",
             gProgramName, argv_mainloop, intGainChange);
 
@@ -1183,6 +2543,7 @@ static int queryUserForClipping(char *argv_mainloop, int intGainChange)
         }
         ch = toupper(ch);
     }
+    pthread_mutex_unlock(&promptLock);
     if (ch == 'N')
     {
         return 0;
@@ -1252,6 +2613,8 @@ static void fullUsage()
            "\t          not Joint Stereo)\n"
            "\t-l 1 <i> - apply gain i to channel 1 (right channel)\n"
            "\t-e - skip Album analysis, even if multiple files listed\n"
+           "\t-j <n> - process up to n files at the same time\n"
+           "\t-b <n> - decode each long file as n blocks at the same time\n"
            "\t-r - apply Track gain automatically (all files set to equal loudness)\n"
            "\t-k - automatically lower Track/Album gain to not clip audio\n"
            "\t-a - apply Album gain automatically (files are all from the same\n"
@@ -1264,6 +2627,14 @@ static void fullUsage()
            "\t-o - output is a database-friendly tab-delimited list\n"
            "\t-t - writes modified data to temp file, then deletes original\n"
            "\t     instead of modifying bytes in original file\n"
+           "\t--stats - report the writes needed to change each file in place\n"
+           "\t--index - keep an index of the gain fields next to each file\n"
+           "\t          changed, so the next change need not search for them\n"
+           "\t--lame-tag - take the peak and track gain from the LAME tag\n"
+           "\t          where it has them, instead of decoding the file\n"
+           "\t--verify-crc - only check the CRC of each protected frame\n"
+           "\t--id3-padding <n> - leave n bytes of padding (default 1024) when\n"
+           "\t          an ID3v2 tag grows, so later updates fit in place\n"
            "\t-q - Quiet mode: no status messages\n"
            "\t-p - Preserve original file timestamp\n"
            "\t-x - Only find max. amplitude of file\n"
@@ -1286,71 +2657,1555 @@ static void fullUsage()
     exit(0);
 }
 
-int main(int argc, char **argv)
+/* Allocate the read and write buffers of the calling thread */
+static void initWorkerState(void)
 {
-    MPSTR mp;
-    int mode;
-    unsigned char *Xingcheck;
-    unsigned long frame;
-    int nchan;
-    int bitridx;
-    int freqidx;
-    long bytesinframe;
-    double dBchange;
-    double dblGainChange;
-    int intGainChange = 0;
-    int intAlbumGainChange = 0;
-    int nprocsamp;
-    int first = 1;
-    Float_t maxsample;
-    Float_t lsamples[1152];
-    Float_t rsamples[1152];
-    unsigned char maxgain;
-    unsigned char mingain;
-    int ignoreClipWarning = 0;
-    int autoClip = 0;
-    bool applyTrack = false;
-    bool applyAlbum = false;
-    int analysisTrack = 0;
-    bool analysisError = false;
-    int databaseFormat = 0;
-    int *fileok;
-    int goAhead;
-    bool directGain = false;
-    bool directSingleChannelGain = false;
-    int directGainVal = 0;
-    int mp3GainMod = 0;
-    double dBGainMod = 0;
-    int mpegver;
-    int sideinfo_len;
-    long gFilesize = 0;
-    int decodeSuccess;
-    struct MP3GainTagInfo *tagInfo;
-    struct MP3GainTagInfo *curTag;
-    struct FileTagsStruct *fileTags;
-    int albumRecalc;
-    double curAlbumGain = 0;
-    double curAlbumPeak = 0;
-    unsigned char curAlbumMinGain = 0;
-    unsigned char curAlbumMaxGain = 0;
+    if (readbuffer == NULL)
+    {
+        buffer = readbuffer = malloc(BUFFERSIZE);
+        writebuffer = malloc(sizeof(wbuffer) * WRITEBUFFERSIZE);
+    }
+}
 
-    gSuccess = true;
-    gProgramName = basename(argv[0]);
+static void freeWorkerState(void)
+{
+    stopReading();
+    free(readbuffer);
+    buffer = readbuffer = NULL;
+    free(writebuffer);
+    writebuffer = NULL;
+    free(indexEntries);
+    indexEntries = NULL;
+    indexCount = indexAlloc = 0;
+}
 
-    if (argc < 2)
+/* How many audio frames filename has: the count in its Xing/Info header
+   when it has one, or else its audio bytes over the length of its first
+   frame, which is exact for CBR.  tags are the ones main() read, for the
+   end of the audio.  0 if there is no frame near the start */
+static long estimateFrames(const char *filename, const struct FileTagsStruct *tags)
+{
+    unsigned char head[XING_PROBE];
+    VBRTAGDATA xing;
+    struct stat st;
+    unsigned long start = 0;
+    unsigned long end;
+    ssize_t n = 0;
+    FILE *f = openFile(filename, "rb");
+
+    if (f == NULL)
     {
-        errUsage();
+        return 0;
     }
+    if (sessionStat(filename, &st) == 0 && S_ISREG(st.st_mode) &&
+        pread(fileno(f), head, 10, 0) == 10)
+    {
+        start = id3v2Length(head);
+        n = pread(fileno(f), head, sizeof(head), start);
+    }
+    closeFile(f);
 
-    bool ok = true;
-    maxAmpOnly = false;
-    gSaveTime = false;
-    int fileStart = 1;
-    numFiles = 0;
-
-    for (int i = 1; i < argc; i++)
+    for (const unsigned char *p = head; n >= HEADERSIZE && p + HEADERSIZE <= head + n; p++)
     {
-        const char *arg = argv[i];
+        p = syncScan(p, head + n - HEADERSIZE);
+        if (p + HEADERSIZE > head + n)
+        {
+            break;
+        }
+        if ((p[1] & 0x06) != 0x02 || (p[1] & 0x18) == 0x08 ||
+            (p[2] & 0xF0) == 0xF0 || (p[2] & 0xF0) == 0x00 || (p[2] & 0x0C) == 0x0C)
+        {
+            continue;   /* not a Layer III header */
+        }
+        if (p + frameLength(p) + HEADERSIZE <= head + n && !sameHeader(p + frameLength(p), p))
+        {
+            continue;   /* a false sync: the next frame is not there */
+        }
+        if (p + XING_HEADER_MAX <= head + n && GetVbrTag(&xing, (unsigned char *)p) &&
+            (xing.flags & FRAMES_FLAG) && xing.frames > 0)
+        {
+            return xing.frames;
+        }
+        end = tags->fileSize == st.st_size ? (unsigned long)tags->tagOffset : (unsigned long)st.st_size;
+        start += p - head;
+        return end > start ? (long)((end - start) / frameLength(p)) : 0;
+    }
+    return 0;
+}
+
+typedef void (*fileJob)(int argi, FILE *out);
+
+struct jobQueue
+{
+    pthread_mutex_t lock;
+    fileJob job;
+    int next;       /* next place in order to hand out */
+    int *order;     /* the files, longest first */
+    int printed;    /* next file whose output goes to stdout */
+    int end;
+    char **text;
+    size_t *textLen;
+    bool *done;
+    GainAnalysis *album;   /* every worker's titles */
+};
+
+/* job() on one file, in a session of its own */
+static void runJob(fileJob job, int argi, FILE *out)
+{
+    startSession(fileNames[argi]);
+    curTags = fileTags + argi;
+    job(argi, out);
+    curTags = NULL;
+    endSession();
+}
+
+static void *fileWorker(void *arg)
+{
+    struct jobQueue *q = arg;
+
+    initWorkerState();
+    for (;;)
+    {
+        pthread_mutex_lock(&q->lock);
+        int next = q->next++;
+        pthread_mutex_unlock(&q->lock);
+        if (next >= q->end)
+        {
+            break;
+        }
+        int argi = q->order[next];
+
+        FILE *out = open_memstream(&q->text[argi], &q->textLen[argi]);
+        runJob(q->job, argi, out ? out : stdout);
+        if (out)
+        {
+            fclose(out);
+        }
+
+        /* print whatever is finished, in command line order */
+        pthread_mutex_lock(&q->lock);
+        q->done[argi] = true;
+        while (q->printed < q->end && q->done[q->printed])
+        {
+            if (q->text[q->printed])
+            {
+                fwrite(q->text[q->printed], 1, q->textLen[q->printed], stdout);
+                free(q->text[q->printed]);
+            }
+            q->printed++;
+        }
+        fflush(stdout);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    pthread_mutex_lock(&q->lock);
+    MergeAlbumGain(q->album, DefaultGainAnalysis());
+    pthread_mutex_unlock(&q->lock);
+    freeWorkerState();
+    return NULL;
+}
+
+static int longerFile(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    if (fileFrames[x] != fileFrames[y])
+    {
+        return fileFrames[x] > fileFrames[y] ? -1 : 1;
+    }
+    return x - y;
+}
+
+/* Run job() on files start..end-1, on up to gJobs threads.  The threads
+   take the longest files first, so that one long file picked up last does
+   not keep the others waiting; the output still comes in command line
+   order */
+static void runFileJobs(int start, int end, fileJob job)
+{
+    int nthreads = end - start < gJobs ? end - start : gJobs;
+    int created = 0;
+
+    if (nthreads > 1)
+    {
+        struct jobQueue *q = calloc(1, sizeof(struct jobQueue));
+        pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+
+        pthread_mutex_init(&q->lock, NULL);
+        q->job = job;
+        q->next = start;
+        q->order = malloc(sizeof(int) * end);
+        for (int argi = start; argi < end; argi++)
+        {
+            q->order[argi] = argi;
+        }
+        qsort(q->order + start, end - start, sizeof(int), longerFile);
+        q->printed = start;
+        q->end = end;
+        q->text = calloc(end, sizeof(char *));
+        q->textLen = calloc(end, sizeof(size_t));
+        q->done = calloc(end, sizeof(bool));
+        q->album = CreateGainAnalysis();
+
+        for (int i = 0; i < nthreads; i++)
+        {
+            if (pthread_create(&threads[created], NULL, fileWorker, q) == 0)
+            {
+                created++;
+            }
+        }
+        for (int i = 0; i < created; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        /* album gain is computed by this thread, over every worker's tracks */
+        MergeAlbumGain(DefaultGainAnalysis(), q->album);
+
+        start = q->next < end ? q->next : end; /* nothing left unless no thread started */
+        pthread_mutex_destroy(&q->lock);
+        free(q->order);
+        free(q->text);
+        free(q->textLen);
+        free(q->done);
+        FreeGainAnalysis(q->album);
+        free(q);
+        free(threads);
+    }
+
+    for (int argi = start; argi < end; argi++)
+    {
+        runJob(job, argi, stdout);
+    }
+}
+
+/* -b: a long file is cut at frame boundaries into blocks that are decoded
+   and analyzed on their own threads.  Each block first decodes
+   BLOCK_WARMUP_FRAMES frames of the previous block, to fill the bit
+   reservoir and the synthesis and loudness filter histories, and its
+   histogram starts at the last 50 ms RMS window boundary before its first
+   frame.  A serial run gets no samples from its first frame when that
+   frame's main data starts in a previous one (a file cut mid-stream), so
+   then every block places its samples one frame earlier.  So the blocks
+   count exactly the windows of a serial run, and only the filter history
+   at the start of a block can differ.  The track gain stays within 0.01 dB
+   (one histogram step) of the serial result, also for cut files; on the
+   example files it is identical.  Only a stream with side info the
+   decoder rejects, which restarts it, can still shift the windows. */
+#define BLOCK_WARMUP_FRAMES 20
+#define BLOCK_MIN_FRAMES    1000
+#define BLOCK_READSIZE      (1 << 20)
+
+struct analysisBlock
+{
+    const char *filename;
+    const unsigned char *mapping;   /* the whole file, or NULL to read it */
+    unsigned long mappingSize;
+    const unsigned long *frameOffset;
+    const int *frameBytes;
+    long warmupFrame;       /* first frame decoded */
+    long firstFrame;        /* first frame whose peak counts */
+    long endFrame;
+    long nframes;
+    long samplesPerFrame;
+    long lostSamples;       /* not decoded from the first frame */
+    long firstSample;       /* analyzed samples are firstSample..endSample-1 */
+    long endSample;
+    long freq;
+    GainAnalysis *ctx;      /* NULL if only the peak is wanted */
+    Float_t maxsample;
+    bool analysisError;
+};
+
+static void *analyzeBlock(void *arg)
+{
+    struct analysisBlock *blk = arg;
+    MPSTR mp;
+    Float_t lsamples[1152];
+    Float_t rsamples[1152];
+    Float_t warmupMax;
+    unsigned char dummyMax, dummyMin;
+    const unsigned char *data = blk->mapping;
+    unsigned char *readbuf = NULL;
+    unsigned long dataStart = 0;
+    unsigned long dataLen = blk->mappingSize;
+    int nprocsamp;
+    FILE *f = NULL;
+
+    if (data == NULL)
+    {
+        f = fopen(blk->filename, "rb");
+        data = readbuf = malloc(BLOCK_READSIZE);
+        if (f == NULL || readbuf == NULL)
+        {
+            fprintf(stderr, "%s: Can't open %s for reading\n",
+                    gProgramName, blk->filename);
+            blk->analysisError = true;
+            if (f)
+            {
+                fclose(f);
+            }
+            free(readbuf);
+            return NULL;
+        }
+    }
+
+    InitMP3(&mp);
+    if (blk->ctx)
+    {
+        InitGainAnalysisCtx(blk->ctx, blk->freq);
+    }
+    maxGain = &dummyMax;
+    minGain = &dummyMin;
+
+    /* decodeMP3() returns the samples of each frame when it is given the
+       next one, so pos is the position of frame i - 1 */
+    long pos = (blk->warmupFrame - 1) * blk->samplesPerFrame - blk->lostSamples;
+    for (long i = blk->warmupFrame; i <= blk->endFrame && i < blk->nframes && pos < blk->endSample; i++)
+    {
+        unsigned long offset = blk->frameOffset[i];
+        int bytes = blk->frameBytes[i];
+
+        if (f != NULL && (offset < dataStart || offset + bytes > dataStart + dataLen))
+        {
+            dataStart = offset;
+            fseek(f, offset, SEEK_SET);
+            dataLen = fread(readbuf, 1, BLOCK_READSIZE, f);
+            if (dataLen < (unsigned long)bytes)   /* truncated last frame */
+            {
+                memset(readbuf + dataLen, 0, bytes - dataLen);
+                dataLen = bytes;
+            }
+        }
+
+        lSamp = lsamples;
+        rSamp = rsamples;
+        maxSamp = i > blk->firstFrame ? &blk->maxsample : &warmupMax;
+        procSamp = 0;
+        if (decodeMP3(&mp, data + (offset - dataStart), bytes, &nprocsamp) == MP3_OK && blk->ctx)
+        {
+            int nchan = mp.fr.stereo;
+            long n = procSamp / nchan;
+            long skip = 0;
+
+            if (pos + n > blk->endSample)
+            {
+                n = blk->endSample - pos;
+            }
+            if (pos < blk->firstSample)
+            {
+                skip = blk->firstSample - pos < n ? blk->firstSample - pos : n;
+                AnalyzeSamplesCtx(blk->ctx, lsamples, rsamples, skip, nchan);
+                if (pos + skip == blk->firstSample)
+                {
+                    RestartWindowsCtx(blk->ctx);
+                }
+            }
+            if (AnalyzeSamplesCtx(blk->ctx, lsamples + skip, rsamples + skip, n - skip, nchan) == GAIN_ANALYSIS_ERROR)
+            {
+                blk->analysisError = true;
+                break;
+            }
+        }
+        pos += blk->samplesPerFrame;
+    }
+
+    ExitMP3(&mp);
+    if (f != NULL)
+    {
+        free(readbuf);
+        fclose(f);
+    }
+    return NULL;
+}
+
+/* Finish decoding the current file with -b, from its first audio frame at
+   curframe.  expectedFrames (0 if not known) sizes the frame tables up
+   front.  Returns false if the analysis failed */
+static bool analyzeInBlocks(const char *filename, bool analyze, long expectedFrames,
+                            Float_t *maxsample, unsigned char *maxgain, unsigned char *mingain)
+{
+    long allocated = expectedFrames > 0 ? expectedFrames + 1 : 65536;
+    unsigned long *frameOffset = malloc(allocated * sizeof(*frameOffset));
+    int *frameBytes = malloc(allocated * sizeof(*frameBytes));
+    long nframes = 0;
+    long lostFrames = 0;
+    bool ok = true;
+    bool analysisError = false;
+
+    /* find the frames the serial loop would decode, and their global_gain
+       range while we're at it */
+    maxGain = maxgain;
+    minGain = mingain;
+    while (ok)
+    {
+        int bitridx = (curframe[2] >> 4) & 0x0F;
+        if (bitridx == 0)
+        {
+            fprintf(stderr, "%s: %s is free format (not currently supported)\n",
+                    gProgramName, curfilename);
+            analysisIndexed = false;
+            break;
+        }
+        long bytesinframe = arrbytesinframe[bitridx] + ((curframe[2] >> 1) & 0x01);
+
+        indexAnalyzedFrame();
+        if (inbuffer >= bytesinframe)
+        {
+            if (nframes == allocated)
+            {
+                allocated *= 2;
+                frameOffset = realloc(frameOffset, allocated * sizeof(*frameOffset));
+                frameBytes = realloc(frameBytes, allocated * sizeof(*frameBytes));
+            }
+            frameOffset[nframes] = filepos - inbuffer + (curframe - buffer);
+            frameBytes[nframes] = bytesinframe;
+            if (nframes == 0)
+            {
+                /* main_data_begin: the decoder has no reservoir to take
+                   it from yet */
+                const unsigned char *side = curframe + ((curframe[1] & 0x01) ? 4 : 6);
+                int mainDataBegin = ((curframe[1] >> 3) & 0x03) == 3 ? (side[0] << 1) | (side[1] >> 7) : side[0];
+                lostFrames = mainDataBegin > 0;
+            }
+            nframes++;
+            scanFrameGain();
+        }
+
+        wrdpntr = curframe + bytesinframe;
+        ok = frameSearch(0);
+    }
+
+    long nblocks = nframes / BLOCK_MIN_FRAMES;
+    if (nblocks > gBlocks)
+    {
+        nblocks = gBlocks;
+    }
+    if (nblocks < 1)
+    {
+        nblocks = 1;
+    }
+
+    struct analysisBlock *blocks = calloc(nblocks, sizeof(struct analysisBlock));
+    pthread_t *threads = malloc(nblocks * sizeof(pthread_t));
+    bool *started = calloc(nblocks, sizeof(bool));
+    long samplesPerFrame = ((curframe[1] >> 3) & 0x03) == 3 ? 1152 : 576;
+    long window = analyze ? WindowSamplesCtx(DefaultGainAnalysis()) : 1;
+    long lostSamples = lostFrames * samplesPerFrame;
+
+    for (long b = 0; b < nblocks; b++)
+    {
+        struct analysisBlock *blk = blocks + b;
+        long endFrame = nframes * (b + 1) / nblocks;
+
+        blk->filename = filename;
+        blk->mapping = mapping;
+        blk->mappingSize = mappingSize;
+        blk->frameOffset = frameOffset;
+        blk->frameBytes = frameBytes;
+        blk->firstFrame = nframes * b / nblocks;
+        blk->endFrame = endFrame;
+        blk->nframes = nframes;
+        blk->samplesPerFrame = samplesPerFrame;
+        blk->lostSamples = lostSamples;
+        blk->firstSample = b == 0 ? 0 : (blk->firstFrame * samplesPerFrame - lostSamples) / window * window;
+        blk->endSample = b == nblocks - 1 ? LONG_MAX : (endFrame * samplesPerFrame - lostSamples) / window * window;
+        blk->warmupFrame = (blk->firstSample + lostSamples) / samplesPerFrame - BLOCK_WARMUP_FRAMES;
+        if (blk->warmupFrame < 0 || b == 0)
+        {
+            blk->warmupFrame = 0;
+        }
+        blk->freq = (long)(lastfreq * 1000.0);
+        blk->ctx = analyze ? CreateGainAnalysis() : NULL;
+        blk->maxsample = 0;
+    }
+
+    for (long b = 1; b < nblocks; b++)
+    {
+        started[b] = pthread_create(&threads[b], NULL, analyzeBlock, blocks + b) == 0;
+    }
+    analyzeBlock(blocks);
+    for (long b = 1; b < nblocks; b++)
+    {
+        if (!started[b])
+        {
+            analyzeBlock(blocks + b);
+        }
+        else
+        {
+            pthread_join(threads[b], NULL);
+        }
+    }
+
+    for (long b = 0; b < nblocks; b++)
+    {
+        if (blocks[b].maxsample > *maxsample)
+        {
+            *maxsample = blocks[b].maxsample;
+        }
+        if (blocks[b].ctx)
+        {
+            MergeTitleGain(DefaultGainAnalysis(), blocks[b].ctx);
+            FreeGainAnalysis(blocks[b].ctx);
+        }
+        analysisError |= blocks[b].analysisError;
+    }
+
+    free(blocks);
+    free(threads);
+    free(started);
+    free(frameOffset);
+    free(frameBytes);
+    return !analysisError;
+}
+
+/* The LAME extension after the Xing/Info header ends with a CRC-16 (the
+   reflected 0xA001 kind, from 0) of everything in the frame before it */
+static uint16_t lameTagCrc(const unsigned char *p, const unsigned char *end)
+{
+    uint16_t crc = 0;
+
+    for (; p < end; p++)
+    {
+        crc ^= *p;
+        for (int i = 0; i < 8; i++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+/* The peak (in PCM units) and Radio ReplayGain (in dB) the encoder left in
+   the LAME extension of the Xing/Info frame at frame, for --lame-tag.
+   Returns false unless the extension is there, its CRC is right and both
+   fields were filled in */
+static bool readLameTag(const unsigned char *frame, long framelen,
+                        const unsigned char *xing, Float_t *peak, double *gain)
+{
+    const unsigned char *ext = xing + 8;
+    unsigned long flags = (unsigned long)getBE(xing + 4, 4);
+    unsigned long amplitude;
+    int radio;
+
+    ext += (flags & 0x01) ? 4 : 0;      /* frames */
+    ext += (flags & 0x02) ? 4 : 0;      /* bytes */
+    ext += (flags & 0x04) ? 100 : 0;    /* TOC */
+    ext += (flags & 0x08) ? 4 : 0;      /* quality */
+    if (ext + LAME_EXT_SIZE > frame + framelen ||
+        lameTagCrc(frame, ext + LAME_EXT_SIZE - 2) != getBE(ext + LAME_EXT_SIZE - 2, 2))
+    {
+        return false;
+    }
+
+    /* the peak is fixed point, 1 << 23 for a full scale sample */
+    amplitude = (unsigned long)getBE(ext + 11, 4);
+    /* name code 1 (radio), an originator, a sign and tenths of a dB */
+    radio = (int)getBE(ext + 15, 2);
+    if (amplitude == 0 || (radio >> 13) != 1 || ((radio >> 10) & 0x07) == 0)
+    {
+        return false;
+    }
+    *peak = (Float_t)amplitude / (1 << 23) * 32767.0;
+    *gain = ((radio & 0x200) ? -1 : 1) * (radio & 0x1FF) / 10.0;
+    return true;
+}
+
+/* Can the peak and track gain of file argi come from its LAME tag?  Only
+   when the album gain is not analyzed from the decoded samples of every
+   file, and when mp3gain has not changed the gain since it was encoded */
+static bool lameTagUsable(int argi)
+{
+    const struct MP3GainTagInfo *tag = tagInfo + argi;
+
+    return gLameTag && !maxAmpOnly &&
+           (tag->recalc & (FULL_RECALC | AMP_RECALC)) &&
+           (applyTrack || analysisTrack || !(albumRecalc & FULL_RECALC)) &&
+           !(tag->haveUndo && (tag->undoLeft != 0 || tag->undoRight != 0));
+}
+
+/* Analyze and/or modify one file.  Runs on a worker thread when -j is given,
+   so anything it prints goes to `out` rather than stdout */
+static void processFile(int argi, FILE *out)
+{
+    const char *filename = fileNames[argi];
+    MPSTR mp;
+    int mode;
+    unsigned char *Xingcheck;
+    unsigned long frame;
+    int nchan;
+    int bitridx;
+    int freqidx;
+    long bytesinframe;
+    double dBchange;
+    double dblGainChange;
+    int intGainChange = 0;
+    int intAlbumGainChange = 0;
+    int nprocsamp;
+    Float_t maxsample;
+    Float_t lsamples[1152];
+    Float_t rsamples[1152];
+    unsigned char maxgain;
+    unsigned char mingain;
+    bool analysisError = false;
+    int goAhead;
+    int mpegver;
+    int sideinfo_len;
+    long gFilesize = 0;
+    int decodeSuccess;
+    struct MP3GainTagInfo *curTag;
+    bool ok = true;
+
+    memset(&mp, 0, sizeof(mp));
+
+    // if the entire Album requires some kind of recalculation, then each
+    // track needs it
+    tagInfo[argi].recalc |= albumRecalc;
+
+    curfilename = filename;
+    if (gCheckTagOnly)
+    {
+        curTag = tagInfo + argi;
+        if (curTag->haveTrackGain)
+        {
+            dblGainChange = curTag->trackGain / (5.0 * log10(2.0));
+
+            if (fabs(dblGainChange) - (double)((int)(fabs(dblGainChange))) < 0.5)
+            {
+                intGainChange = (int)(dblGainChange);
+            }
+            else
+            {
+                intGainChange = (int)(dblGainChange) + (dblGainChange < 0 ? -1 : 1);
+            }
+        }
+        if (curTag->haveAlbumGain)
+        {
+            dblGainChange = curTag->albumGain / (5.0 * log10(2.0));
+
+            if (fabs(dblGainChange) - (double)((int)(fabs(dblGainChange))) < 0.5)
+            {
+                intAlbumGainChange = (int)(dblGainChange);
+            }
+            else
+            {
+                intAlbumGainChange = (int)(dblGainChange) + (dblGainChange < 0 ? -1 : 1);
+            }
+        }
+        if (!gQuiet && !databaseFormat)
+        {
+            fprintf(out, "%s\n", filename);
+            if (curTag->haveTrackGain)
+            {
+                fprintf(out, "Recommended \"Track\" dB change: %f\n", curTag->trackGain);
+                fprintf(out, "Recommended \"Track\" mp3 gain change: %d\n", intGainChange);
+                if (curTag->haveTrackPeak)
+                {
+                    if (curTag->trackPeak * (Float_t)(pow(2.0, (double)(intGainChange) / 4.0)) > 1.0)
+                    {
+                        fprintf(out, "WARNING: some clipping may occur with this gain change!\n");
+                    }
+                }
+            }
+            if (curTag->haveTrackPeak)
+            {
+                fprintf(out, "Max PCM sample at current gain: %f\n", curTag->trackPeak * 32768.0);
+            }
+            if (curTag->haveMinMaxGain)
+            {
+                fprintf(out, "Max mp3 global gain field: %d\n", curTag->maxGain);
+                fprintf(out, "Min mp3 global gain field: %d\n", curTag->minGain);
+            }
+            if (curTag->haveAlbumGain)
+            {
+                fprintf(out, "Recommended \"Album\" dB change: %f\n", curTag->albumGain);
+                fprintf(out, "Recommended \"Album\" mp3 gain change: %d\n", intAlbumGainChange);
+                if (curTag->haveTrackPeak)
+                {
+                    if (curTag->trackPeak * (Float_t)(pow(2.0, (double)(intAlbumGainChange) / 4.0)) > 1.0)
+                    {
+                        fprintf(out, "WARNING: some clipping may occur with this gain change!\n");
+                    }
+                }
+            }
+            if (curTag->haveAlbumPeak)
+            {
+                fprintf(out, "Max Album PCM sample at current gain: %f\n", curTag->albumPeak * 32768.0);
+            }
+            if (curTag->haveAlbumMinMaxGain)
+            {
+                fprintf(out, "Max Album mp3 global gain field: %d\n", curTag->albumMaxGain);
+                fprintf(out, "Min Album mp3 global gain field: %d\n", curTag->albumMinGain);
+            }
+            fprintf(out, "\n");
+        }
+        else
+        {
+            fprintf(out, "%s\t", filename);
+            if (curTag->haveTrackGain)
+            {
+                fprintf(out, "%d\t", intGainChange);
+                fprintf(out, "%f\t", curTag->trackGain);
+            }
+            else
+            {
+                fprintf(out, "NA\tNA\t");
+            }
+            if (curTag->haveTrackPeak)
+            {
+                fprintf(out, "%f\t", curTag->trackPeak * 32768.0);
+            }
+            else
+            {
+                fprintf(out, "NA\t");
+            }
+            if (curTag->haveMinMaxGain)
+            {
+                fprintf(out, "%d\t", curTag->maxGain);
+                fprintf(out, "%d\t", curTag->minGain);
+            }
+            else
+            {
+                fprintf(out, "NA\tNA\t");
+            }
+            if (curTag->haveAlbumGain)
+            {
+                fprintf(out, "%d\t", intAlbumGainChange);
+                fprintf(out, "%f\t", curTag->albumGain);
+            }
+            else
+            {
+                fprintf(out, "NA\tNA\t");
+            }
+            if (curTag->haveAlbumPeak)
+            {
+                fprintf(out, "%f\t", curTag->albumPeak * 32768.0);
+            }
+            else
+            {
+                fprintf(out, "NA\t");
+            }
+            if (curTag->haveAlbumMinMaxGain)
+            {
+                fprintf(out, "%d\t", curTag->albumMaxGain);
+                fprintf(out, "%d\n", curTag->albumMinGain);
+            }
+            else
+            {
+                fprintf(out, "NA\tNA\n");
+            }
+            fflush(out);
+        }
+    }
+    else if (undoChanges)
+    {
+        if ((tagInfo[argi].haveUndo) && (tagInfo[argi].undoLeft || tagInfo[argi].undoRight))
+        {
+            if (!gQuiet && !databaseFormat)
+            {
+                fprintf(out, "Undoing mp3gain changes (%d,%d) to %s...\n",
+                        tagInfo[argi].undoLeft, tagInfo[argi].undoRight,
+                        filename);
+            }
+
+            if (databaseFormat)
+            {
+                fprintf(out, "%s\t%d\t%d\n", filename, tagInfo[argi].undoLeft, tagInfo[argi].undoRight);
+            }
+
+            changeGainAndTag(filename,
+                             tagInfo[argi].undoLeft, tagInfo[argi].undoRight,
+                             tagInfo + argi, fileTags + argi);
+
+        }
+        else
+        {
+            if (databaseFormat)
+            {
+                fprintf(out, "%s\t0\t0\n", filename);
+            }
+            else if (!gQuiet)
+            {
+                if (tagInfo[argi].haveUndo)
+                {
+                    fprintf(stderr, "%s: No changes to undo in %s\n",
+                            gProgramName, filename);
+                }
+                else
+                {
+                    fprintf(stderr, "%s: No undo information in %s\n",
+                            gProgramName, filename);
+                }
+                gSuccess = false;
+            }
+        }
+    }
+    else if (directSingleChannelGain)
+    {
+        if (!gQuiet)
+        {
+            fprintf(out, "Applying gain change of %d to CHANNEL %d of %s...\n",
+                    directGainVal, whichChannel, filename);
+        }
+        if (whichChannel)   /* do right channel */
+        {
+            if (gSkipTag)
+            {
+                changeGain(filename, 0, directGainVal);
+            }
+            else
+            {
+                changeGainAndTag(filename, 0, directGainVal, tagInfo + argi, fileTags + argi);
+            }
+        }
+        else   /* do left channel */
+        {
+            if (gSkipTag)
+            {
+                changeGain(filename, directGainVal, 0);
+            }
+            else
+            {
+                changeGainAndTag(filename, directGainVal, 0, tagInfo + argi, fileTags + argi);
+            }
+        }
+        if (!gQuiet && gSuccess)
+        {
+            fprintf(out, "\ndone\n");
+        }
+    }
+    else if (directGain)
+    {
+        if (!gQuiet)
+        {
+            fprintf(out, "Applying gain change of %d to %s...\n",
+                    directGainVal, filename);
+        }
+        if (gSkipTag)
+        {
+            changeGain(filename, directGainVal, directGainVal);
+        }
+        else
+        {
+            changeGainAndTag(filename,
+                             directGainVal, directGainVal, tagInfo + argi,
+                             fileTags + argi);
+        }
+        if (!gQuiet && gSuccess)
+        {
+            fprintf(out, "\ndone\n");
+        }
+    }
+    else if (gDeleteTag)
+    {
+        {
+            RemoveMP3GainAPETag(filename, gSaveTime);
+            if (gUseId3)
+            {
+                RemoveMP3GainID3Tag(filename, gSaveTime);
+            }
+        }
+        if (!gQuiet && !databaseFormat)
+        {
+            fprintf(out, "Deleting tag info of %s...\n", filename);
+        }
+        if (databaseFormat)
+        {
+            fprintf(out, "%s\tNA\tNA\tNA\tNA\tNA\n", filename);
+        }
+    }
+    else
+    {
+        if (!databaseFormat && !gQuiet)
+        {
+            fprintf(out, "%s\n", filename);
+        }
+
+        if (tagInfo[argi].recalc > 0)
+        {
+            gFilesize = getSizeOfFile(filename);
+
+            inf = openFile(filename, "rb");
+        }
+
+        if ((inf == NULL) && (tagInfo[argi].recalc > 0))
+        {
+            fprintf(stderr, "%s: Can't open %s for reading\n",
+                    gProgramName, filename);
+            gSuccess = false;
+        }
+        else
+        {
+            InitMP3(&mp);
+            if (tagInfo[argi].recalc == 0)
+            {
+                maxsample = tagInfo[argi].trackPeak * 32768.0;
+                maxgain = tagInfo[argi].maxGain;
+                mingain = tagInfo[argi].minGain;
+                ok = true;
+            }
+            else
+            {
+                if (!((tagInfo[argi].recalc & FULL_RECALC) || (tagInfo[argi].recalc & AMP_RECALC))) /* only min/max rescan */
+                {
+                    maxsample = tagInfo[argi].trackPeak * 32768.0;
+                }
+                else
+                {
+                    maxsample = 0;
+                }
+                {
+                    gBadLayer = false;
+                    LayerSet = Reckless;
+                    maxgain = 0;
+                    mingain = 255;
+                    ok = startReading(filename);
+                    startAnalysisIndex(applyTrack);
+                }
+            }
+            if (ok)
+            {
+                if (tagInfo[argi].recalc > 0)
+                {
+                    wrdpntr = buffer;
+
+                    ok = frameSearch(true);
+                }
+
+                if (!ok)
+                {
+                    if (!gBadLayer)
+                    {
+                        fprintf(stderr, "%s: Can't find any valid MP3 frames in file %s\n",
+                                gProgramName, filename);
+                        gSuccess = false;
+                    }
+                }
+                else
+                {
+                    LayerSet = 1; /* We've found at least one valid layer 3 frame.
+                                     Assume any later layer 1 or 2 frames are just
+                                     bitstream corruption */
+                    fileok[argi] = true;
+                    numFiles++;
+
+                    if (tagInfo[argi].recalc > 0)
+                    {
+                        mode = (curframe[3] >> 6) & 3;
+
+                        if ((curframe[1] & 0x08) == 0x08) /* MPEG 1 */
+                        {
+                            sideinfo_len = ((curframe[3] & 0xC0) == 0xC0) ? 4 + 17 : 4 + 32;
+                        }
+                        else                /* MPEG 2 */
+                        {
+                            sideinfo_len = ((curframe[3] & 0xC0) == 0xC0) ? 4 + 9 : 4 + 17;
+                        }
+
+                        if (!(curframe[1] & 0x01))
+                        {
+                            sideinfo_len += 2;
+                        }
+
+                        Xingcheck = curframe + sideinfo_len;
+                        //LAME CBR files have "Info" tags, not "Xing" tags
+                        if ((Xingcheck[0] == 'X' && Xingcheck[1] == 'i' && Xingcheck[2] == 'n' && Xingcheck[3] == 'g') ||
+                            (Xingcheck[0] == 'I' && Xingcheck[1] == 'n' && Xingcheck[2] == 'f' && Xingcheck[3] == 'o'))
+                        {
+                            bitridx = (curframe[2] >> 4) & 0x0F;
+                            if (bitridx == 0)
+                            {
+                                fprintf(stderr, "%s: %s is free format (not currently supported)\n",
+                                        gProgramName, curfilename);
+                                ok = false;
+                                analysisIndexed = false;
+                            }
+                            else
+                            {
+                                Float_t lamePeak;
+                                double lameGain;
+
+                                mpegver = (curframe[1] >> 3) & 0x03;
+                                freqidx = (curframe[2] >> 2) & 0x03;
+
+                                bytesinframe = arrbytesinframe[bitridx] + ((curframe[2] >> 1) & 0x01);
+
+                                if (lameTagUsable(argi) &&
+                                    readLameTag(curframe, bytesinframe, Xingcheck, &lamePeak, &lameGain))
+                                {
+                                    /* take them as if they were stored tag
+                                       info, and only scan the gain fields */
+                                    curTag = tagInfo + argi;
+                                    curTag->recalc &= ~(FULL_RECALC | AMP_RECALC);
+                                    curTag->recalc |= MIN_MAX_GAIN_RECALC;
+                                    curTag->dirty = true;
+                                    curTag->haveTrackGain = true;
+                                    curTag->trackGain = lameGain;
+                                    curTag->haveTrackPeak = true;
+                                    curTag->trackPeak = lamePeak / 32768.0;
+                                    maxsample = lamePeak;
+                                    lameTagFiles++;
+                                }
+
+                                wrdpntr = curframe + bytesinframe;
+
+                                ok = frameSearch(0);
+                            }
+                        }
+
+                        frame = 1;
+
+                        if (!maxAmpOnly)
+                        {
+                            if (ok)
+                            {
+                                mpegver = (curframe[1] >> 3) & 0x03;
+                                freqidx = (curframe[2] >> 2) & 0x03;
+
+                                if (firstAnalysis)
+                                {
+                                    lastfreq = frequency[mpegver][freqidx];
+                                    InitGainAnalysis((long)(lastfreq * 1000.0));
+                                    analysisError = false;
+                                    firstAnalysis = 0;
+                                }
+                                else
+                                {
+                                    if (frequency[mpegver][freqidx] != lastfreq)
+                                    {
+                                        lastfreq = frequency[mpegver][freqidx];
+                                        ResetSampleFrequency((long)(lastfreq * 1000.0));
+                                    }
+                                }
+                            }
+                        }
+                        else
+                        {
+                            analysisError = false;
+                        }
+
+                        if (ok && gBlocks > 1 && !analysisError &&
+                            ((tagInfo[argi].recalc & AMP_RECALC) || (tagInfo[argi].recalc & FULL_RECALC)))
+                        {
+                            if (!analyzeInBlocks(filename, !maxAmpOnly && (tagInfo[argi].recalc & FULL_RECALC),
+                                                 fileFrames[argi], &maxsample, &maxgain, &mingain))
+                            {
+                                fprintf(stderr, "%s: Error analyzing further samples (max time reached)\n", gProgramName);
+                                analysisError = true;
+                            }
+                            ok = false;
+                        }
+
+                        while (ok)
+                        {
+                            bitridx = (curframe[2] >> 4) & 0x0F;
+                            if (bitridx == 0)
+                            {
+                                fprintf(stderr, "%s: %s is free format (not currently supported)\n",
+                                        gProgramName, curfilename);
+                                ok = false;
+                                analysisIndexed = false;
+                            }
+                            else
+                            {
+                                mpegver = (curframe[1] >> 3) & 0x03;
+                                freqidx = (curframe[2] >> 2) & 0x03;
+
+                                bytesinframe = arrbytesinframe[bitridx] + ((curframe[2] >> 1) & 0x01);
+                                mode = (curframe[3] >> 6) & 0x03;
+                                nchan = (mode == 3) ? 1 : 2;
+                                indexAnalyzedFrame();
+
+                                if (inbuffer >= bytesinframe)
+                                {
+                                    lSamp = lsamples;
+                                    rSamp = rsamples;
+                                    maxSamp = &maxsample;
+                                    maxGain = &maxgain;
+                                    minGain = &mingain;
+                                    procSamp = 0;
+                                    if ((tagInfo[argi].recalc & AMP_RECALC) || (tagInfo[argi].recalc & FULL_RECALC))
+                                    {
+                                        decodeSuccess = decodeMP3(&mp, curframe, bytesinframe, &nprocsamp);
+                                    }
+                                    else
+                                    {
+                                        /* don't need to actually decode
+                                           frame, just scan for min/max
+                                           gain values */
+                                        decodeSuccess = !MP3_OK;
+                                        scanFrameGain();//curframe);
+                                    }
+                                    if (decodeSuccess == MP3_OK)
+                                    {
+                                        if (!maxAmpOnly && (tagInfo[argi].recalc & FULL_RECALC))
+                                        {
+                                            if (AnalyzeSamples(lsamples, rsamples, procSamp / nchan, nchan) == GAIN_ANALYSIS_ERROR)
+                                            {
+                                                fprintf(stderr, "%s: Error analyzing further samples (max time reached)\n", gProgramName);
+                                                analysisError = true;
+                                                ok = false;
+                                            }
+                                        }
+                                    }
+                                }
+
+                                if (!analysisError)
+                                {
+                                    wrdpntr = curframe + bytesinframe;
+                                    ok = frameSearch(0);
+                                }
+
+                                if (!gQuiet)
+                                {
+                                    if (!(++frame % 200))
+                                    {
+                                        if (fileFrames[argi] > 0)
+                                        {
+                                            /* by frames, so a VBR file moves evenly */
+                                            reportPercentAnalyzed(frame < (unsigned long)fileFrames[argi] ?
+                                                                  frame * 100 / fileFrames[argi] : 100,
+                                                                  gFilesize);
+                                        }
+                                        else
+                                        {
+                                            reportPercentAnalyzed((int)(((double)(filepos - (inbuffer - (curframe + bytesinframe - buffer))) * 100.0) / gFilesize),
+                                                                  gFilesize);
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+
+                    if (analysisError)
+                    {
+                        analysisIndexed = false;
+                    }
+                    if (!gQuiet)
+                    {
+                        fprintf(stderr, "                                                 \r");
+                    }
+
+                    if (tagInfo[argi].recalc & FULL_RECALC)
+                    {
+                        if (maxAmpOnly)
+                        {
+                            dBchange = 0;
+                        }
+                        else
+                        {
+                            dBchange = GetTitleGain();
+                        }
+                    }
+                    else
+                    {
+                        dBchange = tagInfo[argi].trackGain;
+                    }
+
+                    if (dBchange == GAIN_NOT_ENOUGH_SAMPLES)
+                    {
+                        fprintf(stderr, "%s: Not enough samples in %s to do analysis\n",
+                                gProgramName, filename);
+                        gSuccess = false;
+                        numFiles--;
+                    }
+                    else
+                    {
+                        /* even if gSkipTag is on, we'll leave this part
+                           running just to store the minpeak and
+                           maxpeak */
+                        curTag = tagInfo + argi;
+                        if (!maxAmpOnly)
+                        {
+                            /* if we don't already have a tagged track
+                               gain OR we have it, but it doesn't match */
+                            if (!curTag->haveTrackGain ||
+                                (curTag->haveTrackGain &&
+                                 (fabs(dBchange - curTag->trackGain) >= 0.01))
+                               )
+                            {
+                                curTag->dirty = true;
+                                curTag->haveTrackGain = 1;
+                                curTag->trackGain = dBchange;
+                            }
+                        }
+                        if (!curTag->haveMinMaxGain || /* if minGain or
+                                                          maxGain doesn't
+                                                          match tag */
+                            (curTag->haveMinMaxGain &&
+                             (curTag->minGain != mingain || curTag->maxGain != maxgain)))
+                        {
+                            curTag->dirty = true;
+                            curTag->haveMinMaxGain = true;
+                            curTag->minGain = mingain;
+                            curTag->maxGain = maxgain;
+                        }
+
+                        if (!curTag->haveTrackPeak ||
+                            (curTag->haveTrackPeak &&
+                             (fabs(maxsample - (curTag->trackPeak) * 32768.0) >= 3.3)))
+                        {
+                            curTag->dirty = true;
+                            curTag->haveTrackPeak = true;
+                            curTag->trackPeak = maxsample / 32768.0;
+                        }
+                        /* the TAG version of the suggested Track Gain
+                           should ALWAYS be based on the 89dB standard.
+                           So we don't modify the suggested gain change
+                           until this point */
+
+                        dBchange += dBGainMod;
+
+                        dblGainChange = dBchange / (5.0 * log10(2.0));
+
+                        if (fabs(dblGainChange) - (double)((int)(fabs(dblGainChange))) < 0.5)
+                        {
+                            intGainChange = (int)(dblGainChange);
+                        }
+                        else
+                        {
+                            intGainChange = (int)(dblGainChange) + (dblGainChange < 0 ? -1 : 1);
+                        }
+                        intGainChange += mp3GainMod;
+
+                        if (databaseFormat)
+                        {
+                            fprintf(out, "%s\t%d\t%f\t%f\t%d\t%d\n", filename, intGainChange, dBchange, maxsample, maxgain, mingain);
+                            fflush(out);
+                        }
+                        if (!applyTrack && !applyAlbum)
+                        {
+                            if (!databaseFormat)
+                            {
+                                fprintf(out, "Recommended \"Track\" dB change: %f\n", dBchange);
+                                fprintf(out, "Recommended \"Track\" mp3 gain change: %d\n", intGainChange);
+                                if (maxsample * (Float_t)(pow(2.0, (double)(intGainChange) / 4.0)) > 32767.0)
+                                {
+                                    fprintf(out, "WARNING: some clipping may occur with this gain change!\n");
+                                }
+                                fprintf(out, "Max PCM sample at current gain: %f\n", maxsample);
+                                fprintf(out, "Max mp3 global gain field: %d\n", maxgain);
+                                fprintf(out, "Min mp3 global gain field: %d\n", mingain);
+                                fprintf(out, "\n");
+                            }
+                        }
+                        else if (applyTrack)
+                        {
+                            firstAnalysis = true; /* don't keep track of Album gain */
+                            if (inf)
+                            {
+                                closeFile(inf);
+                                inf = NULL;
+                            }
+                            goAhead = true;
+
+                            if (intGainChange == 0)
+                            {
+                                fprintf(out, "No changes to %s are necessary\n", filename);
+                                if (!gSkipTag && tagInfo[argi].dirty)
+                                {
+                                    fprintf(out, "...but tag needs update: Writing tag information for %s\n", filename);
+                                    WriteMP3GainTag(filename, tagInfo + argi, fileTags + argi, gSaveTime);
+                                }
+                            }
+                            else
+                            {
+                                if (autoClip)
+                                {
+                                    int intMaxNoClipGain = (int)(floor(4.0 * log10(32767.0 / maxsample) / log10(2.0)));
+                                    if (intGainChange > intMaxNoClipGain)
+                                    {
+                                        fprintf(out, "Applying auto-clipped mp3 gain change of %d to %s\n(Original suggested gain was %d)\n",
+                                                intMaxNoClipGain, filename, intGainChange);
+                                        intGainChange = intMaxNoClipGain;
+                                    }
+                                }
+                                else if (!ignoreClipWarning)
+                                {
+                                    if (maxsample * (Float_t)(pow(2.0, (double)(intGainChange) / 4.0)) > 32767.0)
+                                    {
+                                        if (queryUserForClipping(filename, intGainChange))
+                                        {
+                                            if (!gQuiet)
+                                            {
+                                                fprintf(out, "Applying mp3 gain change of %d to %s...\n", intGainChange, filename);
+                                            }
+                                        }
+                                        else
+                                        {
+                                            goAhead = 0;
+                                        }
+                                    }
+                                }
+                                if (goAhead)
+                                {
+                                    if (!gQuiet)
+                                    {
+                                        fprintf(out, "Applying mp3 gain change of %d to %s...\n", intGainChange, filename);
+                                    }
+                                    if (gSkipTag)
+                                    {
+                                        changeGain(filename, intGainChange, intGainChange);
+                                    }
+                                    else
+                                    {
+                                        changeGainAndTag(filename,
+                                                         intGainChange, intGainChange, tagInfo + argi, fileTags + argi);
+                                    }
+                                }
+                                else if (!gSkipTag && tagInfo[argi].dirty)
+                                {
+                                    fprintf(out, "Writing tag information for %s\n", filename);
+                                    WriteMP3GainTag(filename, tagInfo + argi, fileTags + argi, gSaveTime);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            ExitMP3(&mp);
+            stopReading();
+            analysisIndexed = false;
+            fflush(out);
+            if (inf)
+            {
+                closeFile(inf);
+                inf = NULL;
+            }
+        }
+    }
+}
+
+/* Apply the album gain change to one file (-a) */
+static void applyAlbumGain(int argi, FILE *out)
+{
+    const char *filename = fileNames[argi];
+    int goAhead;
+
+    if (fileok[argi])
+    {
+        goAhead = true;
+        if (albumGainChange == 0)
+        {
+            fprintf(out, "\nNo changes to %s are necessary\n", filename);
+            if (!gSkipTag && tagInfo[argi].dirty)
+            {
+                fprintf(out, "...but tag needs update: Writing tag information for %s\n", filename);
+                WriteMP3GainTag(filename, tagInfo + argi, fileTags + argi, gSaveTime);
+            }
+        }
+        else
+        {
+            if (!ignoreClipWarning)
+            {
+                if (tagInfo[argi].trackPeak * (Float_t)(pow(2.0, (double)(albumGainChange) / 4.0)) > 1.0)
+                {
+                    goAhead = queryUserForClipping(filename, albumGainChange);
+                }
+            }
+            if (goAhead)
+            {
+                if (!gQuiet)
+                {
+                    fprintf(out, "Applying mp3 gain change of %d to %s...\n", albumGainChange, filename);
+                }
+                if (gSkipTag)
+                {
+                    changeGain(filename, albumGainChange, albumGainChange);
+                }
+                else
+                {
+                    changeGainAndTag(filename, albumGainChange, albumGainChange, tagInfo + argi,
+                                     fileTags + argi);
+                }
+            }
+            else if (!gSkipTag && tagInfo[argi].dirty)
+            {
+                fprintf(out, "Writing tag information for %s\n", filename);
+                WriteMP3GainTag(filename, tagInfo + argi, fileTags + argi, gSaveTime);
+            }
+        }
+    }
+}
+
+/* Write the tag of one file whose tag info changed.  Nothing is printed,
+   so out is unused */
+static void updateTag(int argi, FILE *out)
+{
+    (void)out;
+    if (fileok[argi] && tagInfo[argi].dirty)
+    {
+        WriteMP3GainTag(fileNames[argi], tagInfo + argi, fileTags + argi, gSaveTime);
+    }
+}
+
+/* Check the CRC of every protected frame of one file (--verify-crc).
+   Nothing is decoded: the frames are walked by their headers through the
+   mapping, so this goes about as fast as the file can be read */
+static void verifyCrc(int argi, FILE *out)
+{
+    const char *filename = fileNames[argi];
+    unsigned long frames = 0;
+    unsigned long protectedFrames = 0;
+    unsigned long badFrames = 0;
+    bool ok;
+
+    curfilename = filename;
+    gBadLayer = false;
+    LayerSet = Reckless;
+
+    inf = openFile(filename, "rb");
+    if (inf == NULL)
+    {
+        fprintf(stderr, "%s: Can't open %s for reading\n", gProgramName, filename);
+        gSuccess = false;
+        return;
+    }
+
+    ok = startReading(filename);
+    wrdpntr = buffer;
+    ok = ok && frameSearch(true);
+    if (!ok && !gBadLayer)
+    {
+        passError(3, "Can't find any valid MP3 frames in file ", filename, "\n");
+    }
+    LayerSet = 1;
+
+    while (ok)
+    {
+        int bitridx = (curframe[2] >> 4) & 0x0F;
+        bool mono = ((curframe[3] >> 6) & 0x03) == 3;
+
+        if (bitridx == 0)
+        {
+            passError(3, filename, " is free format (not currently supported)", "\n");
+            break;
+        }
+        frames++;
+        if (!(curframe[1] & 0x01))
+        {
+            int crclen = (curframe[1] & 0x08) ? (mono ? 23 : 38) : (mono ? 15 : 23);
+
+            protectedFrames++;
+            if (frameCrc(curframe, crclen) != ((curframe[4] << 8) | curframe[5]))
+            {
+                badFrames++;
+                fprintf(out, "%s: CRC error in frame %lu at byte %lu\n", filename, frames,
+                        filepos - (inbuffer - (curframe - buffer)));
+            }
+        }
+        wrdpntr = curframe + arrbytesinframe[bitridx] + ((curframe[2] >> 1) & 0x01);
+        ok = frameSearch(false);
+    }
+
+    stopReading();
+    closeFile(inf);
+    inf = NULL;
+
+    if (databaseFormat)
+    {
+        fprintf(out, "%s\t%lu\t%lu\t%lu\n", filename, frames, protectedFrames, badFrames);
+    }
+    else if (!gQuiet)
+    {
+        fprintf(out, "%s: %lu frames, %lu with a CRC, %lu CRC errors\n", filename,
+                frames, protectedFrames, badFrames);
+    }
+    if (badFrames > 0)
+    {
+        gSuccess = false;
+    }
+}
+
+/* Free the per-file results and the exit status of the run */
+static int finish(int fileStart, int argc)
+{
+    free(tagInfo);
+    free(fileFrames);
+    free(fileok);
+    for (int argi = fileStart; argi < argc; argi++)
+    {
+        if (fileTags[argi].apeTag)
+        {
+            free(fileTags[argi].apeTag->otherFields);
+            free(fileTags[argi].apeTag);
+        }
+        free(fileTags[argi].lyrics3tag);
+        free(fileTags[argi].id31tag);
+    }
+    free(fileTags);
+    freeWorkerState();
+
+    if (!gSuccess)
+    {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    double dBchange;
+    double dblGainChange;
+    int intGainChange = 0;
+    struct MP3GainTagInfo *curTag;
+    double curAlbumGain = 0;
+    double curAlbumPeak = 0;
+    unsigned char curAlbumMinGain = 0;
+    unsigned char curAlbumMaxGain = 0;
+
+    gSuccess = true;
+    gProgramName = basename(argv[0]);
+
+    if (argc < 2)
+    {
+        errUsage();
+    }
+
+    maxAmpOnly = false;
+    gSaveTime = false;
+    int fileStart = 1;
+    numFiles = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--stats") == 0)
+        {
+            gStats = true;
+            fileStart++;
+            continue;
+        }
+        if (strcmp(arg, "--index") == 0)
+        {
+            gUseIndex = true;
+            fileStart++;
+            continue;
+        }
+        if (strcmp(arg, "--lame-tag") == 0)
+        {
+            gLameTag = true;
+            fileStart++;
+            continue;
+        }
+        if (strcmp(arg, "--verify-crc") == 0)
+        {
+            gVerifyCrc = true;
+            fileStart++;
+            continue;
+        }
+        if (strcmp(arg, "--id3-padding") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                errUsage();
+            }
+            gID3Padding = strtoul(argv[++i], NULL, 10);
+            fileStart += 2;
+            continue;
+        }
         if (arg[0] != '-' || strlen(arg) != 2)
         {
             continue;
@@ -1363,6 +4218,21 @@ int main(int argc, char **argv)
             applyAlbum = true;
             break;
 
+        case 'b':
+            if (arg[2] != '\0')
+            {
+                gBlocks = atoi(arg + 2);
+                break;
+            }
+            if (i + 1 >= argc)
+            {
+                errUsage();
+            }
+            gBlocks = atoi(argv[i + 1]);
+            i++;
+            fileStart++;
+            break;
+
         case 'c':
             ignoreClipWarning = true;
             break;
@@ -1408,6 +4278,21 @@ int main(int argc, char **argv)
             fullUsage();
             break;
 
+        case 'j':
+            if (arg[2] != '\0')
+            {
+                gJobs = atoi(arg + 2);
+                break;
+            }
+            if (i + 1 >= argc)
+            {
+                errUsage();
+            }
+            gJobs = atoi(argv[i + 1]);
+            i++;
+            fileStart++;
+            break;
+
         case 'k':
             autoClip = true;
             break;
@@ -1482,7 +4367,7 @@ int main(int argc, char **argv)
                 }
                 i++;
                 fileStart++;
-                c = arg[0];
+                c = argv[i][0];
             }
             else
             {
@@ -1548,16 +4433,33 @@ int main(int argc, char **argv)
         }
     }
 
+    if (undoChanges)
+    {
+        directGain = true; /* so we don't write the tag a second time */
+    }
+    if (gJobs < 1)
+    {
+        gJobs = 1;
+    }
+    initCrcTables();
+    initWorkerState();
+
     /* now stored in tagInfo---  maxsample = malloc(sizeof(Float_t) * argc); */
     fileok = malloc(sizeof(int) * argc);
     /* now stored in tagInfo---  maxgain = malloc(sizeof(unsigned char) * argc); */
     /* now stored in tagInfo---  mingain = malloc(sizeof(unsigned char) * argc); */
     tagInfo = calloc(argc, sizeof(struct MP3GainTagInfo));
     fileTags = malloc(sizeof(struct FileTagsStruct) * argc);
+    fileFrames = calloc(argc, sizeof(long));
+    fileNames = argv;
 
     if (databaseFormat)
     {
-        if (gCheckTagOnly)
+        if (gVerifyCrc)
+        {
+            printf("File\tFrames\tFrames with CRC\tCRC errors\n");
+        }
+        else if (gCheckTagOnly)
         {
             printf("File\tMP3 gain\tdB gain\tMax Amplitude\tMax global_gain\t"
                    "Min global_gain\tAlbum gain\tAlbum dB gain\tAlbum Max Amplitude\t"
@@ -1575,12 +4477,16 @@ int main(int argc, char **argv)
         fflush(stdout);
     }
 
-    /* read all the tags first */
+    /* read all the tags first, and how long each file is where the
+       scheduling or the progress display can use it */
+    bool wantFrames = !gCheckTagOnly && (gJobs > 1 || gBlocks > 1 || !gQuiet);
     totFiles = argc - fileStart;
     for (int argi = fileStart; argi < argc; argi++)
     {
         fileok[argi] = 0;
         curfilename = argv[argi];
+        recoverJournal(curfilename);
+        fileTags[argi].fileSize = -1;
         fileTags[argi].apeTag = NULL;
         fileTags[argi].lyrics3tag = NULL;
         fileTags[argi].id31tag = NULL;
@@ -1596,6 +4502,7 @@ int main(int argc, char **argv)
 
         if (!gSkipTag && !gDeleteTag)
         {
+            startSession(curfilename);
             {
                 ReadMP3GainAPETag(curfilename, &(tagInfo[argi]), &(fileTags[argi]));
                 if (gUseId3)
@@ -1609,7 +4516,12 @@ int main(int argc, char **argv)
                     }
                     ReadMP3GainID3Tag(curfilename, &(tagInfo[argi]));
                 }
+                if (wantFrames)
+                {
+                    fileFrames[argi] = estimateFrames(curfilename, fileTags + argi);
+                }
             }
+            endSession();
 #if 0
             printf("Read previous tags from %s\n", curfilename);
             dumpTaginfo(&(tagInfo[argi]));
@@ -1655,6 +4567,18 @@ int main(int argc, char **argv)
                 }
             }
         }
+        else if (wantFrames)
+        {
+            startSession(curfilename);
+            fileFrames[argi] = estimateFrames(curfilename, fileTags + argi);
+            endSession();
+        }
+    }
+
+    if (gVerifyCrc)
+    {
+        runFileJobs(fileStart, argc, verifyCrc);
+        return finish(fileStart, argc);
     }
 
     /* check if we need to actually process the file(s) */
@@ -1703,711 +4627,39 @@ int main(int argc, char **argv)
                 }
                 else if (tagInfo[argi].albumPeak != curAlbumPeak)
                 {
-                    albumRecalc |= AMP_RECALC;
-                }
-                if (!tagInfo[argi].haveAlbumMinMaxGain)
-                {
-                    albumRecalc |= MIN_MAX_GAIN_RECALC;
-                }
-                else if (tagInfo[argi].albumMaxGain != curAlbumMaxGain)
-                {
-                    albumRecalc |= MIN_MAX_GAIN_RECALC;
-                }
-                else if (tagInfo[argi].albumMinGain != curAlbumMinGain)
-                {
-                    albumRecalc |= MIN_MAX_GAIN_RECALC;
-                }
-            }
-            if (!tagInfo[argi].haveTrackPeak)
-            {
-                tagInfo[argi].recalc |= AMP_RECALC;
-            }
-            if (!tagInfo[argi].haveMinMaxGain)
-            {
-                tagInfo[argi].recalc |= MIN_MAX_GAIN_RECALC;
-            }
-        }
-    }
-
-    for (int argi = fileStart; argi < argc; argi++)
-    {
-        memset(&mp, 0, sizeof(mp));
-
-        // if the entire Album requires some kind of recalculation, then each
-        // track needs it
-        tagInfo[argi].recalc |= albumRecalc;
-
-        curfilename = argv[argi];
-        if (gCheckTagOnly)
-        {
-            curTag = tagInfo + argi;
-            if (curTag->haveTrackGain)
-            {
-                dblGainChange = curTag->trackGain / (5.0 * log10(2.0));
-
-                if (fabs(dblGainChange) - (double)((int)(fabs(dblGainChange))) < 0.5)
-                {
-                    intGainChange = (int)(dblGainChange);
-                }
-                else
-                {
-                    intGainChange = (int)(dblGainChange) + (dblGainChange < 0 ? -1 : 1);
-                }
-            }
-            if (curTag->haveAlbumGain)
-            {
-                dblGainChange = curTag->albumGain / (5.0 * log10(2.0));
-
-                if (fabs(dblGainChange) - (double)((int)(fabs(dblGainChange))) < 0.5)
-                {
-                    intAlbumGainChange = (int)(dblGainChange);
-                }
-                else
-                {
-                    intAlbumGainChange = (int)(dblGainChange) + (dblGainChange < 0 ? -1 : 1);
-                }
-            }
-            if (!gQuiet && !databaseFormat)
-            {
-                printf("%s\n", argv[argi]);
-                if (curTag->haveTrackGain)
-                {
-                    printf("Recommended \"Track\" dB change: %f\n", curTag->trackGain);
-                    printf("Recommended \"Track\" mp3 gain change: %d\n", intGainChange);
-                    if (curTag->haveTrackPeak)
-                    {
-                        if (curTag->trackPeak * (Float_t)(pow(2.0, (double)(intGainChange) / 4.0)) > 1.0)
-                        {
-                            printf("WARNING: some clipping may occur with this gain change!\n");
-                        }
-                    }
-                }
-                if (curTag->haveTrackPeak)
-                {
-                    printf("Max PCM sample at current gain: %f\n", curTag->trackPeak * 32768.0);
-                }
-                if (curTag->haveMinMaxGain)
-                {
-                    printf("Max mp3 global gain field: %d\n", curTag->maxGain);
-                    printf("Min mp3 global gain field: %d\n", curTag->minGain);
-                }
-                if (curTag->haveAlbumGain)
-                {
-                    printf("Recommended \"Album\" dB change: %f\n", curTag->albumGain);
-                    printf("Recommended \"Album\" mp3 gain change: %d\n", intAlbumGainChange);
-                    if (curTag->haveTrackPeak)
-                    {
-                        if (curTag->trackPeak * (Float_t)(pow(2.0, (double)(intAlbumGainChange) / 4.0)) > 1.0)
-                        {
-                            printf("WARNING: some clipping may occur with this gain change!\n");
-                        }
-                    }
-                }
-                if (curTag->haveAlbumPeak)
-                {
-                    printf("Max Album PCM sample at current gain: %f\n", curTag->albumPeak * 32768.0);
-                }
-                if (curTag->haveAlbumMinMaxGain)
-                {
-                    printf("Max Album mp3 global gain field: %d\n", curTag->albumMaxGain);
-                    printf("Min Album mp3 global gain field: %d\n", curTag->albumMinGain);
-                }
-                printf("\n");
-            }
-            else
-            {
-                printf("%s\t", argv[argi]);
-                if (curTag->haveTrackGain)
-                {
-                    printf("%d\t", intGainChange);
-                    printf("%f\t", curTag->trackGain);
-                }
-                else
-                {
-                    printf("NA\tNA\t");
-                }
-                if (curTag->haveTrackPeak)
-                {
-                    printf("%f\t", curTag->trackPeak * 32768.0);
-                }
-                else
-                {
-                    printf("NA\t");
-                }
-                if (curTag->haveMinMaxGain)
-                {
-                    printf("%d\t", curTag->maxGain);
-                    printf("%d\t", curTag->minGain);
-                }
-                else
-                {
-                    printf("NA\tNA\t");
-                }
-                if (curTag->haveAlbumGain)
-                {
-                    printf("%d\t", intAlbumGainChange);
-                    printf("%f\t", curTag->albumGain);
-                }
-                else
-                {
-                    printf("NA\tNA\t");
-                }
-                if (curTag->haveAlbumPeak)
-                {
-                    printf("%f\t", curTag->albumPeak * 32768.0);
-                }
-                else
-                {
-                    printf("NA\t");
-                }
-                if (curTag->haveAlbumMinMaxGain)
-                {
-                    printf("%d\t", curTag->albumMaxGain);
-                    printf("%d\n", curTag->albumMinGain);
-                }
-                else
-                {
-                    printf("NA\tNA\n");
-                }
-                fflush(stdout);
-            }
-        }
-        else if (undoChanges)
-        {
-            directGain = true; /* so we don't write the tag a second time */
-            if ((tagInfo[argi].haveUndo) && (tagInfo[argi].undoLeft || tagInfo[argi].undoRight))
-            {
-                if (!gQuiet && !databaseFormat)
-                {
-                    printf("Undoing mp3gain changes (%d,%d) to %s...\n",
-                           tagInfo[argi].undoLeft, tagInfo[argi].undoRight,
-                           argv[argi]);
-                }
-
-                if (databaseFormat)
-                {
-                    printf("%s\t%d\t%d\n", argv[argi], tagInfo[argi].undoLeft, tagInfo[argi].undoRight);
-                }
-
-                changeGainAndTag(argv[argi],
-                                 tagInfo[argi].undoLeft, tagInfo[argi].undoRight,
-                                 tagInfo + argi, fileTags + argi);
-
-            }
-            else
-            {
-                if (databaseFormat)
-                {
-                    printf("%s\t0\t0\n", argv[argi]);
-                }
-                else if (!gQuiet)
-                {
-                    if (tagInfo[argi].haveUndo)
-                    {
-                        fprintf(stderr, "%s: No changes to undo in %s\n",
-                                gProgramName, argv[argi]);
-                    }
-                    else
-                    {
-                        fprintf(stderr, "%s: No undo information in %s\n",
-                                gProgramName, argv[argi]);
-                    }
-                    gSuccess = false;
-                }
-            }
-        }
-        else if (directSingleChannelGain)
-        {
-            if (!gQuiet)
-            {
-                printf("Applying gain change of %d to CHANNEL %d of %s...\n",
-                       directGainVal, whichChannel, argv[argi]);
-            }
-            if (whichChannel)   /* do right channel */
-            {
-                if (gSkipTag)
-                {
-                    changeGain(argv[argi], 0, directGainVal);
-                }
-                else
-                {
-                    changeGainAndTag(argv[argi], 0, directGainVal, tagInfo + argi, fileTags + argi);
-                }
-            }
-            else   /* do left channel */
-            {
-                if (gSkipTag)
-                {
-                    changeGain(argv[argi], directGainVal, 0);
-                }
-                else
-                {
-                    changeGainAndTag(argv[argi], directGainVal, 0, tagInfo + argi, fileTags + argi);
-                }
-            }
-            if (!gQuiet && gSuccess)
-            {
-                printf("\ndone\n");
-            }
-        }
-        else if (directGain)
-        {
-            if (!gQuiet)
-            {
-                printf("Applying gain change of %d to %s...\n",
-                       directGainVal, argv[argi]);
-            }
-            if (gSkipTag)
-            {
-                changeGain(argv[argi], directGainVal, directGainVal);
-            }
-            else
-            {
-                changeGainAndTag(argv[argi],
-                                 directGainVal, directGainVal, tagInfo + argi,
-                                 fileTags + argi);
-            }
-            if (!gQuiet && gSuccess)
-            {
-                printf("\ndone\n");
-            }
-        }
-        else if (gDeleteTag)
-        {
-            {
-                RemoveMP3GainAPETag(argv[argi], gSaveTime);
-                if (gUseId3)
-                {
-                    RemoveMP3GainID3Tag(argv[argi], gSaveTime);
-                }
-            }
-            if (!gQuiet && !databaseFormat)
-            {
-                printf("Deleting tag info of %s...\n", argv[argi]);
-            }
-            if (databaseFormat)
-            {
-                printf("%s\tNA\tNA\tNA\tNA\tNA\n", argv[argi]);
-            }
-        }
-        else
-        {
-            if (!databaseFormat && !gQuiet)
-            {
-                printf("%s\n", argv[argi]);
-            }
-
-            if (tagInfo[argi].recalc > 0)
-            {
-                gFilesize = getSizeOfFile(argv[argi]);
-
-                inf = fopen(argv[argi], "rb");
-            }
-
-            if ((inf == NULL) && (tagInfo[argi].recalc > 0))
-            {
-                fprintf(stderr, "%s: Can't open %s for reading\n",
-                        gProgramName, argv[argi]);
-                gSuccess = false;
-            }
-            else
-            {
-                InitMP3(&mp);
-                if (tagInfo[argi].recalc == 0)
-                {
-                    maxsample = tagInfo[argi].trackPeak * 32768.0;
-                    maxgain = tagInfo[argi].maxGain;
-                    mingain = tagInfo[argi].minGain;
-                    ok = true;
+                    albumRecalc |= AMP_RECALC;
                 }
-                else
+                if (!tagInfo[argi].haveAlbumMinMaxGain)
                 {
-                    if (!((tagInfo[argi].recalc & FULL_RECALC) || (tagInfo[argi].recalc & AMP_RECALC))) /* only min/max rescan */
-                    {
-                        maxsample = tagInfo[argi].trackPeak * 32768.0;
-                    }
-                    else
-                    {
-                        maxsample = 0;
-                    }
-                    {
-                        gBadLayer = false;
-                        LayerSet = Reckless;
-                        maxgain = 0;
-                        mingain = 255;
-                        inbuffer = 0;
-                        filepos = 0;
-                        bitidx = 0;
-                        ok = fillBuffer(0);
-                    }
+                    albumRecalc |= MIN_MAX_GAIN_RECALC;
                 }
-                if (ok)
+                else if (tagInfo[argi].albumMaxGain != curAlbumMaxGain)
                 {
-                    if (tagInfo[argi].recalc > 0)
-                    {
-                        wrdpntr = buffer;
-
-                        ok = skipID3v2();
-                        // TODO: why are we ignoring `ok` here?
-
-                        ok = frameSearch(true);
-                    }
-
-                    if (!ok)
-                    {
-                        if (!gBadLayer)
-                        {
-                            fprintf(stderr, "%s: Can't find any valid MP3 frames in file %s\n",
-                                    gProgramName, argv[argi]);
-                            gSuccess = false;
-                        }
-                    }
-                    else
-                    {
-                        LayerSet = 1; /* We've found at least one valid layer 3 frame.
-                                         Assume any later layer 1 or 2 frames are just
-                                         bitstream corruption */
-                        fileok[argi] = true;
-                        numFiles++;
-
-                        if (tagInfo[argi].recalc > 0)
-                        {
-                            mode = (curframe[3] >> 6) & 3;
-
-                            if ((curframe[1] & 0x08) == 0x08) /* MPEG 1 */
-                            {
-                                sideinfo_len = ((curframe[3] & 0xC0) == 0xC0) ? 4 + 17 : 4 + 32;
-                            }
-                            else                /* MPEG 2 */
-                            {
-                                sideinfo_len = ((curframe[3] & 0xC0) == 0xC0) ? 4 + 9 : 4 + 17;
-                            }
-
-                            if (!(curframe[1] & 0x01))
-                            {
-                                sideinfo_len += 2;
-                            }
-
-                            Xingcheck = curframe + sideinfo_len;
-                            //LAME CBR files have "Info" tags, not "Xing" tags
-                            if ((Xingcheck[0] == 'X' && Xingcheck[1] == 'i' && Xingcheck[2] == 'n' && Xingcheck[3] == 'g') ||
-                                (Xingcheck[0] == 'I' && Xingcheck[1] == 'n' && Xingcheck[2] == 'f' && Xingcheck[3] == 'o'))
-                            {
-                                bitridx = (curframe[2] >> 4) & 0x0F;
-                                if (bitridx == 0)
-                                {
-                                    fprintf(stderr, "%s: %s is free format (not currently supported)\n",
-                                            gProgramName, curfilename);
-                                    ok = false;
-                                }
-                                else
-                                {
-                                    mpegver = (curframe[1] >> 3) & 0x03;
-                                    freqidx = (curframe[2] >> 2) & 0x03;
-
-                                    bytesinframe = arrbytesinframe[bitridx] + ((curframe[2] >> 1) & 0x01);
-
-                                    wrdpntr = curframe + bytesinframe;
-
-                                    ok = frameSearch(0);
-                                }
-                            }
-
-                            frame = 1;
-
-                            if (!maxAmpOnly)
-                            {
-                                if (ok)
-                                {
-                                    mpegver = (curframe[1] >> 3) & 0x03;
-                                    freqidx = (curframe[2] >> 2) & 0x03;
-
-                                    if (first)
-                                    {
-                                        lastfreq = frequency[mpegver][freqidx];
-                                        InitGainAnalysis((long)(lastfreq * 1000.0));
-                                        analysisError = false;
-                                        first = 0;
-                                    }
-                                    else
-                                    {
-                                        if (frequency[mpegver][freqidx] != lastfreq)
-                                        {
-                                            lastfreq = frequency[mpegver][freqidx];
-                                            ResetSampleFrequency((long)(lastfreq * 1000.0));
-                                        }
-                                    }
-                                }
-                            }
-                            else
-                            {
-                                analysisError = false;
-                            }
-
-                            while (ok)
-                            {
-                                bitridx = (curframe[2] >> 4) & 0x0F;
-                                if (bitridx == 0)
-                                {
-                                    fprintf(stderr, "%s: %s is free format (not currently supported)\n",
-                                            gProgramName, curfilename);
-                                    ok = false;
-                                }
-                                else
-                                {
-                                    mpegver = (curframe[1] >> 3) & 0x03;
-                                    freqidx = (curframe[2] >> 2) & 0x03;
-
-                                    bytesinframe = arrbytesinframe[bitridx] + ((curframe[2] >> 1) & 0x01);
-                                    mode = (curframe[3] >> 6) & 0x03;
-                                    nchan = (mode == 3) ? 1 : 2;
-
-                                    if (inbuffer >= bytesinframe)
-                                    {
-                                        lSamp = lsamples;
-                                        rSamp = rsamples;
-                                        maxSamp = &maxsample;
-                                        maxGain = &maxgain;
-                                        minGain = &mingain;
-                                        procSamp = 0;
-                                        if ((tagInfo[argi].recalc & AMP_RECALC) || (tagInfo[argi].recalc & FULL_RECALC))
-                                        {
-                                            decodeSuccess = decodeMP3(&mp, curframe, bytesinframe, &nprocsamp);
-                                        }
-                                        else
-                                        {
-                                            /* don't need to actually decode
-                                               frame, just scan for min/max
-                                               gain values */
-                                            decodeSuccess = !MP3_OK;
-                                            scanFrameGain();//curframe);
-                                        }
-                                        if (decodeSuccess == MP3_OK)
-                                        {
-                                            if (!maxAmpOnly && (tagInfo[argi].recalc & FULL_RECALC))
-                                            {
-                                                if (AnalyzeSamples(lsamples, rsamples, procSamp / nchan, nchan) == GAIN_ANALYSIS_ERROR)
-                                                {
-                                                    fprintf(stderr, "%s: Error analyzing further samples (max time reached)\n", gProgramName);
-                                                    analysisError = true;
-                                                    ok = false;
-                                                }
-                                            }
-                                        }
-                                    }
-
-                                    if (!analysisError)
-                                    {
-                                        wrdpntr = curframe + bytesinframe;
-                                        ok = frameSearch(0);
-                                    }
-
-                                    if (!gQuiet)
-                                    {
-                                        if (!(++frame % 200))
-                                        {
-                                            reportPercentAnalyzed((int)(((double)(filepos - (inbuffer - (curframe + bytesinframe - buffer))) * 100.0) / gFilesize),
-                                                                  gFilesize);
-                                        }
-                                    }
-                                }
-                            }
-                        }
-
-                        if (!gQuiet)
-                        {
-                            fprintf(stderr, "                                                 \r");
-                        }
-
-                        if (tagInfo[argi].recalc & FULL_RECALC)
-                        {
-                            if (maxAmpOnly)
-                            {
-                                dBchange = 0;
-                            }
-                            else
-                            {
-                                dBchange = GetTitleGain();
-                            }
-                        }
-                        else
-                        {
-                            dBchange = tagInfo[argi].trackGain;
-                        }
-
-                        if (dBchange == GAIN_NOT_ENOUGH_SAMPLES)
-                        {
-                            fprintf(stderr, "%s: Not enough samples in %s to do analysis\n",
-                                    gProgramName, argv[argi]);
-                            gSuccess = false;
-                            numFiles--;
-                        }
-                        else
-                        {
-                            /* even if gSkipTag is on, we'll leave this part
-                               running just to store the minpeak and
-                               maxpeak */
-                            curTag = tagInfo + argi;
-                            if (!maxAmpOnly)
-                            {
-                                /* if we don't already have a tagged track
-                                   gain OR we have it, but it doesn't match */
-                                if (!curTag->haveTrackGain ||
-                                    (curTag->haveTrackGain &&
-                                     (fabs(dBchange - curTag->trackGain) >= 0.01))
-                                   )
-                                {
-                                    curTag->dirty = true;
-                                    curTag->haveTrackGain = 1;
-                                    curTag->trackGain = dBchange;
-                                }
-                            }
-                            if (!curTag->haveMinMaxGain || /* if minGain or
-                                                              maxGain doesn't
-                                                              match tag */
-                                (curTag->haveMinMaxGain &&
-                                 (curTag->minGain != mingain || curTag->maxGain != maxgain)))
-                            {
-                                curTag->dirty = true;
-                                curTag->haveMinMaxGain = true;
-                                curTag->minGain = mingain;
-                                curTag->maxGain = maxgain;
-                            }
-
-                            if (!curTag->haveTrackPeak ||
-                                (curTag->haveTrackPeak &&
-                                 (fabs(maxsample - (curTag->trackPeak) * 32768.0) >= 3.3)))
-                            {
-                                curTag->dirty = true;
-                                curTag->haveTrackPeak = true;
-                                curTag->trackPeak = maxsample / 32768.0;
-                            }
-                            /* the TAG version of the suggested Track Gain
-                               should ALWAYS be based on the 89dB standard.
-                               So we don't modify the suggested gain change
-                               until this point */
-
-                            dBchange += dBGainMod;
-
-                            dblGainChange = dBchange / (5.0 * log10(2.0));
-
-                            if (fabs(dblGainChange) - (double)((int)(fabs(dblGainChange))) < 0.5)
-                            {
-                                intGainChange = (int)(dblGainChange);
-                            }
-                            else
-                            {
-                                intGainChange = (int)(dblGainChange) + (dblGainChange < 0 ? -1 : 1);
-                            }
-                            intGainChange += mp3GainMod;
-
-                            if (databaseFormat)
-                            {
-                                printf("%s\t%d\t%f\t%f\t%d\t%d\n", argv[argi], intGainChange, dBchange, maxsample, maxgain, mingain);
-                                fflush(stdout);
-                            }
-                            if (!applyTrack && !applyAlbum)
-                            {
-                                if (!databaseFormat)
-                                {
-                                    printf("Recommended \"Track\" dB change: %f\n", dBchange);
-                                    printf("Recommended \"Track\" mp3 gain change: %d\n", intGainChange);
-                                    if (maxsample * (Float_t)(pow(2.0, (double)(intGainChange) / 4.0)) > 32767.0)
-                                    {
-                                        printf("WARNING: some clipping may occur with this gain change!\n");
-                                    }
-                                    printf("Max PCM sample at current gain: %f\n", maxsample);
-                                    printf("Max mp3 global gain field: %d\n", maxgain);
-                                    printf("Min mp3 global gain field: %d\n", mingain);
-                                    printf("\n");
-                                }
-                            }
-                            else if (applyTrack)
-                            {
-                                first = true; /* don't keep track of Album gain */
-                                if (inf)
-                                {
-                                    fclose(inf);
-                                    inf = NULL;
-                                }
-                                goAhead = true;
-
-                                if (intGainChange == 0)
-                                {
-                                    printf("No changes to %s are necessary\n", argv[argi]);
-                                    if (!gSkipTag && tagInfo[argi].dirty)
-                                    {
-                                        printf("...but tag needs update: Writing tag information for %s\n", argv[argi]);
-                                        WriteMP3GainTag(argv[argi], tagInfo + argi, fileTags + argi, gSaveTime);
-                                    }
-                                }
-                                else
-                                {
-                                    if (autoClip)
-                                    {
-                                        int intMaxNoClipGain = (int)(floor(4.0 * log10(32767.0 / maxsample) / log10(2.0)));
-                                        if (intGainChange > intMaxNoClipGain)
-                                        {
-                                            printf("Applying auto-clipped mp3 gain change of %d to %s\n(Original suggested gain was %d)\n",
-                                                   intMaxNoClipGain, argv[argi], intGainChange);
-                                            intGainChange = intMaxNoClipGain;
-                                        }
-                                    }
-                                    else if (!ignoreClipWarning)
-                                    {
-                                        if (maxsample * (Float_t)(pow(2.0, (double)(intGainChange) / 4.0)) > 32767.0)
-                                        {
-                                            if (queryUserForClipping(argv[argi], intGainChange))
-                                            {
-                                                if (!gQuiet)
-                                                {
-                                                    printf("Applying mp3 gain change of %d to %s...\n", intGainChange, argv[argi]);
-                                                }
-                                            }
-                                            else
-                                            {
-                                                goAhead = 0;
-                                            }
-                                        }
-                                    }
-                                    if (goAhead)
-                                    {
-                                        if (!gQuiet)
-                                        {
-                                            printf("Applying mp3 gain change of %d to %s...\n", intGainChange, argv[argi]);
-                                        }
-                                        if (gSkipTag)
-                                        {
-                                            changeGain(argv[argi], intGainChange, intGainChange);
-                                        }
-                                        else
-                                        {
-                                            changeGainAndTag(argv[argi],
-                                                             intGainChange, intGainChange, tagInfo + argi, fileTags + argi);
-                                        }
-                                    }
-                                    else if (!gSkipTag && tagInfo[argi].dirty)
-                                    {
-                                        printf("Writing tag information for %s\n", argv[argi]);
-                                        WriteMP3GainTag(argv[argi], tagInfo + argi, fileTags + argi, gSaveTime);
-                                    }
-                                }
-                            }
-                        }
-                    }
+                    albumRecalc |= MIN_MAX_GAIN_RECALC;
                 }
-
-                ExitMP3(&mp);
-                fflush(stdout);
-                if (inf)
+                else if (tagInfo[argi].albumMinGain != curAlbumMinGain)
                 {
-                    fclose(inf);
-                    inf = NULL;
+                    albumRecalc |= MIN_MAX_GAIN_RECALC;
                 }
             }
+            if (!tagInfo[argi].haveTrackPeak)
+            {
+                tagInfo[argi].recalc |= AMP_RECALC;
+            }
+            if (!tagInfo[argi].haveMinMaxGain)
+            {
+                tagInfo[argi].recalc |= MIN_MAX_GAIN_RECALC;
+            }
         }
     }
 
+    runFileJobs(fileStart, argc, processFile);
+    if (gStats && gLameTag)
+    {
+        fprintf(stderr, "%d of %d files analyzed from their LAME tag\n",
+                (int)lameTagFiles, totFiles);
+    }
+
     if (numFiles > 0 && !applyTrack && !analysisTrack)
     {
         if (albumRecalc & FULL_RECALC)
@@ -2570,53 +4822,8 @@ int main(int argc, char **argv)
                     }
 
                 }
-                for (int argi = fileStart; argi < argc; argi++)
-                {
-                    if (fileok[argi])
-                    {
-                        goAhead = true;
-                        if (intGainChange == 0)
-                        {
-                            printf("\nNo changes to %s are necessary\n", argv[argi]);
-                            if (!gSkipTag && tagInfo[argi].dirty)
-                            {
-                                printf("...but tag needs update: Writing tag information for %s\n", argv[argi]);
-                                WriteMP3GainTag(argv[argi], tagInfo + argi, fileTags + argi, gSaveTime);
-                            }
-                        }
-                        else
-                        {
-                            if (!ignoreClipWarning)
-                            {
-                                if (tagInfo[argi].trackPeak * (Float_t)(pow(2.0, (double)(intGainChange) / 4.0)) > 1.0)
-                                {
-                                    goAhead = queryUserForClipping(argv[argi], intGainChange);
-                                }
-                            }
-                            if (goAhead)
-                            {
-                                if (!gQuiet)
-                                {
-                                    printf("Applying mp3 gain change of %d to %s...\n", intGainChange, argv[argi]);
-                                }
-                                if (gSkipTag)
-                                {
-                                    changeGain(argv[argi], intGainChange, intGainChange);
-                                }
-                                else
-                                {
-                                    changeGainAndTag(argv[argi], intGainChange, intGainChange, tagInfo + argi,
-                                                     fileTags + argi);
-                                }
-                            }
-                            else if (!gSkipTag && tagInfo[argi].dirty)
-                            {
-                                printf("Writing tag information for %s\n", argv[argi]);
-                                WriteMP3GainTag(argv[argi], tagInfo + argi, fileTags + argi, gSaveTime);
-                            }
-                        }
-                    }
-                }
+                albumGainChange = intGainChange;
+                runFileJobs(fileStart, argc, applyAlbumGain);
             }
         }
     }
@@ -2631,35 +4838,8 @@ int main(int argc, char **argv)
         !gCheckTagOnly)
     {
         /* if we made changes, we already updated the tags */
-        for (int argi = fileStart; argi < argc; argi++)
-        {
-            if (fileok[argi])
-            {
-                if (tagInfo[argi].dirty)
-                {
-                    WriteMP3GainTag(argv[argi], tagInfo + argi, fileTags + argi, gSaveTime);
-                }
-            }
-        }
-    }
-
-    free(tagInfo);
-    free(fileok);
-    for (int argi = fileStart; argi < argc; argi++)
-    {
-        if (fileTags[argi].apeTag)
-        {
-            free(fileTags[argi].apeTag->otherFields);
-            free(fileTags[argi].apeTag);
-        }
-        free(fileTags[argi].lyrics3tag);
-        free(fileTags[argi].id31tag);
+        runFileJobs(fileStart, argc, updateTag);
     }
-    free(fileTags);
 
-    if (!gSuccess)
-    {
-        return EXIT_FAILURE;
-    }
-    return EXIT_SUCCESS;
+    return finish(fileStart, argc);
 }
@@ -21,6 +21,9 @@
 
 #pragma once
 
+#include <stdio.h>
+#include <stdbool.h>
+
 #define MP3GAIN_VERSION "1.5.2"
 
 #define M3G_ERR_CANT_MODIFY_FILE -1
@@ -34,6 +37,9 @@
 
 void passError(int numStrings, ...);
 
+/* fprintf() to stderr, only with --stats */
+void statsLine(const char *format, ...);
+
 typedef enum
 {
     storeTime,
@@ -42,3 +48,23 @@ typedef enum
 
 /* Get/Set file datetime stamp */
 void fileTime(const char *filename, timeAction action);
+
+/* fopen()/fclose() and rename() over the file being processed, which
+   share one open descriptor for all its steps */
+FILE *openFile(const char *filename, const char *mode);
+void closeFile(FILE *file);
+int replaceFile(const char *tmpfilename, const char *filename);
+
+/* bytes to be written at offset in the file */
+struct fileRange
+{
+    unsigned long offset;
+    const unsigned char *data;
+    size_t len;
+};
+
+/* journal a tag written over the start of the file, so that an
+   interrupted write is completed by the next run */
+bool journalTagWrite(const char *filename, unsigned long oldsize, unsigned long newsize,
+                     const struct fileRange *ranges, int nranges);
+void endTagJournal(const char *filename, int fd);
@@ -0,0 +1,132 @@
+/*
+ * make bench: per-file cost of setting up the decoder.  "before" redoes
+ * everything InitMP3() used to do for every file, "after" is what it
+ * does now.
+ *
+ * Then the time to decode example2.mp3, with the vector code picked for
+ * this CPU (or the one named by MP3GAIN_SIMD).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "mpglibDBL_common.h"
+#include "mpglibDBL_interface.h"
+#include "mpglibDBL_tabinit.h"
+#include "mpglibDBL_layer3.h"
+
+#define FILES 2000
+#define DECODES 5
+#define CHUNK 16384
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double decodeFile(const unsigned char *data, long len)
+{
+    static MPSTR mp;
+    static Float_t lsamples[1152], rsamples[1152], maxsample;
+    static unsigned char maxgain, mingain;
+    long pos;
+    int done;
+    double start = seconds();
+
+    InitMP3(&mp);
+    maxSamp = &maxsample;
+    maxGain = &maxgain;
+    minGain = &mingain;
+    for (pos = 0; pos < len; pos += CHUNK)
+    {
+        lSamp = lsamples;
+        rSamp = rsamples;
+        if (decodeMP3(&mp, data + pos, len - pos < CHUNK ? len - pos : CHUNK, &done) != MP3_OK)
+        {
+            continue;
+        }
+        do
+        {
+            lSamp = lsamples;
+            rSamp = rsamples;
+        }
+        while (mp.bsize >= 4 && decodeMP3(&mp, NULL, 0, &done) == MP3_OK);
+    }
+    ExitMP3(&mp);
+    return seconds() - start;
+}
+
+int main(void)
+{
+    static double ispow[8207];
+    static double gainpow2[256 + 118 + 4];
+    static MPSTR mp;
+    double start, before, after;
+    int n, i;
+
+    start = seconds();
+    for (n = 0; n < FILES; n++)
+    {
+        InitMP3(&mp);
+        make_decode_tables(32767);
+        init_layer3(SBLIMIT);
+        for (i = -256; i < 118 + 4; i++)
+        {
+            gainpow2[i + 256] = pow((double)2.0, -0.25 * (double)(i + 210));
+        }
+        for (i = 0; i < 8207; i++)
+        {
+            ispow[i] = pow((double)i, (double)4.0 / 3.0);
+        }
+        ExitMP3(&mp);
+    }
+    before = (seconds() - start) / FILES;
+
+    start = seconds();
+    for (n = 0; n < FILES; n++)
+    {
+        InitMP3(&mp);
+        ExitMP3(&mp);
+    }
+    after = (seconds() - start) / FILES;
+
+    printf("decoder setup per file: before %.1f us, after %.1f us\n",
+           before * 1e6, after * 1e6);
+
+    {
+        FILE *f = fopen("example2.mp3", "rb");
+        unsigned char *data;
+        long len;
+        double best = 1e9;
+
+        if (f == NULL)
+        {
+            perror("example2.mp3");
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        len = ftell(f);
+        rewind(f);
+        data = malloc(len);
+        if (data == NULL || fread(data, 1, len, f) != (size_t)len)
+        {
+            perror("example2.mp3");
+            return 1;
+        }
+        fclose(f);
+
+        for (n = 0; n < DECODES; n++)
+        {
+            double t = decodeFile(data, len);
+            best = t < best ? t : best;
+        }
+        printf("decoding example2.mp3: %.1f ms (best of %d)\n", best * 1e3, DECODES);
+        free(data);
+    }
+
+    return ispow[8206] > 0 && gainpow2[0] > 0 ? 0 : 1;
+}
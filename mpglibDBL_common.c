@@ -27,10 +27,8 @@ const long freqs[9] = { 44100, 48000, 32000,
                         11025, 12000,  8000
                       };
 
-int bitindex;
-unsigned char *wordpointer;
-unsigned char *pcm_sample;
-int pcm_point = 0;
+_Thread_local unsigned char *pcm_sample;
+_Thread_local int pcm_point = 0;
 
 #define HDRCMPMASK 0xfffffd00
 
@@ -198,57 +196,10 @@ void print_header_compact(struct frame *fr)
 
 #endif
 
-unsigned int getbits(int number_of_bits)
-{
-    unsigned long rval;
-
-    if (!number_of_bits)
-    {
-        return 0;
-    }
-
-    {
-        rval = wordpointer[0];
-        rval <<= 8;
-        rval |= wordpointer[1];
-        rval <<= 8;
-        rval |= wordpointer[2];
-        rval <<= bitindex;
-        rval &= 0xffffff;
-
-        bitindex += number_of_bits;
-
-        rval >>= (24 - number_of_bits);
-
-        wordpointer += (bitindex >> 3);
-        bitindex &= 7;
-    }
-    return rval;
-}
-
-unsigned int getbits_fast(int number_of_bits)
-{
-    unsigned long rval;
-
-    {
-        rval = wordpointer[0];
-        rval <<= 8;
-        rval |= wordpointer[1];
-        rval <<= bitindex;
-        rval &= 0xffff;
-        bitindex += number_of_bits;
-
-        rval >>= (16 - number_of_bits);
-
-        wordpointer += (bitindex >> 3);
-        bitindex &= 7;
-    }
-    return rval;
-}
-
 int set_pointer(PMPSTR mp, long backstep)
 {
     unsigned char *bsbufold;
+    unsigned char *pnt = mp->wordpointer - backstep;
 
     if (mp->fsizeold < 0 && backstep > 0)
     {
@@ -256,11 +207,30 @@ int set_pointer(PMPSTR mp, long backstep)
         return MP3_ERR;
     }
     bsbufold = mp->bsspace[1 - mp->bsnum] + 512;
-    wordpointer -= backstep;
     if (backstep)
     {
-        memcpy(wordpointer, bsbufold + mp->fsizeold - backstep, (size_t)backstep);
+        memcpy(pnt, bsbufold + mp->fsizeold - backstep, (size_t)backstep);
     }
-    bitindex = 0;
+    bits_init(&mp->bits, pnt);
     return MP3_OK;
 }
+
+/* MP3GAIN_SIMD=scalar, sse2 or avx2 in the environment overrides the choice */
+int simd_level(void)
+{
+    const char *simd = getenv("MP3GAIN_SIMD");
+
+    if (simd != NULL && strcmp(simd, "scalar") == 0)
+    {
+        return SIMD_SCALAR;
+    }
+#ifdef HAVE_X86_SIMD
+    if ((simd == NULL || strcmp(simd, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+    {
+        return SIMD_AVX2;
+    }
+    return SIMD_SSE2;
+#else
+    return SIMD_SCALAR;
+#endif
+}
@@ -23,13 +23,75 @@
 
 extern const int  tabsel_123[2][3][16];
 extern const long freqs[9];
-extern unsigned char *wordpointer;
-extern int bitindex;
 
 int  head_check(unsigned long head, int check_layer);
 int  decode_header(struct frame *fr, unsigned long newhead);
 void print_header(struct frame *fr);
 void print_header_compact(struct frame *fr);
-unsigned int getbits(int number_of_bits);
-unsigned int getbits_fast(int number_of_bits);
 int set_pointer(PMPSTR mp, long backstep);
+
+static inline void bits_init(struct bitreader *bs, const unsigned char *pnt)
+{
+    bs->pnt = pnt;
+    bs->cache = 0;
+    bs->count = 0;
+}
+
+/* top up the cache to at least 56 bits with one unaligned load */
+static inline void bits_refill(struct bitreader *bs)
+{
+    uint64_t word;
+
+    memcpy(&word, bs->pnt, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    bs->cache |= word >> bs->count;
+    bs->pnt += (63 - bs->count) >> 3;
+    bs->count |= 56;
+}
+
+/* the next number_of_bits (up to 56) bits, left in the stream */
+static inline unsigned int peekbits(struct bitreader *bs, int number_of_bits)
+{
+    if (bs->count < number_of_bits)
+    {
+        bits_refill(bs);
+    }
+    /* shifted twice so that number_of_bits == 0 gives 0 */
+    return (unsigned int)((bs->cache >> 1) >> (63 - number_of_bits));
+}
+
+/* only after peeking at least that many bits */
+static inline void skipbits(struct bitreader *bs, int number_of_bits)
+{
+    bs->cache <<= number_of_bits;
+    bs->count -= number_of_bits;
+}
+
+static inline unsigned int getbits(struct bitreader *bs, int number_of_bits)
+{
+    unsigned int rval = peekbits(bs, number_of_bits);
+
+    skipbits(bs, number_of_bits);
+    return rval;
+}
+
+static inline unsigned int get1bit(struct bitreader *bs)
+{
+    return getbits(bs, 1);
+}
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/* which vector versions of the decoder to use */
+enum
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+int simd_level(void);
@@ -9,6 +9,124 @@
 #include "mpglibDBL_dct64_i386.h"
 #include "mpglibDBL_tabinit.h"
 
+/* the last butterflies, and the output as one column of the synthesis buffer */
+static void dct64_last(double *out0, double *out1, double *b1, double *b2)
+{
+    {
+        register double const cos0 = pnts[4][0];
+
+        b1[0x00] = b2[0x00] + b2[0x01];
+        b1[0x01] = (b2[0x00] - b2[0x01]) * cos0;
+        b1[0x02] = b2[0x02] + b2[0x03];
+        b1[0x03] = (b2[0x03] - b2[0x02]) * cos0;
+        b1[0x02] += b1[0x03];
+
+        b1[0x04] = b2[0x04] + b2[0x05];
+        b1[0x05] = (b2[0x04] - b2[0x05]) * cos0;
+        b1[0x06] = b2[0x06] + b2[0x07];
+        b1[0x07] = (b2[0x07] - b2[0x06]) * cos0;
+        b1[0x06] += b1[0x07];
+        b1[0x04] += b1[0x06];
+        b1[0x06] += b1[0x05];
+        b1[0x05] += b1[0x07];
+
+        b1[0x08] = b2[0x08] + b2[0x09];
+        b1[0x09] = (b2[0x08] - b2[0x09]) * cos0;
+        b1[0x0A] = b2[0x0A] + b2[0x0B];
+        b1[0x0B] = (b2[0x0B] - b2[0x0A]) * cos0;
+        b1[0x0A] += b1[0x0B];
+
+        b1[0x0C] = b2[0x0C] + b2[0x0D];
+        b1[0x0D] = (b2[0x0C] - b2[0x0D]) * cos0;
+        b1[0x0E] = b2[0x0E] + b2[0x0F];
+        b1[0x0F] = (b2[0x0F] - b2[0x0E]) * cos0;
+        b1[0x0E] += b1[0x0F];
+        b1[0x0C] += b1[0x0E];
+        b1[0x0E] += b1[0x0D];
+        b1[0x0D] += b1[0x0F];
+
+        b1[0x10] = b2[0x10] + b2[0x11];
+        b1[0x11] = (b2[0x10] - b2[0x11]) * cos0;
+        b1[0x12] = b2[0x12] + b2[0x13];
+        b1[0x13] = (b2[0x13] - b2[0x12]) * cos0;
+        b1[0x12] += b1[0x13];
+
+        b1[0x14] = b2[0x14] + b2[0x15];
+        b1[0x15] = (b2[0x14] - b2[0x15]) * cos0;
+        b1[0x16] = b2[0x16] + b2[0x17];
+        b1[0x17] = (b2[0x17] - b2[0x16]) * cos0;
+        b1[0x16] += b1[0x17];
+        b1[0x14] += b1[0x16];
+        b1[0x16] += b1[0x15];
+        b1[0x15] += b1[0x17];
+
+        b1[0x18] = b2[0x18] + b2[0x19];
+        b1[0x19] = (b2[0x18] - b2[0x19]) * cos0;
+        b1[0x1A] = b2[0x1A] + b2[0x1B];
+        b1[0x1B] = (b2[0x1B] - b2[0x1A]) * cos0;
+        b1[0x1A] += b1[0x1B];
+
+        b1[0x1C] = b2[0x1C] + b2[0x1D];
+        b1[0x1D] = (b2[0x1C] - b2[0x1D]) * cos0;
+        b1[0x1E] = b2[0x1E] + b2[0x1F];
+        b1[0x1F] = (b2[0x1F] - b2[0x1E]) * cos0;
+        b1[0x1E] += b1[0x1F];
+        b1[0x1C] += b1[0x1E];
+        b1[0x1E] += b1[0x1D];
+        b1[0x1D] += b1[0x1F];
+    }
+
+    out0[16] = b1[0x00];
+    out0[12] = b1[0x04];
+    out0[8] = b1[0x02];
+    out0[4] = b1[0x06];
+    out0[0] = b1[0x01];
+    out1[0] = b1[0x01];
+    out1[4] = b1[0x05];
+    out1[8] = b1[0x03];
+    out1[12] = b1[0x07];
+
+    b1[0x08] += b1[0x0C];
+    out0[14] = b1[0x08];
+    b1[0x0C] += b1[0x0a];
+    out0[10] = b1[0x0C];
+    b1[0x0A] += b1[0x0E];
+    out0[6] = b1[0x0A];
+    b1[0x0E] += b1[0x09];
+    out0[2] = b1[0x0E];
+    b1[0x09] += b1[0x0D];
+    out1[2] = b1[0x09];
+    b1[0x0D] += b1[0x0B];
+    out1[6] = b1[0x0D];
+    b1[0x0B] += b1[0x0F];
+    out1[10] = b1[0x0B];
+    out1[14] = b1[0x0F];
+
+    b1[0x18] += b1[0x1C];
+    out0[15] = b1[0x10] + b1[0x18];
+    out0[13] = b1[0x18] + b1[0x14];
+    b1[0x1C] += b1[0x1a];
+    out0[11] = b1[0x14] + b1[0x1C];
+    out0[9] = b1[0x1C] + b1[0x12];
+    b1[0x1A] += b1[0x1E];
+    out0[7] = b1[0x12] + b1[0x1A];
+    out0[5] = b1[0x1A] + b1[0x16];
+    b1[0x1E] += b1[0x19];
+    out0[3] = b1[0x16] + b1[0x1E];
+    out0[1] = b1[0x1E] + b1[0x11];
+    b1[0x19] += b1[0x1D];
+    out1[1] = b1[0x11] + b1[0x19];
+    out1[3] = b1[0x19] + b1[0x15];
+    b1[0x1D] += b1[0x1B];
+    out1[5] = b1[0x15] + b1[0x1D];
+    out1[7] = b1[0x1D] + b1[0x13];
+    b1[0x1B] += b1[0x1F];
+    out1[9] = b1[0x13] + b1[0x1B];
+    out1[11] = b1[0x1B] + b1[0x17];
+    out1[13] = b1[0x17] + b1[0x1F];
+    out1[15] = b1[0x1F];
+}
+
 static void dct64_1(double *out0, double *out1, double *b1, double *b2, double *samples)
 {
 
@@ -187,127 +305,116 @@ static void dct64_1(double *out0, double *out1, double *b1, double *b2, double *
         b2[0x1E] = (b1[0x1E] - b1[0x1D]) * cos1;
     }
 
-    {
-        register double const cos0 = pnts[4][0];
+    dct64_last(out0, out1, b1, b2);
+}
 
-        b1[0x00] = b2[0x00] + b2[0x01];
-        b1[0x01] = (b2[0x00] - b2[0x01]) * cos0;
-        b1[0x02] = b2[0x02] + b2[0x03];
-        b1[0x03] = (b2[0x03] - b2[0x02]) * cos0;
-        b1[0x02] += b1[0x03];
+/*
+ * the call via dct64 is a trick to force GCC to use
+ * (new) registers for the b1,b2 pointer to the bufs[xx] field
+ */
+void dct64(double *a, double *b, double *c)
+{
+    double bufs[0x40];
+    dct64_1(a, b, bufs, bufs + 0x20, c);
+}
 
-        b1[0x04] = b2[0x04] + b2[0x05];
-        b1[0x05] = (b2[0x04] - b2[0x05]) * cos0;
-        b1[0x06] = b2[0x06] + b2[0x07];
-        b1[0x07] = (b2[0x07] - b2[0x06]) * cos0;
-        b1[0x06] += b1[0x07];
-        b1[0x04] += b1[0x06];
-        b1[0x06] += b1[0x05];
-        b1[0x05] += b1[0x07];
+#ifdef HAVE_X86_SIMD
 
-        b1[0x08] = b2[0x08] + b2[0x09];
-        b1[0x09] = (b2[0x08] - b2[0x09]) * cos0;
-        b1[0x0A] = b2[0x0A] + b2[0x0B];
-        b1[0x0B] = (b2[0x0B] - b2[0x0A]) * cos0;
-        b1[0x0A] += b1[0x0B];
+/*
+ * The same butterflies with two or four at a time in vector registers.  The
+ * sums and products are exactly the ones above, so the output is the same
+ * to the last bit.  Each stage works on blocks of n values, and in every
+ * other block the differences are taken the other way around.
+ */
 
-        b1[0x0C] = b2[0x0C] + b2[0x0D];
-        b1[0x0D] = (b2[0x0C] - b2[0x0D]) * cos0;
-        b1[0x0E] = b2[0x0E] + b2[0x0F];
-        b1[0x0F] = (b2[0x0F] - b2[0x0E]) * cos0;
-        b1[0x0E] += b1[0x0F];
-        b1[0x0C] += b1[0x0E];
-        b1[0x0E] += b1[0x0D];
-        b1[0x0D] += b1[0x0F];
+#define SWAP_PD(v)  _mm_shuffle_pd((v), (v), 1)
 
-        b1[0x10] = b2[0x10] + b2[0x11];
-        b1[0x11] = (b2[0x10] - b2[0x11]) * cos0;
-        b1[0x12] = b2[0x12] + b2[0x13];
-        b1[0x13] = (b2[0x13] - b2[0x12]) * cos0;
-        b1[0x12] += b1[0x13];
+static void butterflies_sse2(double *out, const double *in, const double *costab, int n, int blocks)
+{
+    int blk, i;
 
-        b1[0x14] = b2[0x14] + b2[0x15];
-        b1[0x15] = (b2[0x14] - b2[0x15]) * cos0;
-        b1[0x16] = b2[0x16] + b2[0x17];
-        b1[0x17] = (b2[0x17] - b2[0x16]) * cos0;
-        b1[0x16] += b1[0x17];
-        b1[0x14] += b1[0x16];
-        b1[0x16] += b1[0x15];
-        b1[0x15] += b1[0x17];
+    for (blk = 0; blk < blocks; blk++, in += n, out += n)
+    {
+        for (i = 0; i < n / 2; i += 2)
+        {
+            __m128d lo = _mm_loadu_pd(in + i);
+            __m128d hi = SWAP_PD(_mm_loadu_pd(in + n - 2 - i));
+            __m128d d = (blk & 1) ? _mm_sub_pd(hi, lo) : _mm_sub_pd(lo, hi);
+
+            _mm_storeu_pd(out + i, _mm_add_pd(lo, hi));
+            _mm_storeu_pd(out + n - 2 - i, SWAP_PD(_mm_mul_pd(d, _mm_loadu_pd(costab + i))));
+        }
+    }
+}
 
-        b1[0x18] = b2[0x18] + b2[0x19];
-        b1[0x19] = (b2[0x18] - b2[0x19]) * cos0;
-        b1[0x1A] = b2[0x1A] + b2[0x1B];
-        b1[0x1B] = (b2[0x1B] - b2[0x1A]) * cos0;
-        b1[0x1A] += b1[0x1B];
+void dct64_sse2(double *a, double *b, double *c)
+{
+    double bufs[0x40];
+    double *b1 = bufs, *b2 = bufs + 0x20;
+    __m128d cos01 = _mm_loadu_pd(pnts[3]);
+    int blk;
 
-        b1[0x1C] = b2[0x1C] + b2[0x1D];
-        b1[0x1D] = (b2[0x1C] - b2[0x1D]) * cos0;
-        b1[0x1E] = b2[0x1E] + b2[0x1F];
-        b1[0x1F] = (b2[0x1F] - b2[0x1E]) * cos0;
-        b1[0x1E] += b1[0x1F];
-        b1[0x1C] += b1[0x1E];
-        b1[0x1E] += b1[0x1D];
-        b1[0x1D] += b1[0x1F];
+    butterflies_sse2(b1, c, pnts[0], 32, 1);
+    butterflies_sse2(b2, b1, pnts[1], 16, 2);
+    butterflies_sse2(b1, b2, pnts[2], 8, 4);
+
+    for (blk = 0; blk < 8; blk++)
+    {
+        __m128d lo = _mm_loadu_pd(b1 + 4 * blk);
+        __m128d hi = SWAP_PD(_mm_loadu_pd(b1 + 4 * blk + 2));
+        __m128d d = (blk & 1) ? _mm_sub_pd(hi, lo) : _mm_sub_pd(lo, hi);
+
+        _mm_storeu_pd(b2 + 4 * blk, _mm_add_pd(lo, hi));
+        _mm_storeu_pd(b2 + 4 * blk + 2, SWAP_PD(_mm_mul_pd(d, cos01)));
     }
 
-    out0[0x10 * 16] = b1[0x00];
-    out0[0x10 * 12] = b1[0x04];
-    out0[0x10 * 8] = b1[0x02];
-    out0[0x10 * 4] = b1[0x06];
-    out0[0x10 * 0] = b1[0x01];
-    out1[0x10 * 0] = b1[0x01];
-    out1[0x10 * 4] = b1[0x05];
-    out1[0x10 * 8] = b1[0x03];
-    out1[0x10 * 12] = b1[0x07];
+    dct64_last(a, b, b1, b2);
+}
 
-    b1[0x08] += b1[0x0C];
-    out0[0x10 * 14] = b1[0x08];
-    b1[0x0C] += b1[0x0a];
-    out0[0x10 * 10] = b1[0x0C];
-    b1[0x0A] += b1[0x0E];
-    out0[0x10 * 6] = b1[0x0A];
-    b1[0x0E] += b1[0x09];
-    out0[0x10 * 2] = b1[0x0E];
-    b1[0x09] += b1[0x0D];
-    out1[0x10 * 2] = b1[0x09];
-    b1[0x0D] += b1[0x0B];
-    out1[0x10 * 6] = b1[0x0D];
-    b1[0x0B] += b1[0x0F];
-    out1[0x10 * 10] = b1[0x0B];
-    out1[0x10 * 14] = b1[0x0F];
+#define REVERSE_PD(v)   _mm256_permute4x64_pd((v), 0x1B)
 
-    b1[0x18] += b1[0x1C];
-    out0[0x10 * 15] = b1[0x10] + b1[0x18];
-    out0[0x10 * 13] = b1[0x18] + b1[0x14];
-    b1[0x1C] += b1[0x1a];
-    out0[0x10 * 11] = b1[0x14] + b1[0x1C];
-    out0[0x10 * 9] = b1[0x1C] + b1[0x12];
-    b1[0x1A] += b1[0x1E];
-    out0[0x10 * 7] = b1[0x12] + b1[0x1A];
-    out0[0x10 * 5] = b1[0x1A] + b1[0x16];
-    b1[0x1E] += b1[0x19];
-    out0[0x10 * 3] = b1[0x16] + b1[0x1E];
-    out0[0x10 * 1] = b1[0x1E] + b1[0x11];
-    b1[0x19] += b1[0x1D];
-    out1[0x10 * 1] = b1[0x11] + b1[0x19];
-    out1[0x10 * 3] = b1[0x19] + b1[0x15];
-    b1[0x1D] += b1[0x1B];
-    out1[0x10 * 5] = b1[0x15] + b1[0x1D];
-    out1[0x10 * 7] = b1[0x1D] + b1[0x13];
-    b1[0x1B] += b1[0x1F];
-    out1[0x10 * 9] = b1[0x13] + b1[0x1B];
-    out1[0x10 * 11] = b1[0x1B] + b1[0x17];
-    out1[0x10 * 13] = b1[0x17] + b1[0x1F];
-    out1[0x10 * 15] = b1[0x1F];
+__attribute__((target("avx2")))
+static void butterflies_avx2(double *out, const double *in, const double *costab, int n, int blocks)
+{
+    int blk, i;
+
+    for (blk = 0; blk < blocks; blk++, in += n, out += n)
+    {
+        for (i = 0; i < n / 2; i += 4)
+        {
+            __m256d lo = _mm256_loadu_pd(in + i);
+            __m256d hi = REVERSE_PD(_mm256_loadu_pd(in + n - 4 - i));
+            __m256d d = (blk & 1) ? _mm256_sub_pd(hi, lo) : _mm256_sub_pd(lo, hi);
+
+            _mm256_storeu_pd(out + i, _mm256_add_pd(lo, hi));
+            _mm256_storeu_pd(out + n - 4 - i, REVERSE_PD(_mm256_mul_pd(d, _mm256_loadu_pd(costab + i))));
+        }
+    }
 }
 
-/*
- * the call via dct64 is a trick to force GCC to use
- * (new) registers for the b1,b2 pointer to the bufs[xx] field
- */
-void dct64(double *a, double *b, double *c)
+__attribute__((target("avx2")))
+void dct64_avx2(double *a, double *b, double *c)
 {
     double bufs[0x40];
-    dct64_1(a, b, bufs, bufs + 0x20, c);
+    double *b1 = bufs, *b2 = bufs + 0x20;
+    __m256d cos10 = _mm256_set_pd(pnts[3][0], pnts[3][1], 0, 0);
+    int blk;
+
+    butterflies_avx2(b1, c, pnts[0], 32, 1);
+    butterflies_avx2(b2, b1, pnts[1], 16, 2);
+    butterflies_avx2(b1, b2, pnts[2], 8, 4);
+
+    for (blk = 0; blk < 8; blk++)
+    {
+        __m256d v = _mm256_loadu_pd(b1 + 4 * blk);
+        __m256d r = REVERSE_PD(v);
+        __m256d d = (blk & 1) ? _mm256_sub_pd(v, r) : _mm256_sub_pd(r, v);
+
+        /* sums in the low half, differences in the high half */
+        _mm256_storeu_pd(b2 + 4 * blk, _mm256_blend_pd(_mm256_add_pd(v, r), _mm256_mul_pd(d, cos10), 0xC));
+    }
+
+    dct64_last(a, b, b1, b2);
 }
+
+#endif /* HAVE_X86_SIMD */
@@ -21,3 +21,8 @@
 #include "mpglibDBL_common.h"
 
 void dct64(double *a, double *b, double *c);
+
+#ifdef HAVE_X86_SIMD
+void dct64_sse2(double *a, double *b, double *c);
+void dct64_avx2(double *a, double *b, double *c);
+#endif
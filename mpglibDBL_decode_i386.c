@@ -18,12 +18,13 @@
 #include "mpglibDBL_tabinit.h"
 #include "mpglibDBL_interface.h"
 
-Float_t *lSamp;
-Float_t *rSamp;
-Float_t *maxSamp;
+/* output of the decoder running on this thread */
+_Thread_local Float_t *lSamp;
+_Thread_local Float_t *rSamp;
+_Thread_local Float_t *maxSamp;
 bool maxAmpOnly;
 
-int procSamp;
+_Thread_local int procSamp;
 
 int synth_1to1_mono(PMPSTR mp, double *bandPtr, int *pnt)
 {
@@ -36,14 +37,304 @@ int synth_1to1_mono(PMPSTR mp, double *bandPtr, int *pnt)
     return ret;
 }
 
+/*
+ * The window sums.  b0 is a synthesis buffer, where tap k of row r is
+ * b0[k * SYNTH_ROWS + r].  The 32 samples go to dsamp, unless it is NULL
+ * (maxAmpOnly); the largest absolute sample is returned.  The vector
+ * versions work out neighbouring rows side by side, adding the taps in the
+ * same order as window_scalar, so they give exactly the same samples.
+ */
+typedef double (*windowFunc)(const double *b0, int bo1, Float_t *dsamp);
+
+#define TAP(k)  b0[(k) * SYNTH_ROWS]
+
+static double window_scalar(const double *b0, int bo1, Float_t *dsamp)
+{
+    register int j;
+    double mSamp = 0;
+    const double *window = decwin + 16 - bo1;
+
+    for (j = 16; j; j--, b0++, window += 0x20)
+    {
+        double sum;
+        sum  = window[0x0] * TAP(0x0);
+        sum -= window[0x1] * TAP(0x1);
+        sum += window[0x2] * TAP(0x2);
+        sum -= window[0x3] * TAP(0x3);
+        sum += window[0x4] * TAP(0x4);
+        sum -= window[0x5] * TAP(0x5);
+        sum += window[0x6] * TAP(0x6);
+        sum -= window[0x7] * TAP(0x7);
+        sum += window[0x8] * TAP(0x8);
+        sum -= window[0x9] * TAP(0x9);
+        sum += window[0xA] * TAP(0xA);
+        sum -= window[0xB] * TAP(0xB);
+        sum += window[0xC] * TAP(0xC);
+        sum -= window[0xD] * TAP(0xD);
+        sum += window[0xE] * TAP(0xE);
+        sum -= window[0xF] * TAP(0xF);
+
+        if (dsamp)
+        {
+            *dsamp++ = (Float_t)sum;
+        }
+        if (sum > mSamp)
+        {
+            mSamp = sum;
+        }
+        else if ((-sum) > mSamp)
+        {
+            mSamp = (-sum);
+        }
+    }
+
+    {
+        double sum;
+        sum  = window[0x0] * TAP(0x0);
+        sum += window[0x2] * TAP(0x2);
+        sum += window[0x4] * TAP(0x4);
+        sum += window[0x6] * TAP(0x6);
+        sum += window[0x8] * TAP(0x8);
+        sum += window[0xA] * TAP(0xA);
+        sum += window[0xC] * TAP(0xC);
+        sum += window[0xE] * TAP(0xE);
+
+        if (dsamp)
+        {
+            *dsamp++ = (Float_t)sum;
+        }
+        if (sum > mSamp)
+        {
+            mSamp = sum;
+        }
+        else if ((-sum) > mSamp)
+        {
+            mSamp = (-sum);
+        }
+        b0--, window -= 0x20;
+    }
+    window += bo1 << 1;
+
+    for (j = 15; j; j--, b0--, window -= 0x20)
+    {
+        double sum;
+        sum = -window[-0x1] * TAP(0x0);
+        sum -= window[-0x2] * TAP(0x1);
+        sum -= window[-0x3] * TAP(0x2);
+        sum -= window[-0x4] * TAP(0x3);
+        sum -= window[-0x5] * TAP(0x4);
+        sum -= window[-0x6] * TAP(0x5);
+        sum -= window[-0x7] * TAP(0x6);
+        sum -= window[-0x8] * TAP(0x7);
+        sum -= window[-0x9] * TAP(0x8);
+        sum -= window[-0xA] * TAP(0x9);
+        sum -= window[-0xB] * TAP(0xA);
+        sum -= window[-0xC] * TAP(0xB);
+        sum -= window[-0xD] * TAP(0xC);
+        sum -= window[-0xE] * TAP(0xD);
+        sum -= window[-0xF] * TAP(0xE);
+        sum -= window[-0x0] * TAP(0xF);
+
+        if (dsamp)
+        {
+            *dsamp++ = (Float_t)sum;
+        }
+        if (sum > mSamp)
+        {
+            mSamp = sum;
+        }
+        else if ((-sum) > mSamp)
+        {
+            mSamp = (-sum);
+        }
+    }
+
+    return mSamp;
+}
+
+/* the middle sample, row 16, which only has the even taps */
+static double window_middle(const double *b0, int bo1)
+{
+    const double (*window)[SYNTH_ROWS] = decwinT + 16 - bo1;
+    double sum;
+    int k;
+
+    sum = window[0][16] * b0[16];
+    for (k = 2; k < 16; k += 2)
+    {
+        sum += window[k][16] * b0[k * SYNTH_ROWS + 16];
+    }
+    return sum;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * In the first half, row r (0..15) goes to sample r and its taps use
+ * decwinT[16 - bo1 + k][r], added and subtracted in turn.  In the second
+ * half, row r (15..1) goes to sample 32 - r, tap k < 15 uses
+ * decwinT[15 + bo1 - k][r] and tap 15 uses decwinT[16 + bo1][r], all
+ * subtracted.  Row 0 of the second half is worked out with the others and
+ * thrown away.
+ */
+
+static double window_sse2(const double *b0, int bo1, Float_t *dsamp)
+{
+    const double (*first)[SYNTH_ROWS] = decwinT + 16 - bo1;
+    const double (*second)[SYNTH_ROWS] = decwinT + 15 + bo1;
+    const __m128d absMask = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffffLL));
+    __m128d peak = _mm_setzero_pd();
+    double middle, mSamp;
+    int r, k;
+
+    for (r = 0; r < 16; r += 2)
+    {
+        __m128d sum = _mm_mul_pd(_mm_load_pd(first[0] + r), _mm_load_pd(b0 + r));
+
+        for (k = 1; k < 16; k++)
+        {
+            __m128d t = _mm_mul_pd(_mm_load_pd(first[k] + r), _mm_load_pd(b0 + k * SYNTH_ROWS + r));
+            sum = (k & 1) ? _mm_sub_pd(sum, t) : _mm_add_pd(sum, t);
+        }
+        if (dsamp)
+        {
+            _mm_storeu_pd(dsamp + r, sum);
+        }
+        peak = _mm_max_pd(_mm_and_pd(sum, absMask), peak);
+    }
+
+    middle = window_middle(b0, bo1);
+    if (dsamp)
+    {
+        dsamp[16] = middle;
+    }
+
+    for (r = 0; r < 16; r += 2)
+    {
+        __m128d sum = _mm_xor_pd(_mm_set1_pd(-0.0), _mm_mul_pd(_mm_load_pd(second[0] + r), _mm_load_pd(b0 + r)));
+
+        for (k = 1; k < 15; k++)
+        {
+            sum = _mm_sub_pd(sum, _mm_mul_pd(_mm_load_pd(second[-k] + r), _mm_load_pd(b0 + k * SYNTH_ROWS + r)));
+        }
+        sum = _mm_sub_pd(sum, _mm_mul_pd(_mm_load_pd(second[1] + r), _mm_load_pd(b0 + 15 * SYNTH_ROWS + r)));
+
+        if (r == 0)
+        {
+            sum = _mm_unpackhi_pd(sum, sum);
+            if (dsamp)
+            {
+                _mm_storeh_pd(dsamp + 31, sum);
+            }
+        }
+        else if (dsamp)
+        {
+            _mm_storeu_pd(dsamp + 31 - r, _mm_shuffle_pd(sum, sum, 1));
+        }
+        peak = _mm_max_pd(_mm_and_pd(sum, absMask), peak);
+    }
+
+    peak = _mm_max_pd(peak, _mm_unpackhi_pd(peak, peak));
+    mSamp = _mm_cvtsd_f64(peak);
+    return fabs(middle) > mSamp ? fabs(middle) : mSamp;
+}
+
+__attribute__((target("avx2")))
+static double window_avx2(const double *b0, int bo1, Float_t *dsamp)
+{
+    const double (*first)[SYNTH_ROWS] = decwinT + 16 - bo1;
+    const double (*second)[SYNTH_ROWS] = decwinT + 15 + bo1;
+    const __m256d absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+    __m256d peak = _mm256_setzero_pd();
+    __m128d peak2;
+    double middle, mSamp;
+    int r, k;
+
+    for (r = 0; r < 16; r += 4)
+    {
+        __m256d sum = _mm256_mul_pd(_mm256_load_pd(first[0] + r), _mm256_load_pd(b0 + r));
+
+        for (k = 1; k < 16; k++)
+        {
+            __m256d t = _mm256_mul_pd(_mm256_load_pd(first[k] + r), _mm256_load_pd(b0 + k * SYNTH_ROWS + r));
+            sum = (k & 1) ? _mm256_sub_pd(sum, t) : _mm256_add_pd(sum, t);
+        }
+        if (dsamp)
+        {
+            _mm256_storeu_pd(dsamp + r, sum);
+        }
+        peak = _mm256_max_pd(_mm256_and_pd(sum, absMask), peak);
+    }
+
+    middle = window_middle(b0, bo1);
+    if (dsamp)
+    {
+        dsamp[16] = middle;
+    }
+
+    for (r = 0; r < 16; r += 4)
+    {
+        __m256d sum = _mm256_xor_pd(_mm256_set1_pd(-0.0), _mm256_mul_pd(_mm256_load_pd(second[0] + r), _mm256_load_pd(b0 + r)));
+
+        for (k = 1; k < 15; k++)
+        {
+            sum = _mm256_sub_pd(sum, _mm256_mul_pd(_mm256_load_pd(second[-k] + r), _mm256_load_pd(b0 + k * SYNTH_ROWS + r)));
+        }
+        sum = _mm256_sub_pd(sum, _mm256_mul_pd(_mm256_load_pd(second[1] + r), _mm256_load_pd(b0 + 15 * SYNTH_ROWS + r)));
+
+        if (r == 0)
+        {
+            sum = _mm256_blend_pd(sum, _mm256_setzero_pd(), 0x1);
+            if (dsamp)
+            {
+                _mm256_maskstore_pd(dsamp + 29, _mm256_set_epi64x(0, -1, -1, -1), _mm256_permute4x64_pd(sum, 0x1B));
+            }
+        }
+        else if (dsamp)
+        {
+            _mm256_storeu_pd(dsamp + 29 - r, _mm256_permute4x64_pd(sum, 0x1B));
+        }
+        peak = _mm256_max_pd(_mm256_and_pd(sum, absMask), peak);
+    }
+
+    peak2 = _mm_max_pd(_mm256_castpd256_pd128(peak), _mm256_extractf128_pd(peak, 1));
+    peak2 = _mm_max_pd(peak2, _mm_unpackhi_pd(peak2, peak2));
+    mSamp = _mm_cvtsd_f64(peak2);
+    return fabs(middle) > mSamp ? fabs(middle) : mSamp;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static void (*dct64_impl)(double *a, double *b, double *c) = dct64;
+static windowFunc window_impl = window_scalar;
+
+void init_synth(void)
+{
+    switch (simd_level())
+    {
+#ifdef HAVE_X86_SIMD
+    case SIMD_AVX2:
+        dct64_impl = dct64_avx2;
+        window_impl = window_avx2;
+        break;
+    case SIMD_SSE2:
+        dct64_impl = dct64_sse2;
+        window_impl = window_sse2;
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
 int synth_1to1(PMPSTR mp, double *bandPtr, int channel, int *pnt)
 {
     /*  static const int step = 2; */
     int bo;
     Float_t *dsamp;
-    double mSamp = 0;
+    double mSamp;
 
-    double *b0, (*buf)[0x110];
+    double *b0, (*buf)[16 * SYNTH_ROWS];
     int clip = 0;
     int bo1;
 
@@ -66,201 +357,25 @@ int synth_1to1(PMPSTR mp, double *bandPtr, int channel, int *pnt)
     {
         b0 = buf[0];
         bo1 = bo;
-        dct64(buf[1] + ((bo + 1) & 0xf), buf[0] + bo, bandPtr);
+        dct64_impl(buf[1] + ((bo + 1) & 0xf) * SYNTH_ROWS, buf[0] + bo * SYNTH_ROWS, bandPtr);
     }
     else
     {
         b0 = buf[1];
         bo1 = bo + 1;
-        dct64(buf[0] + bo, buf[1] + bo + 1, bandPtr);
+        dct64_impl(buf[0] + bo * SYNTH_ROWS, buf[1] + (bo + 1) * SYNTH_ROWS, bandPtr);
     }
 
     mp->synth_bo = bo;
     if (maxAmpOnly)
     {
-        {
-            register int j;
-            double *window = decwin + 16 - bo1;
-
-            for (j = 16; j; j--, b0 += 0x10, window += 0x20)
-            {
-                double sum;
-                sum  = window[0x0] * b0[0x0];
-                sum -= window[0x1] * b0[0x1];
-                sum += window[0x2] * b0[0x2];
-                sum -= window[0x3] * b0[0x3];
-                sum += window[0x4] * b0[0x4];
-                sum -= window[0x5] * b0[0x5];
-                sum += window[0x6] * b0[0x6];
-                sum -= window[0x7] * b0[0x7];
-                sum += window[0x8] * b0[0x8];
-                sum -= window[0x9] * b0[0x9];
-                sum += window[0xA] * b0[0xA];
-                sum -= window[0xB] * b0[0xB];
-                sum += window[0xC] * b0[0xC];
-                sum -= window[0xD] * b0[0xD];
-                sum += window[0xE] * b0[0xE];
-                sum -= window[0xF] * b0[0xF];
-
-                if (sum > mSamp)
-                {
-                    mSamp = sum;
-                }
-                else if ((-sum) > mSamp)
-                {
-                    mSamp = (-sum);
-                }
-            }
-
-            {
-                double sum;
-                sum  = window[0x0] * b0[0x0];
-                sum += window[0x2] * b0[0x2];
-                sum += window[0x4] * b0[0x4];
-                sum += window[0x6] * b0[0x6];
-                sum += window[0x8] * b0[0x8];
-                sum += window[0xA] * b0[0xA];
-                sum += window[0xC] * b0[0xC];
-                sum += window[0xE] * b0[0xE];
-
-                if (sum > mSamp)
-                {
-                    mSamp = sum;
-                }
-                else if ((-sum) > mSamp)
-                {
-                    mSamp = (-sum);
-                }
-                b0 -= 0x10, window -= 0x20;
-            }
-            window += bo1 << 1;
-
-            for (j = 15; j; j--, b0 -= 0x10, window -= 0x20)
-            {
-                double sum;
-                sum = -window[-0x1] * b0[0x0];
-                sum -= window[-0x2] * b0[0x1];
-                sum -= window[-0x3] * b0[0x2];
-                sum -= window[-0x4] * b0[0x3];
-                sum -= window[-0x5] * b0[0x4];
-                sum -= window[-0x6] * b0[0x5];
-                sum -= window[-0x7] * b0[0x6];
-                sum -= window[-0x8] * b0[0x7];
-                sum -= window[-0x9] * b0[0x8];
-                sum -= window[-0xA] * b0[0x9];
-                sum -= window[-0xB] * b0[0xA];
-                sum -= window[-0xC] * b0[0xB];
-                sum -= window[-0xD] * b0[0xC];
-                sum -= window[-0xE] * b0[0xD];
-                sum -= window[-0xF] * b0[0xE];
-                sum -= window[-0x0] * b0[0xF];
-
-                if (sum > mSamp)
-                {
-                    mSamp = sum;
-                }
-                else if ((-sum) > mSamp)
-                {
-                    mSamp = (-sum);
-                }
-            }
-        }
+        mSamp = window_impl(b0, bo1, NULL);
     }
     else
     {
-
-        {
-            register int j;
-            double *window = decwin + 16 - bo1;
-
-            for (j = 16; j; j--, b0 += 0x10, window += 0x20)
-            {
-                double sum;
-                sum  = window[0x0] * b0[0x0];
-                sum -= window[0x1] * b0[0x1];
-                sum += window[0x2] * b0[0x2];
-                sum -= window[0x3] * b0[0x3];
-                sum += window[0x4] * b0[0x4];
-                sum -= window[0x5] * b0[0x5];
-                sum += window[0x6] * b0[0x6];
-                sum -= window[0x7] * b0[0x7];
-                sum += window[0x8] * b0[0x8];
-                sum -= window[0x9] * b0[0x9];
-                sum += window[0xA] * b0[0xA];
-                sum -= window[0xB] * b0[0xB];
-                sum += window[0xC] * b0[0xC];
-                sum -= window[0xD] * b0[0xD];
-                sum += window[0xE] * b0[0xE];
-                sum -= window[0xF] * b0[0xF];
-
-                *dsamp++ = (Float_t)sum;
-                procSamp++;
-                if (sum > mSamp)
-                {
-                    mSamp = sum;
-                }
-                else if ((-sum) > mSamp)
-                {
-                    mSamp = (-sum);
-                }
-            }
-
-            {
-                double sum;
-                sum  = window[0x0] * b0[0x0];
-                sum += window[0x2] * b0[0x2];
-                sum += window[0x4] * b0[0x4];
-                sum += window[0x6] * b0[0x6];
-                sum += window[0x8] * b0[0x8];
-                sum += window[0xA] * b0[0xA];
-                sum += window[0xC] * b0[0xC];
-                sum += window[0xE] * b0[0xE];
-                *dsamp++ = (Float_t)sum;
-                procSamp++;
-                if (sum > mSamp)
-                {
-                    mSamp = sum;
-                }
-                else if ((-sum) > mSamp)
-                {
-                    mSamp = (-sum);
-                }
-                b0 -= 0x10, window -= 0x20;
-            }
-            window += bo1 << 1;
-
-            for (j = 15; j; j--, b0 -= 0x10, window -= 0x20)
-            {
-                double sum;
-                sum = -window[-0x1] * b0[0x0];
-                sum -= window[-0x2] * b0[0x1];
-                sum -= window[-0x3] * b0[0x2];
-                sum -= window[-0x4] * b0[0x3];
-                sum -= window[-0x5] * b0[0x4];
-                sum -= window[-0x6] * b0[0x5];
-                sum -= window[-0x7] * b0[0x6];
-                sum -= window[-0x8] * b0[0x7];
-                sum -= window[-0x9] * b0[0x8];
-                sum -= window[-0xA] * b0[0x9];
-                sum -= window[-0xB] * b0[0xA];
-                sum -= window[-0xC] * b0[0xB];
-                sum -= window[-0xD] * b0[0xC];
-                sum -= window[-0xE] * b0[0xD];
-                sum -= window[-0xF] * b0[0xE];
-                sum -= window[-0x0] * b0[0xF];
-
-                *dsamp++ = (Float_t)sum;
-                procSamp++;
-                if (sum > mSamp)
-                {
-                    mSamp = sum;
-                }
-                else if ((-sum) > mSamp)
-                {
-                    mSamp = (-sum);
-                }
-            }
-        }
+        mSamp = window_impl(b0, bo1, dsamp);
+        dsamp += 32;
+        procSamp += 32;
     }
     *pnt += 128;
 
@@ -22,3 +22,4 @@
 
 int synth_1to1_mono(PMPSTR mp, double *bandPtr, int *pnt);
 int synth_1to1(PMPSTR mp, double *bandPtr, int channel, int *pnt);
+void init_synth(void);
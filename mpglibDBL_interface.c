@@ -1,15 +1,29 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "mpglibDBL_common.h"
 #include "mpglibDBL_interface.h"
 #include "mpglibDBL_tabinit.h"
+#include "mpglibDBL_decode_i386.h"
 #include "mpglibDBL_layer3.h"
 #include "mpglibDBL_VbrTag.h"
 
+/* The synthesis and layer 3 tables are shared by every decoder */
+static void initTables(void)
+{
+    make_decode_tables(32767);
+    init_synth();
+
+    init_layer3(SBLIMIT);
+}
+
 bool InitMP3(PMPSTR mp)
 {
-    memset(mp, 0, sizeof(MPSTR));
+    static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+    memset(mp, 0, offsetof(MPSTR, inbuf));
 
     mp->framesize = 0;
     mp->num_frames = 0;
@@ -26,52 +40,33 @@ bool InitMP3(PMPSTR mp)
     mp->head = mp->tail = NULL;
     mp->fr.single = -1;
     mp->bsnum = 0;
-    wordpointer = mp->bsspace[mp->bsnum] + 512;
+    mp->wordpointer = mp->bsspace[mp->bsnum] + 512;
     mp->synth_bo = 1;
     mp->sync_bitstream = 1;
 
-    make_decode_tables(32767);
-
-    init_layer3(SBLIMIT);
+    pthread_once(&tablesOnce, initTables);
 
     return !0;
 }
 
 void ExitMP3(PMPSTR mp)
 {
-    struct buf *b, *bn;
-
-    b = mp->tail;
-    while (b)
-    {
-        free(b->pnt);
-        bn = b->next;
-        free(b);
-        b = bn;
-    }
+    mp->head = mp->tail = NULL;
+    mp->bsize = 0;
 }
 
-static struct buf *addbuf(PMPSTR mp, const unsigned char *ibuf, int size)
+/*
+ * The input is read in place from the caller's buffer.  Only what one call
+ * leaves unread is copied, into inbuf, so nothing is allocated per frame.
+ */
+static void addbuf(PMPSTR mp, const unsigned char *ibuf, int size)
 {
-    struct buf *nbuf;
+    struct buf *nbuf = &mp->inbufs[1];
 
-    nbuf = malloc(sizeof(struct buf));
-    if (!nbuf)
-    {
-        fprintf(stderr, "Out of memory!\n");
-        return NULL;
-    }
-    nbuf->pnt = malloc((size_t)size);
-    if (!nbuf->pnt)
-    {
-        free(nbuf);
-        return NULL;
-    }
+    nbuf->pnt = ibuf;
     nbuf->size = size;
-    memcpy(nbuf->pnt, ibuf, (size_t)size);
-    nbuf->next = NULL;
-    nbuf->prev = mp->head;
     nbuf->pos = 0;
+    nbuf->next = NULL;
 
     if (!mp->tail)
     {
@@ -84,27 +79,51 @@ static struct buf *addbuf(PMPSTR mp, const unsigned char *ibuf, int size)
 
     mp->head = nbuf;
     mp->bsize += size;
-
-    return nbuf;
 }
 
-void remove_buf(PMPSTR mp)
+/* keep the unread input for the next call, dropping the oldest if too much */
+static void keep_input(PMPSTR mp)
 {
-    struct buf *buff = mp->tail;
+    struct buf *kept = &mp->inbufs[0];
+    struct buf *b;
+    long size = 0;
 
-    mp->tail = buff->next;
-    if (mp->tail)
+    while (mp->bsize > INBUFSIZE)
     {
-        mp->tail->prev = NULL;
+        long skip = mp->tail->size - mp->tail->pos;
+
+        if (skip > mp->bsize - INBUFSIZE)
+        {
+            skip = mp->bsize - INBUFSIZE;
+        }
+        mp->tail->pos += skip;
+        mp->bsize -= skip;
+        if (mp->tail->pos == mp->tail->size)
+        {
+            mp->tail = mp->tail->next;
+        }
     }
-    else
+
+    for (b = mp->tail; b; b = b->next)
     {
-        mp->tail = mp->head = NULL;
+        memmove(mp->inbuf + size, b->pnt + b->pos, (size_t)(b->size - b->pos));
+        size += b->size - b->pos;
     }
 
-    free(buff->pnt);
-    free(buff);
+    kept->pnt = mp->inbuf;
+    kept->size = size;
+    kept->pos = 0;
+    kept->next = NULL;
+    mp->tail = mp->head = size ? kept : NULL;
+}
 
+static void remove_buf(PMPSTR mp)
+{
+    mp->tail = mp->tail->next;
+    if (!mp->tail)
+    {
+        mp->head = NULL;
+    }
 }
 
 static int read_buf_byte(PMPSTR mp)
@@ -177,6 +196,7 @@ void copy_mp(PMPSTR mp, int size, unsigned char *ptr)
 }
 
 char VBRTag[5] = "Xing";
+char VBRTag2[5] = "Info";   /* LAME's name for the header of a CBR file */
 
 static int ExtractI4(unsigned char *buf)
 {
@@ -247,22 +267,10 @@ int GetVbrTag(VBRTAGDATA *pTagData,  unsigned char *buf)
         }
     }
 
-    if (buf[0] != VBRTag[0])
-    {
-        return 0;    /* fail */
-    }
-    if (buf[1] != VBRTag[1])
+    if (memcmp(buf, VBRTag, 4) != 0 && memcmp(buf, VBRTag2, 4) != 0)
     {
         return 0;    /* header not found*/
     }
-    if (buf[2] != VBRTag[2])
-    {
-        return 0;
-    }
-    if (buf[3] != VBRTag[3])
-    {
-        return 0;
-    }
 
     buf += 4;
 
@@ -460,18 +468,10 @@ int sync_buffer(PMPSTR mp, int free_match)
     return -1;
 }
 
-int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
+static int decode_frame(PMPSTR mp, int *done)
 {
     int i, iret, bits, bytes;
 
-    if (in)
-    {
-        if (addbuf(mp, in, isize) == NULL)
-        {
-            return MP3_ERR;
-        }
-    }
-
     /* First decode header */
     if (!mp->header_parsed)
     {
@@ -541,7 +541,7 @@ int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
             mp->sync_bitstream = 1;
 
             /* skip some bytes, buffer the rest */
-            size = (int)(wordpointer - (mp->bsspace[mp->bsnum] + 512));
+            size = (int)(mp->wordpointer - (mp->bsspace[mp->bsnum] + 512));
 
             if (size > MAXFRAMESIZE)
             {
@@ -549,7 +549,7 @@ int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
                 //                  fprintf(stderr,"mpglib: wordpointer trashed.  size=%i (%i)  bytes=%i \n",
                 //                          size,MAXFRAMESIZE,bytes);
                 size = 0;
-                wordpointer = mp->bsspace[mp->bsnum] + 512;
+                mp->wordpointer = mp->bsspace[mp->bsnum] + 512;
             }
 
             /* buffer contains 'size' data right now
@@ -562,7 +562,7 @@ int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
                 read_buf_byte(mp);
             }
 
-            copy_mp(mp, bytes, wordpointer);
+            copy_mp(mp, bytes, mp->wordpointer);
             mp->fsizeold += bytes;
         }
 
@@ -586,8 +586,7 @@ int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
         }
 
         mp->bsnum = 1 - mp->bsnum; /* toggle buffer */
-        wordpointer = mp->bsspace[mp->bsnum] + 512;
-        bitindex = 0;
+        mp->wordpointer = mp->bsspace[mp->bsnum] + 512;
 
         /* for very first header, never parse rest of data */
         if (mp->fsizeold == -1)
@@ -608,19 +607,23 @@ int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
                 return MP3_NEED_MORE;
             }
 
-            copy_mp(mp, mp->ssize, wordpointer);
+            copy_mp(mp, mp->ssize, mp->wordpointer);
+            bits_init(&mp->bits, mp->wordpointer);
 
             if (mp->fr.error_protection)
             {
-                getbits(16);
+                getbits(&mp->bits, 16);
             }
-            bits = do_layer3_sideinfo(&mp->fr);
+            bits = do_layer3_sideinfo(mp);
             if (bits == -32767)
             {
                 ExitMP3(mp);
                 InitMP3(mp);
                 return MP3_ERR;
             }
+            /* the side info is a whole number of bytes; main data follows */
+            mp->wordpointer += mp->ssize;
+
             /* bits = actual number of bits needed to parse this frame */
             /* can be negative, if all bits needed are in the reservoir */
             if (bits < 0)
@@ -663,7 +666,7 @@ int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
             return MP3_NEED_MORE;
         }
 
-        copy_mp(mp, mp->dsize, wordpointer);
+        copy_mp(mp, mp->dsize, mp->wordpointer);
 
         *done = 0;
 
@@ -681,7 +684,7 @@ int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
             fprintf(stderr, "invalid layer %d\n", mp->fr.lay);
         }
 
-        wordpointer = mp->bsspace[mp->bsnum] + 512 + mp->ssize + mp->dsize;
+        mp->wordpointer = mp->bsspace[mp->bsnum] + 512 + mp->ssize + mp->dsize;
 
         mp->data_parsed = 1;
     }
@@ -723,10 +726,10 @@ int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
     if (bytes > 0)
     {
         int size;
-        copy_mp(mp, bytes, wordpointer);
-        wordpointer += bytes;
+        copy_mp(mp, bytes, mp->wordpointer);
+        mp->wordpointer += bytes;
 
-        size = (int)(wordpointer - (mp->bsspace[mp->bsnum] + 512));
+        size = (int)(mp->wordpointer - (mp->bsspace[mp->bsnum] + 512));
         if (size > MAXFRAMESIZE)
         {
             fprintf(stderr, "fatal error.  MAXFRAMESIZE not large enough.\n");
@@ -744,3 +747,17 @@ int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
 
     return iret;
 }
+
+int decodeMP3(PMPSTR mp, const unsigned char *in, int isize, int *done)
+{
+    int iret;
+
+    if (in)
+    {
+        addbuf(mp, in, isize);
+    }
+    iret = decode_frame(mp, done);
+    keep_input(mp);
+
+    return iret;
+}
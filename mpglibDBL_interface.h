@@ -22,15 +22,14 @@
 #include "mpglibDBL_common.h"
 #include "gain_analysis.h"
 
-extern Float_t *lSamp;
-extern Float_t *rSamp;
-extern Float_t *maxSamp;
-extern unsigned char *maxGain;
-extern unsigned char *minGain;
+extern _Thread_local Float_t *lSamp;
+extern _Thread_local Float_t *rSamp;
+extern _Thread_local Float_t *maxSamp;
+extern _Thread_local unsigned char *maxGain;
+extern _Thread_local unsigned char *minGain;
 extern bool maxAmpOnly;
-extern int procSamp;
+extern _Thread_local int procSamp;
 
 bool InitMP3(PMPSTR mp);
 int decodeMP3(PMPSTR mp, const unsigned char *inmemory, int inmemsize, int *done);
 void ExitMP3(PMPSTR mp);
-void remove_buf(PMPSTR mp);
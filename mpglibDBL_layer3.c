@@ -10,16 +10,16 @@
 #include "mpglibDBL_huffman.h"
 #include "mpglibDBL_encoder.h"
 #include "mpglibDBL_decode_i386.h"
+#include "mpglibDBL_tables.h"
 
-unsigned char *maxGain;
-unsigned char *minGain;
+_Thread_local unsigned char *maxGain;
+_Thread_local unsigned char *minGain;
 
-static double ispow[8207];
 static double aa_ca[8], aa_cs[8];
 static double COS1[12][6];
 static double win[4][36];
 static double win1[4][36];
-static double gainpow2[256 + 118 + 4];
+static _Alignas(32) double winLanes[4][36][4];   /* win, win1, win, win1 */
 static double COS9[9];
 static double COS6_1, COS6_2;
 static double tfcos36[9];
@@ -106,16 +106,113 @@ static unsigned int i_slen2[256]; /* MPEG 2.0 slen for intensity stereo */
 static double tan1_1[16], tan2_1[16], tan1_2[16], tan2_2[16];
 static double pow1_1[2][16], pow2_1[2][16], pow1_2[2][16], pow2_2[2][16];
 
-static unsigned int get1bit(void)
+static void init_hybrid(void);
+
+/*
+ * Huffman codes are looked up HUFF_BITS at a time.  Each entry is the
+ * value and length of the code those bits start with, or, if the code is
+ * longer (len < 0), where in the tree to carry on bit by bit after using
+ * up all HUFF_BITS.  The tables are shared by trees with several linbits.
+ */
+#define HUFF_BITS 9
+
+struct hufflookup
 {
-    unsigned char rval;
-    rval = *wordpointer << bitindex;
+    short val;
+    signed char len;
+};
+
+static struct hufflookup huffLookups[18][1 << HUFF_BITS];
+static const struct hufflookup *htLookup[32];
+static const struct hufflookup *htcLookup[2];
 
-    bitindex++;
-    wordpointer += (bitindex >> 3);
-    bitindex &= 7;
+static void make_huff_lookup(struct hufflookup *lookup, const short *table)
+{
+    int bits;
 
-    return rval >> 7;
+    for (bits = 0; bits < 1 << HUFF_BITS; bits++)
+    {
+        const short *val = table;
+        int n = 0;
+        int y;
+
+        while ((y = *val++) < 0 && n < HUFF_BITS)
+        {
+            if (bits & (1 << (HUFF_BITS - 1 - n)))
+            {
+                val -= y;
+            }
+            n++;
+        }
+        if (y < 0)
+        {
+            lookup[bits].val = (short)(val - 1 - table);
+            lookup[bits].len = -1;
+        }
+        else
+        {
+            lookup[bits].val = (short)y;
+            lookup[bits].len = (signed char)n;
+        }
+    }
+}
+
+/* a big_values code: the pair x, y as (x << 4) | y */
+static inline int huff_decode(struct bitreader *bs, const struct newhuff *h, const struct hufflookup *lookup, int *part2remain)
+{
+    const struct hufflookup *e = &lookup[peekbits(bs, HUFF_BITS)];
+    register const short *val;
+    register int y;
+
+    if (e->len >= 0)
+    {
+        skipbits(bs, e->len);
+        *part2remain -= e->len;
+        return e->val;
+    }
+
+    skipbits(bs, HUFF_BITS);
+    *part2remain -= HUFF_BITS;
+    val = h->table + e->val;
+    while ((y = *val++) < 0)
+    {
+        if (get1bit(bs))
+        {
+            val -= y;
+        }
+        (*part2remain)--;
+    }
+    return y;
+}
+
+/* a count1 code, which stops short at the end of part 3 */
+static inline int huff_decode_count1(struct bitreader *bs, const struct newhuff *h, const struct hufflookup *lookup, int *part2remain)
+{
+    const struct hufflookup *e = &lookup[peekbits(bs, HUFF_BITS)];
+    register const short *val = h->table;
+    register short a;
+
+    if (e->len >= 0 && e->len <= *part2remain)
+    {
+        skipbits(bs, e->len);
+        *part2remain -= e->len;
+        return e->val;
+    }
+
+    while ((a = *val++) < 0)
+    {
+        (*part2remain)--;
+        if (*part2remain < 0)
+        {
+            (*part2remain)++;
+            return 0;
+        }
+        if (get1bit(bs))
+        {
+            val -= a;
+        }
+    }
+    return a;
 }
 
 /*
@@ -125,14 +222,27 @@ void init_layer3(int down_sample_sblimit)
 {
     int i, j, k;
 
-    for (i = -256; i < 118 + 4; i++)
+    /* ispow and gainpow2 are generated at build time, see mpglibDBL_mktables.c */
+
+    for (i = 0, k = 0; i < 32; i++)
     {
-        gainpow2[i + 256] = pow((double)2.0, -0.25 * (double)(i + 210));
+        for (j = 0; j < i && ht[j].table != ht[i].table; j++)
+        {
+        }
+        if (j < i)
+        {
+            htLookup[i] = htLookup[j];
+        }
+        else
+        {
+            make_huff_lookup(huffLookups[k], ht[i].table);
+            htLookup[i] = huffLookups[k++];
+        }
     }
-
-    for (i = 0; i < 8207; i++)
+    for (i = 0; i < 2; i++, k++)
     {
-        ispow[i] = pow((double)i, (double)4.0 / 3.0);
+        make_huff_lookup(huffLookups[k], htc[i].table);
+        htcLookup[i] = huffLookups[k];
     }
 
     for (i = 0; i < 8; i++)
@@ -196,6 +306,11 @@ void init_layer3(int down_sample_sblimit)
         {
             win1[j][i] = - win[j][i];
         }
+        for (i = 0; i < 36; i++)
+        {
+            winLanes[j][i][0] = winLanes[j][i][2] = win[j][i];
+            winLanes[j][i][1] = winLanes[j][i][3] = win1[j][i];
+        }
     }
 
     for (i = 0; i < 16; i++)
@@ -364,31 +479,32 @@ void init_layer3(int down_sample_sblimit)
             }
         }
     }
+    init_hybrid();
 }
 
 /*
  * read additional side information
  */
-static int III_get_side_info_1(struct III_sideinfo *si, int stereo,
+static int III_get_side_info_1(struct bitreader *bs, struct III_sideinfo *si, int stereo,
                                int ms_stereo, long sfreq, int single)
 {
     int ch, gr;
     int powdiff = (single == 3) ? 4 : 0;
 
-    si->main_data_begin = getbits(9);
+    si->main_data_begin = getbits(bs, 9);
     if (stereo == 1)
     {
-        si->private_bits = getbits_fast(5);
+        si->private_bits = getbits(bs, 5);
     }
     else
     {
-        si->private_bits = getbits_fast(3);
+        si->private_bits = getbits(bs, 3);
     }
 
     for (ch = 0; ch < stereo; ch++)
     {
         si->ch[ch].gr[0].scfsi = -1;
-        si->ch[ch].gr[1].scfsi = getbits_fast(4);
+        si->ch[ch].gr[1].scfsi = getbits(bs, 4);
     }
 
     for (gr = 0; gr < 2; gr++)
@@ -397,8 +513,8 @@ static int III_get_side_info_1(struct III_sideinfo *si, int stereo,
         {
             register struct gr_info_s *gr_infos = &(si->ch[ch].gr[gr]);
 
-            gr_infos->part2_3_length = getbits(12);
-            gr_infos->big_values = getbits_fast(9);
+            gr_infos->part2_3_length = getbits(bs, 12);
+            gr_infos->big_values = getbits(bs, 9);
             if (gr_infos->big_values > 288)
             {
                 //          fprintf(stderr,"big_values too large! %i\n",gr_infos->big_values);
@@ -406,7 +522,7 @@ static int III_get_side_info_1(struct III_sideinfo *si, int stereo,
                 return 0;
             }
             {
-                unsigned int qss = getbits_fast(8);
+                unsigned int qss = getbits(bs, 8);
                 if ((unsigned char)qss > *maxGain)
                 {
                     *maxGain = (unsigned char)qss;
@@ -422,15 +538,15 @@ static int III_get_side_info_1(struct III_sideinfo *si, int stereo,
             {
                 gr_infos->pow2gain += 2;
             }
-            gr_infos->scalefac_compress = getbits_fast(4);
+            gr_infos->scalefac_compress = getbits(bs, 4);
             /* window-switching flag == 1 for block_Type != 0 .. and block-type == 0 -> win-sw-flag = 0 */
-            if (get1bit())
+            if (get1bit(bs))
             {
                 int i;
-                gr_infos->block_type = getbits_fast(2);
-                gr_infos->mixed_block_flag = get1bit();
-                gr_infos->table_select[0] = getbits_fast(5);
-                gr_infos->table_select[1] = getbits_fast(5);
+                gr_infos->block_type = getbits(bs, 2);
+                gr_infos->mixed_block_flag = get1bit(bs);
+                gr_infos->table_select[0] = getbits(bs, 5);
+                gr_infos->table_select[1] = getbits(bs, 5);
 
                 /*
                  * table_select[2] not needed, because there is no region2,
@@ -439,7 +555,7 @@ static int III_get_side_info_1(struct III_sideinfo *si, int stereo,
                 gr_infos->table_select[2] = 0;
                 for (i = 0; i < 3; i++)
                 {
-                    unsigned int sbg = (getbits_fast(3) << 3);
+                    unsigned int sbg = (getbits(bs, 3) << 3);
                     gr_infos->full_gain[i] = gr_infos->pow2gain + sbg;
                 }
 
@@ -459,18 +575,18 @@ static int III_get_side_info_1(struct III_sideinfo *si, int stereo,
                 int i, r0c, r1c;
                 for (i = 0; i < 3; i++)
                 {
-                    gr_infos->table_select[i] = getbits_fast(5);
+                    gr_infos->table_select[i] = getbits(bs, 5);
                 }
-                r0c = getbits_fast(4);
-                r1c = getbits_fast(3);
+                r0c = getbits(bs, 4);
+                r1c = getbits(bs, 3);
                 gr_infos->region1start = bandInfo[sfreq].longIdx[r0c + 1] >> 1 ;
                 gr_infos->region2start = bandInfo[sfreq].longIdx[r0c + 1 + r1c + 1] >> 1;
                 gr_infos->block_type = 0;
                 gr_infos->mixed_block_flag = 0;
             }
-            gr_infos->preflag = get1bit();
-            gr_infos->scalefac_scale = get1bit();
-            gr_infos->count1table_select = get1bit();
+            gr_infos->preflag = get1bit(bs);
+            gr_infos->scalefac_scale = get1bit(bs);
+            gr_infos->count1table_select = get1bit(bs);
         }
     }
     return 1;
@@ -479,21 +595,21 @@ static int III_get_side_info_1(struct III_sideinfo *si, int stereo,
 /*
  * Side Info for MPEG 2.0 / LSF
  */
-static int III_get_side_info_2(struct III_sideinfo *si, int stereo,
+static int III_get_side_info_2(struct bitreader *bs, struct III_sideinfo *si, int stereo,
                                int ms_stereo, long sfreq, int single)
 {
     int ch;
     int powdiff = (single == 3) ? 4 : 0;
 
-    si->main_data_begin = getbits(8);
+    si->main_data_begin = getbits(bs, 8);
 
     if (stereo == 1)
     {
-        si->private_bits = get1bit();
+        si->private_bits = get1bit(bs);
     }
     else
     {
-        si->private_bits = getbits_fast(2);
+        si->private_bits = getbits(bs, 2);
     }
 
     for (ch = 0; ch < stereo; ch++)
@@ -501,15 +617,15 @@ static int III_get_side_info_2(struct III_sideinfo *si, int stereo,
         register struct gr_info_s *gr_infos = &(si->ch[ch].gr[0]);
         unsigned int qss;
 
-        gr_infos->part2_3_length = getbits(12);
-        gr_infos->big_values = getbits_fast(9);
+        gr_infos->part2_3_length = getbits(bs, 12);
+        gr_infos->big_values = getbits(bs, 9);
         if (gr_infos->big_values > 288)
         {
             //         fprintf(stderr,"big_values too large! %i\n",gr_infos->big_values);
             //gr_infos->big_values = 288;
             return 0;
         }
-        qss = getbits_fast(8);
+        qss = getbits(bs, 8);
         if ((unsigned char)qss > *maxGain)
         {
             *maxGain = (unsigned char)qss;
@@ -525,15 +641,15 @@ static int III_get_side_info_2(struct III_sideinfo *si, int stereo,
         {
             gr_infos->pow2gain += 2;
         }
-        gr_infos->scalefac_compress = getbits(9);
+        gr_infos->scalefac_compress = getbits(bs, 9);
         /* window-switching flag == 1 for block_Type != 0 .. and block-type == 0 -> win-sw-flag = 0 */
-        if (get1bit())
+        if (get1bit(bs))
         {
             int i;
-            gr_infos->block_type = getbits_fast(2);
-            gr_infos->mixed_block_flag = get1bit();
-            gr_infos->table_select[0] = getbits_fast(5);
-            gr_infos->table_select[1] = getbits_fast(5);
+            gr_infos->block_type = getbits(bs, 2);
+            gr_infos->mixed_block_flag = get1bit(bs);
+            gr_infos->table_select[0] = getbits(bs, 5);
+            gr_infos->table_select[1] = getbits(bs, 5);
             /*
              * table_select[2] not needed, because there is no region2,
              * but to satisfy some verifications tools we set it either.
@@ -541,7 +657,7 @@ static int III_get_side_info_2(struct III_sideinfo *si, int stereo,
             gr_infos->table_select[2] = 0;
             for (i = 0; i < 3; i++)
             {
-                unsigned int sbg = (getbits_fast(3) << 3);
+                unsigned int sbg = (getbits(bs, 3) << 3);
                 gr_infos->full_gain[i] = gr_infos->pow2gain + sbg;
 
             }
@@ -575,17 +691,17 @@ static int III_get_side_info_2(struct III_sideinfo *si, int stereo,
             int i, r0c, r1c;
             for (i = 0; i < 3; i++)
             {
-                gr_infos->table_select[i] = getbits_fast(5);
+                gr_infos->table_select[i] = getbits(bs, 5);
             }
-            r0c = getbits_fast(4);
-            r1c = getbits_fast(3);
+            r0c = getbits(bs, 4);
+            r1c = getbits(bs, 3);
             gr_infos->region1start = bandInfo[sfreq].longIdx[r0c + 1] >> 1 ;
             gr_infos->region2start = bandInfo[sfreq].longIdx[r0c + 1 + r1c + 1] >> 1;
             gr_infos->block_type = 0;
             gr_infos->mixed_block_flag = 0;
         }
-        gr_infos->scalefac_scale = get1bit();
-        gr_infos->count1table_select = get1bit();
+        gr_infos->scalefac_scale = get1bit(bs);
+        gr_infos->count1table_select = get1bit(bs);
     }
     return 1;
 }
@@ -593,7 +709,7 @@ static int III_get_side_info_2(struct III_sideinfo *si, int stereo,
 /*
  * read scalefactors
  */
-static int III_get_scale_factors_1(int *scf, struct gr_info_s *gr_infos)
+static int III_get_scale_factors_1(struct bitreader *bs, int *scf, struct gr_info_s *gr_infos)
 {
     static const unsigned char slen[2][16] =
     {
@@ -613,7 +729,7 @@ static int III_get_scale_factors_1(int *scf, struct gr_info_s *gr_infos)
         {
             for (i = 8; i; i--)
             {
-                *scf++ = getbits_fast(num0);
+                *scf++ = getbits(bs, num0);
             }
             i = 9;
             numbits -= num0; /* num0 * 17 + num1 * 18 */
@@ -621,11 +737,11 @@ static int III_get_scale_factors_1(int *scf, struct gr_info_s *gr_infos)
 
         for (; i; i--)
         {
-            *scf++ = getbits_fast(num0);
+            *scf++ = getbits(bs, num0);
         }
         for (i = 18; i; i--)
         {
-            *scf++ = getbits_fast(num1);
+            *scf++ = getbits(bs, num1);
         }
         *scf++ = 0;
         *scf++ = 0;
@@ -640,11 +756,11 @@ static int III_get_scale_factors_1(int *scf, struct gr_info_s *gr_infos)
         {
             for (i = 11; i; i--)
             {
-                *scf++ = getbits_fast(num0);
+                *scf++ = getbits(bs, num0);
             }
             for (i = 10; i; i--)
             {
-                *scf++ = getbits_fast(num1);
+                *scf++ = getbits(bs, num1);
             }
             numbits = (num0 + num1) * 10 + num0;
         }
@@ -655,7 +771,7 @@ static int III_get_scale_factors_1(int *scf, struct gr_info_s *gr_infos)
             {
                 for (i = 6; i; i--)
                 {
-                    *scf++ = getbits_fast(num0);
+                    *scf++ = getbits(bs, num0);
                 }
                 numbits += num0 * 6;
             }
@@ -668,7 +784,7 @@ static int III_get_scale_factors_1(int *scf, struct gr_info_s *gr_infos)
             {
                 for (i = 5; i; i--)
                 {
-                    *scf++ = getbits_fast(num0);
+                    *scf++ = getbits(bs, num0);
                 }
                 numbits += num0 * 5;
             }
@@ -681,7 +797,7 @@ static int III_get_scale_factors_1(int *scf, struct gr_info_s *gr_infos)
             {
                 for (i = 5; i; i--)
                 {
-                    *scf++ = getbits_fast(num1);
+                    *scf++ = getbits(bs, num1);
                 }
                 numbits += num1 * 5;
             }
@@ -694,7 +810,7 @@ static int III_get_scale_factors_1(int *scf, struct gr_info_s *gr_infos)
             {
                 for (i = 5; i; i--)
                 {
-                    *scf++ = getbits_fast(num1);
+                    *scf++ = getbits(bs, num1);
                 }
                 numbits += num1 * 5;
             }
@@ -709,7 +825,7 @@ static int III_get_scale_factors_1(int *scf, struct gr_info_s *gr_infos)
     return numbits;
 }
 
-static int III_get_scale_factors_2(int *scf, struct gr_info_s *gr_infos, int i_stereo)
+static int III_get_scale_factors_2(struct bitreader *bs, int *scf, struct gr_info_s *gr_infos, int i_stereo)
 {
     unsigned char *pnt;
     int i, j;
@@ -761,7 +877,7 @@ static int III_get_scale_factors_2(int *scf, struct gr_info_s *gr_infos, int i_s
         {
             for (j = 0; j < (int)(pnt[i]); j++)
             {
-                *scf++ = getbits_fast(num);
+                *scf++ = getbits(bs, num);
             }
             numbits += pnt[i] * num;
         }
@@ -789,7 +905,7 @@ static const int pretab2 [22] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 /*
  * don't forget to apply the same changes to III_dequantize_sample_ms() !!!
  */
-static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
+static int III_dequantize_sample(struct bitreader *bs, double xr[SBLIMIT][SSLIMIT],
                                  int *scf,
                                  struct gr_info_s *gr_infos,
                                  int sfreq,
@@ -799,9 +915,6 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
     double *xrpnt = (double *) xr;
     int l[3], l3;
     int part2remain = gr_infos->part2_3_length - part2bits;
-    int *me;
-
-    memset(xr, 0, SBLIMIT * SSLIMIT * sizeof(double));
 
     {
         int bv       = gr_infos->big_values;
@@ -845,19 +958,21 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
         register double v = 0.0;
         register int *m, mc;
 
+        /* the values are stored band by band, window by window, so
+           clear them all first and store only the decoded ones */
+        memset(xr, 0, SBLIMIT * SSLIMIT * sizeof(double));
+
         if (gr_infos->mixed_block_flag)
         {
             max[3] = -1;
             max[0] = max[1] = max[2] = 2;
             m = map[sfreq][0];
-            me = mapend[sfreq][0];
         }
         else
         {
             max[0] = max[1] = max[2] = max[3] = -1;
             /* max[3] not really needed in this case */
             m = map[sfreq][1];
-            me = mapend[sfreq][1];
         }
 
         mc = 0;
@@ -865,6 +980,7 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
         {
             int lp = l[i];
             struct newhuff *h = (struct newhuff *)(ht + gr_infos->table_select[i]);
+            const struct hufflookup *lookup = htLookup[gr_infos->table_select[i]];
             for (; lp; lp--, mc--)
             {
                 register int x, y;
@@ -885,25 +1001,15 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                         step = 3;
                     }
                 }
-                {
-                    register short *val = (short *)h->table;
-                    while ((y = *val++) < 0)
-                    {
-                        if (get1bit())
-                        {
-                            val -= y;
-                        }
-                        part2remain--;
-                    }
-                    x = y >> 4;
-                    y &= 0xf;
-                }
+                y = huff_decode(bs, h, lookup, &part2remain);
+                x = y >> 4;
+                y &= 0xf;
                 if (x == 15)
                 {
                     max[lwin] = cb;
                     part2remain -= h->linbits + 1;
-                    x += getbits((int)h->linbits);
-                    if (get1bit())
+                    x += getbits(bs, (int)h->linbits);
+                    if (get1bit(bs))
                     {
                         *xrpnt = -ispow[x] * v;
                     }
@@ -915,7 +1021,7 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                 else if (x)
                 {
                     max[lwin] = cb;
-                    if (get1bit())
+                    if (get1bit(bs))
                     {
                         *xrpnt = -ispow[x] * v;
                     }
@@ -934,8 +1040,8 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                 {
                     max[lwin] = cb;
                     part2remain -= h->linbits + 1;
-                    y += getbits((int)h->linbits);
-                    if (get1bit())
+                    y += getbits(bs, (int)h->linbits);
+                    if (get1bit(bs))
                     {
                         *xrpnt = -ispow[y] * v;
                     }
@@ -947,7 +1053,7 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                 else if (y)
                 {
                     max[lwin] = cb;
-                    if (get1bit())
+                    if (get1bit(bs))
                     {
                         *xrpnt = -ispow[y] * v;
                     }
@@ -966,23 +1072,9 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
         }
         for (; l3 && (part2remain > 0); l3--)
         {
-            struct newhuff *h = (struct newhuff *)(htc + gr_infos->count1table_select);
-            register short *val = (short *)h->table, a;
+            int a = huff_decode_count1(bs, htc + gr_infos->count1table_select,
+                                       htcLookup[gr_infos->count1table_select], &part2remain);
 
-            while ((a = *val++) < 0)
-            {
-                part2remain--;
-                if (part2remain < 0)
-                {
-                    part2remain++;
-                    a = 0;
-                    break;
-                }
-                if (get1bit())
-                {
-                    val -= a;
-                }
-            }
             for (i = 0; i < 4; i++)
             {
                 if (!(i & 1))
@@ -1015,7 +1107,7 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                         part2remain++;
                         break;
                     }
-                    if (get1bit())
+                    if (get1bit(bs))
                     {
                         *xrpnt = -v;
                     }
@@ -1032,33 +1124,7 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
             }
         }
 
-        while (m < me)
-        {
-            if (!mc)
-            {
-                mc = *m++;
-                xrpnt = ((double *) xr) + *m++;
-                if ((*m++) == 3)
-                {
-                    step = 1;
-                }
-                else
-                {
-                    step = 3;
-                }
-                m++; /* cb */
-            }
-            mc--;
-            *xrpnt = 0.0;
-            xrpnt += step;
-            *xrpnt = 0.0;
-            xrpnt += step;
-            /* we could add a little opt. here:
-             * if we finished a band for window 3 or a long band
-             * further bands could copied in a simple loop without a
-             * special 'map' decoding
-             */
-        }
+        /* the rest of the bands were cleared above */
 
         gr_infos->maxband[0] = max[0] + 1;
         gr_infos->maxband[1] = max[1] + 1;
@@ -1083,9 +1149,6 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
         register int *m = map[sfreq][2];
         register double v = 0.0;
         register int mc = 0;
-#if 0
-        me = mapend[sfreq][2];
-#endif
 
         /*
          * long hash table values
@@ -1094,6 +1157,7 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
         {
             int lp = l[i];
             struct newhuff *h = (struct newhuff *)(ht + gr_infos->table_select[i]);
+            const struct hufflookup *lookup = htLookup[gr_infos->table_select[i]];
 
             for (; lp; lp--, mc--)
             {
@@ -1105,25 +1169,15 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                     v = gr_infos->pow2gain[((*scf++) + (*pretab++)) << shift];
                     cb = *m++;
                 }
-                {
-                    register short *val = (short *)h->table;
-                    while ((y = *val++) < 0)
-                    {
-                        if (get1bit())
-                        {
-                            val -= y;
-                        }
-                        part2remain--;
-                    }
-                    x = y >> 4;
-                    y &= 0xf;
-                }
+                y = huff_decode(bs, h, lookup, &part2remain);
+                x = y >> 4;
+                y &= 0xf;
                 if (x == 15)
                 {
                     max = cb;
                     part2remain -= h->linbits + 1;
-                    x += getbits((int)h->linbits);
-                    if (get1bit())
+                    x += getbits(bs, (int)h->linbits);
+                    if (get1bit(bs))
                     {
                         *xrpnt++ = -ispow[x] * v;
                     }
@@ -1135,7 +1189,7 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                 else if (x)
                 {
                     max = cb;
-                    if (get1bit())
+                    if (get1bit(bs))
                     {
                         *xrpnt++ = -ispow[x] * v;
                     }
@@ -1154,8 +1208,8 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                 {
                     max = cb;
                     part2remain -= h->linbits + 1;
-                    y += getbits((int)h->linbits);
-                    if (get1bit())
+                    y += getbits(bs, (int)h->linbits);
+                    if (get1bit(bs))
                     {
                         *xrpnt++ = -ispow[y] * v;
                     }
@@ -1167,7 +1221,7 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                 else if (y)
                 {
                     max = cb;
-                    if (get1bit())
+                    if (get1bit(bs))
                     {
                         *xrpnt++ = -ispow[y] * v;
                     }
@@ -1189,23 +1243,9 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
          */
         for (; l3 && (part2remain > 0); l3--)
         {
-            struct newhuff *h = (struct newhuff *)(htc + gr_infos->count1table_select);
-            register short *val = (short *)h->table, a;
+            int a = huff_decode_count1(bs, htc + gr_infos->count1table_select,
+                                       htcLookup[gr_infos->count1table_select], &part2remain);
 
-            while ((a = *val++) < 0)
-            {
-                part2remain--;
-                if (part2remain < 0)
-                {
-                    part2remain++;
-                    a = 0;
-                    break;
-                }
-                if (get1bit())
-                {
-                    val -= a;
-                }
-            }
             for (i = 0; i < 4; i++)
             {
                 if (!(i & 1))
@@ -1227,7 +1267,7 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
                         part2remain++;
                         break;
                     }
-                    if (get1bit())
+                    if (get1bit(bs))
                     {
                         *xrpnt++ = -v;
                     }
@@ -1243,18 +1283,21 @@ static int III_dequantize_sample(double xr[SBLIMIT][SSLIMIT],
             }
         }
 
+        /* nothing is coded past the count1 region */
+        memset(xrpnt, 0, ((double *) xr + SBLIMIT * SSLIMIT - xrpnt) * sizeof(double));
+
         gr_infos->maxbandl = max + 1;
         gr_infos->maxb = longLimit[sfreq][gr_infos->maxbandl];
     }
 
     while (part2remain > 16)
     {
-        getbits(16); /* Dismiss stuffing Bits */
+        getbits(bs, 16); /* Dismiss stuffing Bits */
         part2remain -= 16;
     }
     if (part2remain > 0)
     {
-        getbits(part2remain);
+        getbits(bs, part2remain);
     }
     else if (part2remain < 0)
     {
@@ -1533,11 +1576,11 @@ static void dct36(double *inbuf, double *o1, double *o2, double *wintab, double
 
 #define MACRO0(v) { \
         double tmp; \
-        out2[9+(v)] = (tmp = sum0 + sum1) * w[27+(v)]; \
-        out2[8-(v)] = tmp * w[26-(v)];  } \
+        out2[SBLIMIT*(9+(v))] = (tmp = sum0 + sum1) * w[27+(v)]; \
+        out2[SBLIMIT*(8-(v))] = tmp * w[26-(v)];  } \
     sum0 -= sum1; \
-    ts[SBLIMIT*(8-(v))] = out1[8-(v)] + sum0 * w[8-(v)]; \
-    ts[SBLIMIT*(9+(v))] = out1[9+(v)] + sum0 * w[9+(v)];
+    ts[SBLIMIT*(8-(v))] = out1[SBLIMIT*(8-(v))] + sum0 * w[8-(v)]; \
+    ts[SBLIMIT*(9+(v))] = out1[SBLIMIT*(9+(v))] + sum0 * w[9+(v)];
 #define MACRO1(v) { \
         double sum0,sum1; \
         sum0 = tmp1a + tmp2a; \
@@ -1655,12 +1698,12 @@ static void dct12(double *in, double *rawout1, double *rawout2, register double
     {
         double in0, in1, in2, in3, in4, in5;
         register double *out1 = rawout1;
-        ts[SBLIMIT * 0] = out1[0];
-        ts[SBLIMIT * 1] = out1[1];
-        ts[SBLIMIT * 2] = out1[2];
-        ts[SBLIMIT * 3] = out1[3];
-        ts[SBLIMIT * 4] = out1[4];
-        ts[SBLIMIT * 5] = out1[5];
+        ts[SBLIMIT * 0] = out1[SBLIMIT * 0];
+        ts[SBLIMIT * 1] = out1[SBLIMIT * 1];
+        ts[SBLIMIT * 2] = out1[SBLIMIT * 2];
+        ts[SBLIMIT * 3] = out1[SBLIMIT * 3];
+        ts[SBLIMIT * 4] = out1[SBLIMIT * 4];
+        ts[SBLIMIT * 5] = out1[SBLIMIT * 5];
 
         DCT12_PART1
 
@@ -1671,23 +1714,23 @@ static void dct12(double *in, double *rawout1, double *rawout2, register double
                 tmp0 = tmp1 + tmp2;
                 tmp1 -= tmp2;
             }
-            ts[(17 - 1)*SBLIMIT] = out1[17 - 1] + tmp0 * wi[11 - 1];
-            ts[(12 + 1)*SBLIMIT] = out1[12 + 1] + tmp0 * wi[6 + 1];
-            ts[(6 + 1)*SBLIMIT] = out1[6 + 1] + tmp1 * wi[1];
-            ts[(11 - 1)*SBLIMIT] = out1[11 - 1] + tmp1 * wi[5 - 1];
+            ts[(17 - 1)*SBLIMIT] = out1[(17 - 1)*SBLIMIT] + tmp0 * wi[11 - 1];
+            ts[(12 + 1)*SBLIMIT] = out1[(12 + 1)*SBLIMIT] + tmp0 * wi[6 + 1];
+            ts[(6 + 1)*SBLIMIT] = out1[(6 + 1)*SBLIMIT] + tmp1 * wi[1];
+            ts[(11 - 1)*SBLIMIT] = out1[(11 - 1)*SBLIMIT] + tmp1 * wi[5 - 1];
         }
 
         DCT12_PART2
 
-        ts[(17 - 0)*SBLIMIT] = out1[17 - 0] + in2 * wi[11 - 0];
-        ts[(12 + 0)*SBLIMIT] = out1[12 + 0] + in2 * wi[6 + 0];
-        ts[(12 + 2)*SBLIMIT] = out1[12 + 2] + in3 * wi[6 + 2];
-        ts[(17 - 2)*SBLIMIT] = out1[17 - 2] + in3 * wi[11 - 2];
+        ts[(17 - 0)*SBLIMIT] = out1[(17 - 0)*SBLIMIT] + in2 * wi[11 - 0];
+        ts[(12 + 0)*SBLIMIT] = out1[(12 + 0)*SBLIMIT] + in2 * wi[6 + 0];
+        ts[(12 + 2)*SBLIMIT] = out1[(12 + 2)*SBLIMIT] + in3 * wi[6 + 2];
+        ts[(17 - 2)*SBLIMIT] = out1[(17 - 2)*SBLIMIT] + in3 * wi[11 - 2];
 
-        ts[(6 + 0)*SBLIMIT]  = out1[6 + 0] + in0 * wi[0];
-        ts[(11 - 0)*SBLIMIT] = out1[11 - 0] + in0 * wi[5 - 0];
-        ts[(6 + 2)*SBLIMIT]  = out1[6 + 2] + in4 * wi[2];
-        ts[(11 - 2)*SBLIMIT] = out1[11 - 2] + in4 * wi[5 - 2];
+        ts[(6 + 0)*SBLIMIT]  = out1[(6 + 0)*SBLIMIT] + in0 * wi[0];
+        ts[(11 - 0)*SBLIMIT] = out1[(11 - 0)*SBLIMIT] + in0 * wi[5 - 0];
+        ts[(6 + 2)*SBLIMIT]  = out1[(6 + 2)*SBLIMIT] + in4 * wi[2];
+        ts[(11 - 2)*SBLIMIT] = out1[(11 - 2)*SBLIMIT] + in4 * wi[5 - 2];
     }
 
     in++;
@@ -1705,18 +1748,18 @@ static void dct12(double *in, double *rawout1, double *rawout2, register double
                 tmp0 = tmp1 + tmp2;
                 tmp1 -= tmp2;
             }
-            out2[5 - 1] = tmp0 * wi[11 - 1];
-            out2[0 + 1] = tmp0 * wi[6 + 1];
+            out2[(5 - 1)*SBLIMIT] = tmp0 * wi[11 - 1];
+            out2[(0 + 1)*SBLIMIT] = tmp0 * wi[6 + 1];
             ts[(12 + 1)*SBLIMIT] += tmp1 * wi[1];
             ts[(17 - 1)*SBLIMIT] += tmp1 * wi[5 - 1];
         }
 
         DCT12_PART2
 
-        out2[5 - 0] = in2 * wi[11 - 0];
-        out2[0 + 0] = in2 * wi[6 + 0];
-        out2[0 + 2] = in3 * wi[6 + 2];
-        out2[5 - 2] = in3 * wi[11 - 2];
+        out2[(5 - 0)*SBLIMIT] = in2 * wi[11 - 0];
+        out2[(0 + 0)*SBLIMIT] = in2 * wi[6 + 0];
+        out2[(0 + 2)*SBLIMIT] = in3 * wi[6 + 2];
+        out2[(5 - 2)*SBLIMIT] = in3 * wi[11 - 2];
 
         ts[(12 + 0)*SBLIMIT] += in0 * wi[0];
         ts[(17 - 0)*SBLIMIT] += in0 * wi[5 - 0];
@@ -1729,7 +1772,7 @@ static void dct12(double *in, double *rawout1, double *rawout2, register double
     {
         double in0, in1, in2, in3, in4, in5;
         register double *out2 = rawout2;
-        out2[12] = out2[13] = out2[14] = out2[15] = out2[16] = out2[17] = 0.0;
+        out2[SBLIMIT * 12] = out2[SBLIMIT * 13] = out2[SBLIMIT * 14] = out2[SBLIMIT * 15] = out2[SBLIMIT * 16] = out2[SBLIMIT * 17] = 0.0;
 
         DCT12_PART1
 
@@ -1740,29 +1783,49 @@ static void dct12(double *in, double *rawout1, double *rawout2, register double
                 tmp0 = tmp1 + tmp2;
                 tmp1 -= tmp2;
             }
-            out2[11 - 1] = tmp0 * wi[11 - 1];
-            out2[6 + 1] = tmp0 * wi[6 + 1];
-            out2[0 + 1] += tmp1 * wi[1];
-            out2[5 - 1] += tmp1 * wi[5 - 1];
+            out2[(11 - 1)*SBLIMIT] = tmp0 * wi[11 - 1];
+            out2[(6 + 1)*SBLIMIT] = tmp0 * wi[6 + 1];
+            out2[(0 + 1)*SBLIMIT] += tmp1 * wi[1];
+            out2[(5 - 1)*SBLIMIT] += tmp1 * wi[5 - 1];
         }
 
         DCT12_PART2
 
-        out2[11 - 0] = in2 * wi[11 - 0];
-        out2[6 + 0] = in2 * wi[6 + 0];
-        out2[6 + 2] = in3 * wi[6 + 2];
-        out2[11 - 2] = in3 * wi[11 - 2];
+        out2[(11 - 0)*SBLIMIT] = in2 * wi[11 - 0];
+        out2[(6 + 0)*SBLIMIT] = in2 * wi[6 + 0];
+        out2[(6 + 2)*SBLIMIT] = in3 * wi[6 + 2];
+        out2[(11 - 2)*SBLIMIT] = in3 * wi[11 - 2];
 
-        out2[0 + 0] += in0 * wi[0];
-        out2[5 - 0] += in0 * wi[5 - 0];
-        out2[0 + 2] += in4 * wi[2];
-        out2[5 - 2] += in4 * wi[5 - 2];
+        out2[(0 + 0)*SBLIMIT] += in0 * wi[0];
+        out2[(5 - 0)*SBLIMIT] += in0 * wi[5 - 0];
+        out2[(0 + 2)*SBLIMIT] += in4 * wi[2];
+        out2[(5 - 2)*SBLIMIT] += in4 * wi[5 - 2];
     }
 }
 
 /*
  * III_hybrid
+ *
+ * The overlap buffers in mp->hybrid_block are laid out like tsOut, sample
+ * by sample with the subbands side by side, so that the vector versions
+ * below can load and store several subbands at once.
  */
+
+/* the subbands from sb up have no data: just the overlap from last time */
+static void hybrid_silent(int sb, double *rawout1, double *rawout2, double tsOut[SSLIMIT][SBLIMIT])
+{
+    int i;
+
+    for (; sb < SBLIMIT; sb++)
+    {
+        for (i = 0; i < SSLIMIT; i++)
+        {
+            tsOut[i][sb] = rawout1[i * SBLIMIT + sb];
+            rawout2[i * SBLIMIT + sb] = 0.0;
+        }
+    }
+}
+
 static void III_hybrid(PMPSTR mp, double fsIn[SBLIMIT][SSLIMIT], double tsOut[SSLIMIT][SBLIMIT],
                        int ch, struct gr_info_s *gr_infos)
 {
@@ -1785,48 +1848,381 @@ static void III_hybrid(PMPSTR mp, double fsIn[SBLIMIT][SSLIMIT], double tsOut[SS
     {
         sb = 2;
         dct36(fsIn[0], rawout1, rawout2, win[0], tspnt);
-        dct36(fsIn[1], rawout1 + 18, rawout2 + 18, win1[0], tspnt + 1);
-        rawout1 += 36;
-        rawout2 += 36;
+        dct36(fsIn[1], rawout1 + 1, rawout2 + 1, win1[0], tspnt + 1);
+        rawout1 += 2;
+        rawout2 += 2;
         tspnt += 2;
     }
 
     bt = gr_infos->block_type;
     if (bt == 2)
     {
-        for (; sb < (int)gr_infos->maxb; sb += 2, tspnt += 2, rawout1 += 36, rawout2 += 36)
+        for (; sb < (int)gr_infos->maxb; sb += 2, tspnt += 2, rawout1 += 2, rawout2 += 2)
         {
             dct12(fsIn[sb], rawout1, rawout2, win[2], tspnt);
-            dct12(fsIn[sb + 1], rawout1 + 18, rawout2 + 18, win1[2], tspnt + 1);
+            dct12(fsIn[sb + 1], rawout1 + 1, rawout2 + 1, win1[2], tspnt + 1);
         }
     }
     else
     {
-        for (; sb < (int)gr_infos->maxb; sb += 2, tspnt += 2, rawout1 += 36, rawout2 += 36)
+        for (; sb < (int)gr_infos->maxb; sb += 2, tspnt += 2, rawout1 += 2, rawout2 += 2)
         {
             dct36(fsIn[sb], rawout1, rawout2, win[bt], tspnt);
-            dct36(fsIn[sb + 1], rawout1 + 18, rawout2 + 18, win1[bt], tspnt + 1);
+            dct36(fsIn[sb + 1], rawout1 + 1, rawout2 + 1, win1[bt], tspnt + 1);
         }
     }
 
-    for (; sb < SBLIMIT; sb++, tspnt++)
+    hybrid_silent(sb, rawout1 - sb, rawout2 - sb, tsOut);
+}
+
+static void III_hybrid_scalar(PMPSTR mp, double fsIn[SBLIMIT][SSLIMIT], double tsOut[SSLIMIT][SBLIMIT],
+                              int ch, struct gr_info_s *gr_infos)
+{
+    III_antialias(fsIn, gr_infos);
+    III_hybrid(mp, fsIn, tsOut, ch, gr_infos);
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * The same IMDCTs for four subbands at a time, one in each lane of an AVX2
+ * register, written with GCC's vector extensions.  Each lane does exactly
+ * the sums of dct36 and dct12, so the output is the same to the last bit.
+ * There is no SSE2 version: with only two lanes, and half as many
+ * registers, it was slower than the scalar code.
+ *
+ * For long blocks the alias reduction is done here too, as the inputs are
+ * loaded, instead of in a pass of its own over hybridIn.  The inputs are
+ * not changed, so each subband still sees its neighbours' original values.
+ */
+
+typedef double v4df __attribute__((vector_size(32)));
+typedef long long v4di __attribute__((vector_size(32)));
+typedef double v4df_u __attribute__((vector_size(32), aligned(8)));
+
+#define VLOAD(p)        (*(const v4df_u *)(p))
+#define VSTORE(p, v)    (*(v4df_u *)(p) = (v))
+#define VSELECT(m, a, b) ((v4df)(((v4di)(a) & (m)) | ((v4di)(b) & ~(m))))
+
+/* x[i] gets sample i of subbands sb..sb+3, alias reduced against subbands
+   up to sblim */
+static inline __attribute__((always_inline))
+void hybrid_load_x4(double fsIn[SBLIMIT][SSLIMIT], int sb, int sblim, v4df *x)
+{
+    const double *xr = fsIn[sb];
+    const v4di lo = { 0, 4, 2, 6 }, hi = { 1, 5, 3, 7 };
+    const v4di first = { 0, 1, 4, 5 }, second = { 2, 3, 6, 7 };
+    v4di low, high;
+    int i;
+
+    /* transpose 4x4 blocks; the last one overlaps the one before */
+    for (i = 0; i <= 16; i += 4)
     {
-        int i;
-        for (i = 0; i < SSLIMIT; i++)
+        int c = i < 16 ? i : 14;
+        v4df r0 = VLOAD(xr + c), r1 = VLOAD(xr + SSLIMIT + c);
+        v4df r2 = VLOAD(xr + 2 * SSLIMIT + c), r3 = VLOAD(xr + 3 * SSLIMIT + c);
+        v4df t0 = __builtin_shuffle(r0, r1, lo), t1 = __builtin_shuffle(r0, r1, hi);
+        v4df t2 = __builtin_shuffle(r2, r3, lo), t3 = __builtin_shuffle(r2, r3, hi);
+
+        x[c + 2] = __builtin_shuffle(t0, t2, second);
+        x[c + 3] = __builtin_shuffle(t1, t3, second);
+        if (i < 16)
         {
-            tspnt[i * SBLIMIT] = *rawout1++;
-            *rawout2++ = 0.0;
+            x[c] = __builtin_shuffle(t0, t2, first);
+            x[c + 1] = __builtin_shuffle(t1, t3, first);
         }
     }
+
+    if (sblim < sb)
+    {
+        return;
+    }
+
+    /* lane j is alias reduced with subband sb+j-1 if 1 <= sb+j <= sblim,
+       and with subband sb+j+1 if sb+j+1 <= sblim */
+    low = (v4di)
+    {
+        -(sb >= 1 && sb <= sblim), -(sb + 1 <= sblim), -(sb + 2 <= sblim), -(sb + 3 <= sblim)
+    };
+    high = (v4di)
+    {
+        -(sb + 1 <= sblim), -(sb + 2 <= sblim), -(sb + 3 <= sblim), -(sb + 4 <= sblim)
+    };
+
+    for (i = 0; i < 8; i++)
+    {
+        const v4di shiftUp = { 4, 0, 1, 2 }, shiftDown = { 1, 2, 3, 4 };
+        double before = sb > 0 ? xr[-SSLIMIT + 17 - i] : 0;
+        double after = sb + 4 < SBLIMIT ? xr[4 * SSLIMIT + i] : 0;
+        v4df bd = x[i], bu = x[17 - i];
+        v4df up = __builtin_shuffle(bu, (v4df) { before, before, before, before }, shiftUp);
+        v4df down = __builtin_shuffle(bd, (v4df) { after, after, after, after }, shiftDown);
+
+        x[i] = VSELECT(low, (bd * aa_cs[i]) + (up * aa_ca[i]), bd);
+        x[17 - i] = VSELECT(high, (bu * aa_cs[i]) - (down * aa_ca[i]), bu);
+    }
+}
+
+#define VMACRO0(v) \
+    tmp = sum0 + sum1; \
+    VSTORE(out2 + SBLIMIT*(9+(v)), tmp * w[27+(v)]); \
+    VSTORE(out2 + SBLIMIT*(8-(v)), tmp * w[26-(v)]); \
+    sum0 -= sum1; \
+    VSTORE(ts + SBLIMIT*(8-(v)), VLOAD(out1 + SBLIMIT*(8-(v))) + sum0 * w[8-(v)]); \
+    VSTORE(ts + SBLIMIT*(9+(v)), VLOAD(out1 + SBLIMIT*(9+(v))) + sum0 * w[9+(v)]);
+#define VMACRO1(v) \
+    sum0 = tmp1a + tmp2a; \
+    sum1 = (tmp1b + tmp2b) * tfcos36[(v)]; \
+    VMACRO0(v);
+#define VMACRO2(v) \
+    sum0 = tmp2a - tmp1a; \
+    sum1 = (tmp2b - tmp1b) * tfcos36[(v)]; \
+    VMACRO0(v);
+
+static inline __attribute__((always_inline))
+void dct36_x4(v4df *in, double *out1, double *out2, const v4df *w, double *ts)
+{
+    const double *c = COS9;
+    v4df ta33, ta66, tb33, tb66;
+    v4df tmp1a, tmp2a, tmp1b, tmp2b;
+    v4df sum0, sum1, tmp;
+
+    in[17] += in[16];
+    in[16] += in[15];
+    in[15] += in[14];
+    in[14] += in[13];
+    in[13] += in[12];
+    in[12] += in[11];
+    in[11] += in[10];
+    in[10] += in[9];
+    in[9] += in[8];
+    in[8] += in[7];
+    in[7] += in[6];
+    in[6] += in[5];
+    in[5] += in[4];
+    in[4] += in[3];
+    in[3] += in[2];
+    in[2] += in[1];
+    in[1] += in[0];
+
+    in[17] += in[15];
+    in[15] += in[13];
+    in[13] += in[11];
+    in[11] += in[9];
+    in[9] += in[7];
+    in[7] += in[5];
+    in[5] += in[3];
+    in[3] += in[1];
+
+    ta33 = in[2 * 3 + 0] * c[3];
+    ta66 = in[2 * 6 + 0] * c[6];
+    tb33 = in[2 * 3 + 1] * c[3];
+    tb66 = in[2 * 6 + 1] * c[6];
+
+    tmp1a =             in[2 * 1 + 0] * c[1] + ta33 + in[2 * 5 + 0] * c[5] + in[2 * 7 + 0] * c[7];
+    tmp1b =             in[2 * 1 + 1] * c[1] + tb33 + in[2 * 5 + 1] * c[5] + in[2 * 7 + 1] * c[7];
+    tmp2a = in[2 * 0 + 0] + in[2 * 2 + 0] * c[2] + in[2 * 4 + 0] * c[4] + ta66 + in[2 * 8 + 0] * c[8];
+    tmp2b = in[2 * 0 + 1] + in[2 * 2 + 1] * c[2] + in[2 * 4 + 1] * c[4] + tb66 + in[2 * 8 + 1] * c[8];
+
+    VMACRO1(0);
+    VMACRO2(8);
+
+    tmp1a = (in[2 * 1 + 0] - in[2 * 5 + 0] - in[2 * 7 + 0]) * c[3];
+    tmp1b = (in[2 * 1 + 1] - in[2 * 5 + 1] - in[2 * 7 + 1]) * c[3];
+    tmp2a = (in[2 * 2 + 0] - in[2 * 4 + 0] - in[2 * 8 + 0]) * c[6] - in[2 * 6 + 0] + in[2 * 0 + 0];
+    tmp2b = (in[2 * 2 + 1] - in[2 * 4 + 1] - in[2 * 8 + 1]) * c[6] - in[2 * 6 + 1] + in[2 * 0 + 1];
+
+    VMACRO1(1);
+    VMACRO2(7);
+
+    tmp1a =             in[2 * 1 + 0] * c[5] - ta33 - in[2 * 5 + 0] * c[7] + in[2 * 7 + 0] * c[1];
+    tmp1b =             in[2 * 1 + 1] * c[5] - tb33 - in[2 * 5 + 1] * c[7] + in[2 * 7 + 1] * c[1];
+    tmp2a = in[2 * 0 + 0] - in[2 * 2 + 0] * c[8] - in[2 * 4 + 0] * c[2] + ta66 + in[2 * 8 + 0] * c[4];
+    tmp2b = in[2 * 0 + 1] - in[2 * 2 + 1] * c[8] - in[2 * 4 + 1] * c[2] + tb66 + in[2 * 8 + 1] * c[4];
+
+    VMACRO1(2);
+    VMACRO2(6);
+
+    tmp1a =             in[2 * 1 + 0] * c[7] - ta33 + in[2 * 5 + 0] * c[1] - in[2 * 7 + 0] * c[5];
+    tmp1b =             in[2 * 1 + 1] * c[7] - tb33 + in[2 * 5 + 1] * c[1] - in[2 * 7 + 1] * c[5];
+    tmp2a = in[2 * 0 + 0] - in[2 * 2 + 0] * c[4] + in[2 * 4 + 0] * c[8] + ta66 - in[2 * 8 + 0] * c[2];
+    tmp2b = in[2 * 0 + 1] - in[2 * 2 + 1] * c[4] + in[2 * 4 + 1] * c[8] + tb66 - in[2 * 8 + 1] * c[2];
+
+    VMACRO1(3);
+    VMACRO2(5);
+
+    sum0 =  in[2 * 0 + 0] - in[2 * 2 + 0] + in[2 * 4 + 0] - in[2 * 6 + 0] + in[2 * 8 + 0];
+    sum1 = (in[2 * 0 + 1] - in[2 * 2 + 1] + in[2 * 4 + 1] - in[2 * 6 + 1] + in[2 * 8 + 1]) * tfcos36[4];
+    VMACRO0(4);
+}
+
+static inline __attribute__((always_inline))
+void dct12_x4(v4df *x, double *out1, double *out2, const v4df *wi, double *ts)
+{
+    const v4df zero = { 0, 0, 0, 0 };
+    v4df in0, in1, in2, in3, in4, in5, tmp0, tmp1, tmp2;
+    v4df *in = x;
+    int i;
+
+    for (i = 0; i < 6; i++)
+    {
+        VSTORE(ts + SBLIMIT * i, VLOAD(out1 + SBLIMIT * i));
+    }
+
+    DCT12_PART1
+
+    tmp1 = (in0 - in4);
+    tmp2 = (in1 - in5) * tfcos12[1];
+    tmp0 = tmp1 + tmp2;
+    tmp1 -= tmp2;
+    VSTORE(ts + (17 - 1)*SBLIMIT, VLOAD(out1 + (17 - 1)*SBLIMIT) + tmp0 * wi[11 - 1]);
+    VSTORE(ts + (12 + 1)*SBLIMIT, VLOAD(out1 + (12 + 1)*SBLIMIT) + tmp0 * wi[6 + 1]);
+    VSTORE(ts + (6 + 1)*SBLIMIT, VLOAD(out1 + (6 + 1)*SBLIMIT) + tmp1 * wi[1]);
+    VSTORE(ts + (11 - 1)*SBLIMIT, VLOAD(out1 + (11 - 1)*SBLIMIT) + tmp1 * wi[5 - 1]);
+
+    DCT12_PART2
+
+    VSTORE(ts + (17 - 0)*SBLIMIT, VLOAD(out1 + (17 - 0)*SBLIMIT) + in2 * wi[11 - 0]);
+    VSTORE(ts + (12 + 0)*SBLIMIT, VLOAD(out1 + (12 + 0)*SBLIMIT) + in2 * wi[6 + 0]);
+    VSTORE(ts + (12 + 2)*SBLIMIT, VLOAD(out1 + (12 + 2)*SBLIMIT) + in3 * wi[6 + 2]);
+    VSTORE(ts + (17 - 2)*SBLIMIT, VLOAD(out1 + (17 - 2)*SBLIMIT) + in3 * wi[11 - 2]);
+
+    VSTORE(ts + (6 + 0)*SBLIMIT, VLOAD(out1 + (6 + 0)*SBLIMIT) + in0 * wi[0]);
+    VSTORE(ts + (11 - 0)*SBLIMIT, VLOAD(out1 + (11 - 0)*SBLIMIT) + in0 * wi[5 - 0]);
+    VSTORE(ts + (6 + 2)*SBLIMIT, VLOAD(out1 + (6 + 2)*SBLIMIT) + in4 * wi[2]);
+    VSTORE(ts + (11 - 2)*SBLIMIT, VLOAD(out1 + (11 - 2)*SBLIMIT) + in4 * wi[5 - 2]);
+
+    in = x + 1;
+
+    DCT12_PART1
+
+    tmp1 = (in0 - in4);
+    tmp2 = (in1 - in5) * tfcos12[1];
+    tmp0 = tmp1 + tmp2;
+    tmp1 -= tmp2;
+    VSTORE(out2 + (5 - 1)*SBLIMIT, tmp0 * wi[11 - 1]);
+    VSTORE(out2 + (0 + 1)*SBLIMIT, tmp0 * wi[6 + 1]);
+    VSTORE(ts + (12 + 1)*SBLIMIT, VLOAD(ts + (12 + 1)*SBLIMIT) + tmp1 * wi[1]);
+    VSTORE(ts + (17 - 1)*SBLIMIT, VLOAD(ts + (17 - 1)*SBLIMIT) + tmp1 * wi[5 - 1]);
+
+    DCT12_PART2
+
+    VSTORE(out2 + (5 - 0)*SBLIMIT, in2 * wi[11 - 0]);
+    VSTORE(out2 + (0 + 0)*SBLIMIT, in2 * wi[6 + 0]);
+    VSTORE(out2 + (0 + 2)*SBLIMIT, in3 * wi[6 + 2]);
+    VSTORE(out2 + (5 - 2)*SBLIMIT, in3 * wi[11 - 2]);
+
+    VSTORE(ts + (12 + 0)*SBLIMIT, VLOAD(ts + (12 + 0)*SBLIMIT) + in0 * wi[0]);
+    VSTORE(ts + (17 - 0)*SBLIMIT, VLOAD(ts + (17 - 0)*SBLIMIT) + in0 * wi[5 - 0]);
+    VSTORE(ts + (12 + 2)*SBLIMIT, VLOAD(ts + (12 + 2)*SBLIMIT) + in4 * wi[2]);
+    VSTORE(ts + (17 - 2)*SBLIMIT, VLOAD(ts + (17 - 2)*SBLIMIT) + in4 * wi[5 - 2]);
+
+    in = x + 2;
+    for (i = 12; i < 18; i++)
+    {
+        VSTORE(out2 + SBLIMIT * i, zero);
+    }
+
+    DCT12_PART1
+
+    tmp1 = (in0 - in4);
+    tmp2 = (in1 - in5) * tfcos12[1];
+    tmp0 = tmp1 + tmp2;
+    tmp1 -= tmp2;
+    VSTORE(out2 + (11 - 1)*SBLIMIT, tmp0 * wi[11 - 1]);
+    VSTORE(out2 + (6 + 1)*SBLIMIT, tmp0 * wi[6 + 1]);
+    VSTORE(out2 + (0 + 1)*SBLIMIT, VLOAD(out2 + (0 + 1)*SBLIMIT) + tmp1 * wi[1]);
+    VSTORE(out2 + (5 - 1)*SBLIMIT, VLOAD(out2 + (5 - 1)*SBLIMIT) + tmp1 * wi[5 - 1]);
+
+    DCT12_PART2
+
+    VSTORE(out2 + (11 - 0)*SBLIMIT, in2 * wi[11 - 0]);
+    VSTORE(out2 + (6 + 0)*SBLIMIT, in2 * wi[6 + 0]);
+    VSTORE(out2 + (6 + 2)*SBLIMIT, in3 * wi[6 + 2]);
+    VSTORE(out2 + (11 - 2)*SBLIMIT, in3 * wi[11 - 2]);
+
+    VSTORE(out2 + (0 + 0)*SBLIMIT, VLOAD(out2 + (0 + 0)*SBLIMIT) + in0 * wi[0]);
+    VSTORE(out2 + (5 - 0)*SBLIMIT, VLOAD(out2 + (5 - 0)*SBLIMIT) + in0 * wi[5 - 0]);
+    VSTORE(out2 + (0 + 2)*SBLIMIT, VLOAD(out2 + (0 + 2)*SBLIMIT) + in4 * wi[2]);
+    VSTORE(out2 + (5 - 2)*SBLIMIT, VLOAD(out2 + (5 - 2)*SBLIMIT) + in4 * wi[5 - 2]);
 }
 
 /*
- * main layer3 handler
+ * Mixed blocks are rare, and go the scalar way.  Otherwise the subbands
+ * are done four at a time from 0 up to maxb (rounded up to even, as in
+ * III_hybrid).  Any lanes past that are overwritten by hybrid_silent.
  */
-struct III_sideinfo sideinfo;
+__attribute__((target("avx2")))
+static void III_hybrid_avx2(PMPSTR mp, double fsIn[SBLIMIT][SSLIMIT], double tsOut[SSLIMIT][SBLIMIT],
+                            int ch, struct gr_info_s *gr_infos)
+{
+    double(*block)[2][SBLIMIT * SSLIMIT] = mp->hybrid_block;
+    int *blc = mp->hybrid_blc;
+    double *rawout1, *rawout2;
+    int bt = gr_infos->block_type;
+    int end = ((int)gr_infos->maxb + 1) & ~1;
+    int sb;
+
+    if (gr_infos->mixed_block_flag)
+    {
+        III_hybrid_scalar(mp, fsIn, tsOut, ch, gr_infos);
+        return;
+    }
+
+    {
+        int b = blc[ch];
+        rawout1 = block[b][ch];
+        b = -b + 1;
+        rawout2 = block[b][ch];
+        blc[ch] = b;
+    }
+
+    for (sb = 0; sb < end; sb += 4)
+    {
+        v4df x[SSLIMIT];
+
+        if (bt == 2)
+        {
+            hybrid_load_x4(fsIn, sb, -1, x);
+            dct12_x4(x, rawout1 + sb, rawout2 + sb, (const v4df *)winLanes[2], (double *)tsOut + sb);
+        }
+        else
+        {
+            hybrid_load_x4(fsIn, sb, (int)gr_infos->maxb - 1, x);
+            dct36_x4(x, rawout1 + sb, rawout2 + sb, (const v4df *)winLanes[bt], (double *)tsOut + sb);
+        }
+    }
+
+    hybrid_silent(end, rawout1, rawout2, tsOut);
+}
 
-int do_layer3_sideinfo(struct frame *fr)
+#endif /* HAVE_X86_SIMD */
+
+/* alias reduction and IMDCT, chosen by init_hybrid */
+static void (*hybrid_impl)(PMPSTR mp, double fsIn[SBLIMIT][SSLIMIT], double tsOut[SSLIMIT][SBLIMIT],
+                           int ch, struct gr_info_s *gr_infos) = III_hybrid_scalar;
+
+static void init_hybrid(void)
+{
+    switch (simd_level())
+    {
+#ifdef HAVE_X86_SIMD
+    case SIMD_AVX2:
+        hybrid_impl = III_hybrid_avx2;
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+/*
+ * main layer3 handler
+ */
+int do_layer3_sideinfo(PMPSTR mp)
 {
+    struct frame *fr = &(mp->fr);
+    struct III_sideinfo *si = &(mp->sideinfo);
     int stereo = fr->stereo;
     int single = fr->single;
     int ms_stereo;
@@ -1851,7 +2247,7 @@ int do_layer3_sideinfo(struct frame *fr)
     if (fr->lsf)
     {
         granules = 1;
-        if (!(III_get_side_info_2(&sideinfo, stereo, ms_stereo, sfreq, single)))
+        if (!(III_get_side_info_2(&(mp->bits), si, stereo, ms_stereo, sfreq, single)))
         {
             return -32767;
         }
@@ -1859,7 +2255,7 @@ int do_layer3_sideinfo(struct frame *fr)
     else
     {
         granules = 2;
-        if (!(III_get_side_info_1(&sideinfo, stereo, ms_stereo, sfreq, single)))
+        if (!(III_get_side_info_1(&(mp->bits), si, stereo, ms_stereo, sfreq, single)))
         {
             return -32767;
         }
@@ -1870,18 +2266,19 @@ int do_layer3_sideinfo(struct frame *fr)
     {
         for (ch = 0; ch < stereo ; ++ch)
         {
-            struct gr_info_s *gr_infos = &(sideinfo.ch[ch].gr[gr]);
+            struct gr_info_s *gr_infos = &(si->ch[ch].gr[gr]);
             databits += gr_infos->part2_3_length;
         }
     }
-    return databits - 8 * sideinfo.main_data_begin;
+    return databits - 8 * si->main_data_begin;
 }
 
 int do_layer3(PMPSTR mp, int *pcm_point)
 {
     int gr, ch, ss, clip = 0;
     int scalefacs[2][39]; /* max 39 for short[13][3] mode, mixed: 38, long: 22 */
-    //  struct III_sideinfo sideinfo;
+    struct III_sideinfo *si = &(mp->sideinfo);
+    struct bitreader *bs = &(mp->bits);
     struct frame *fr = &(mp->fr);
     int stereo = fr->stereo;
     int single = fr->single;
@@ -1889,7 +2286,7 @@ int do_layer3(PMPSTR mp, int *pcm_point)
     int sfreq = fr->sampling_frequency;
     int stereo1, granules;
 
-    if (set_pointer(mp, (int)sideinfo.main_data_begin) == MP3_ERR)
+    if (set_pointer(mp, (int)si->main_data_begin) == MP3_ERR)
     {
         return -32767;
     }
@@ -1929,23 +2326,23 @@ int do_layer3(PMPSTR mp, int *pcm_point)
 
     for (gr = 0; gr < granules; gr++)
     {
-        static double hybridIn[2][SBLIMIT][SSLIMIT];
-        static double hybridOut[2][SSLIMIT][SBLIMIT];
+        static _Thread_local double hybridIn[2][SBLIMIT][SSLIMIT];
+        static _Thread_local double hybridOut[2][SSLIMIT][SBLIMIT];
 
         {
-            struct gr_info_s *gr_infos = &(sideinfo.ch[0].gr[gr]);
+            struct gr_info_s *gr_infos = &(si->ch[0].gr[gr]);
             long part2bits;
 
             if (fr->lsf)
             {
-                part2bits = III_get_scale_factors_2(scalefacs[0], gr_infos, 0);
+                part2bits = III_get_scale_factors_2(bs, scalefacs[0], gr_infos, 0);
             }
             else
             {
-                part2bits = III_get_scale_factors_1(scalefacs[0], gr_infos);
+                part2bits = III_get_scale_factors_1(bs, scalefacs[0], gr_infos);
             }
 
-            if (III_dequantize_sample(hybridIn[0], scalefacs[0],
+            if (III_dequantize_sample(bs, hybridIn[0], scalefacs[0],
                                       gr_infos, sfreq, part2bits))
             {
                 return 0;
@@ -1953,18 +2350,18 @@ int do_layer3(PMPSTR mp, int *pcm_point)
         }
         if (stereo == 2)
         {
-            struct gr_info_s *gr_infos = &(sideinfo.ch[1].gr[gr]);
+            struct gr_info_s *gr_infos = &(si->ch[1].gr[gr]);
             long part2bits;
             if (fr->lsf)
             {
-                part2bits = III_get_scale_factors_2(scalefacs[1], gr_infos, i_stereo);
+                part2bits = III_get_scale_factors_2(bs, scalefacs[1], gr_infos, i_stereo);
             }
             else
             {
-                part2bits = III_get_scale_factors_1(scalefacs[1], gr_infos);
+                part2bits = III_get_scale_factors_1(bs, scalefacs[1], gr_infos);
             }
 
-            if (III_dequantize_sample(hybridIn[1], scalefacs[1],
+            if (III_dequantize_sample(bs, hybridIn[1], scalefacs[1],
                                       gr_infos, sfreq, part2bits))
             {
                 return 0;
@@ -1990,13 +2387,13 @@ int do_layer3(PMPSTR mp, int *pcm_point)
 
             if (ms_stereo || i_stereo || (single == 3))
             {
-                if (gr_infos->maxb > sideinfo.ch[0].gr[gr].maxb)
+                if (gr_infos->maxb > si->ch[0].gr[gr].maxb)
                 {
-                    sideinfo.ch[0].gr[gr].maxb = gr_infos->maxb;
+                    si->ch[0].gr[gr].maxb = gr_infos->maxb;
                 }
                 else
                 {
-                    gr_infos->maxb = sideinfo.ch[0].gr[gr].maxb;
+                    gr_infos->maxb = si->ch[0].gr[gr].maxb;
                 }
             }
 
@@ -2027,9 +2424,8 @@ int do_layer3(PMPSTR mp, int *pcm_point)
 
         for (ch = 0; ch < stereo1; ch++)
         {
-            struct gr_info_s *gr_infos = &(sideinfo.ch[ch].gr[gr]);
-            III_antialias(hybridIn[ch], gr_infos);
-            III_hybrid(mp, hybridIn[ch], hybridOut[ch], ch, gr_infos);
+            struct gr_info_s *gr_infos = &(si->ch[ch].gr[gr]);
+            hybrid_impl(mp, hybridIn[ch], hybridOut[ch], ch, gr_infos);
         }
 
         for (ss = 0; ss < SSLIMIT; ss++)
@@ -19,5 +19,5 @@
 #pragma once
 
 void init_layer3(int);
-int  do_layer3_sideinfo(struct frame *fr);
+int  do_layer3_sideinfo(PMPSTR mp);
 int  do_layer3(PMPSTR mp, int *pcm_point);
@@ -0,0 +1,45 @@
+/*
+ * Writes mpglibDBL_tables.c: the layer 3 dequantization tables that
+ * init_layer3() used to compute with pow() for every file.  The values
+ * are printed as hex floats so the decoder sees exactly what the old
+ * runtime code computed.
+ */
+
+#include <stdio.h>
+#include <math.h>
+
+static void printTable(const char *name, const char *size, const double *table, int len)
+{
+    int i;
+
+    printf("const double %s[%s] =\n{\n", name, size);
+    for (i = 0; i < len; i++)
+    {
+        printf("    %a,\n", table[i]);
+    }
+    printf("};\n\n");
+}
+
+int main(void)
+{
+    static double ispow[8207];
+    static double gainpow2[256 + 118 + 4];
+    int i;
+
+    for (i = -256; i < 118 + 4; i++)
+    {
+        gainpow2[i + 256] = pow((double)2.0, -0.25 * (double)(i + 210));
+    }
+
+    for (i = 0; i < 8207; i++)
+    {
+        ispow[i] = pow((double)i, (double)4.0 / 3.0);
+    }
+
+    printf("/* Generated by mpglibDBL_mktables.  Do not edit. */\n\n");
+    printf("#include \"mpglibDBL_tables.h\"\n\n");
+    printTable("ispow", "8207", ispow, 8207);
+    printTable("gainpow2", "256 + 118 + 4", gainpow2, 256 + 118 + 4);
+
+    return 0;
+}
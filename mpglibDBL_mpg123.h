@@ -7,6 +7,7 @@
 
 #define         SBLIMIT                 32
 #define         SSLIMIT                 18
+#define         SYNTH_ROWS              20  /* 17 rows of dct64 output, padded for vector loads */
 
 #define         MPG_MD_STEREO           0
 #define         MPG_MD_JOINT_STEREO     1
@@ -61,8 +62,8 @@ struct gr_info_s
     unsigned preflag;
     unsigned scalefac_scale;
     unsigned count1table_select;
-    double *full_gain[3];
-    double *pow2gain;
+    const double *full_gain[3];
+    const double *pow2gain;
 };
 
 struct III_sideinfo
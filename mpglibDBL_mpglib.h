@@ -1,14 +1,17 @@
+#include <stdint.h>
 #include "mpglibDBL_encoder.h"
 
 struct buf
 {
-    unsigned char *pnt;
+    const unsigned char *pnt;
     long size;
     long pos;
     struct buf *next;
-    struct buf *prev;
 };
 
+/* most input that can be left over between calls to decodeMP3() */
+#define INBUFSIZE 32768
+
 struct framebuf
 {
     struct buf *buf;
@@ -17,9 +20,18 @@ struct framebuf
     struct frame *prev;
 };
 
+/* reads a frame out of bsspace, refilling a 64 bit cache 8 bytes at a time */
+struct bitreader
+{
+    const unsigned char *pnt;   /* next byte to load */
+    uint64_t cache;             /* unread bits, msb first */
+    int count;                  /* number of them in cache */
+};
+
 typedef struct mpstr_tag
 {
     struct buf *head, *tail;
+    struct buf inbufs[2];         /* what is left in inbuf, then the caller's buffer */
     int vbr_header;               /* 1 if valid Xing vbr header detected */
     int num_frames;               /* set if vbr header present */
     int header_parsed;
@@ -34,14 +46,20 @@ typedef struct mpstr_tag
     int fsizeold;
     int fsizeold_nopadding;
     struct frame fr;
-    unsigned char bsspace[2][MAXFRAMESIZE + 512]; /* MAXFRAMESIZE */
+    /* the reader may load up to 8 bytes past the end of the frame */
+    unsigned char bsspace[2][MAXFRAMESIZE + 512 + 8]; /* MAXFRAMESIZE */
+    unsigned char *wordpointer;   /* where the next part of the frame goes */
+    struct bitreader bits;
+    struct III_sideinfo sideinfo;
     double hybrid_block[2][2][SBLIMIT * SSLIMIT];
     int hybrid_blc[2];
     unsigned long header;
     int bsnum;
-    double synth_buffs[2][2][0x110];
+    /* 16 columns of dct64 output, each padded from 17 to SYNTH_ROWS */
+    _Alignas(32) double synth_buffs[2][2][16 * SYNTH_ROWS];
     int  synth_bo;
     int  sync_bitstream;
+    unsigned char inbuf[INBUFSIZE];   /* last, InitMP3() does not clear it */
 
 } MPSTR, *PMPSTR;
 
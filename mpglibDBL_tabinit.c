@@ -2,7 +2,9 @@
 #include "mpglibDBL_tabinit.h"
 #include "mpglibDBL_mpg123.h"
 
-double decwin[512 + 32];
+_Alignas(32) double decwin[512 + 32];
+/* decwinT[m][r] is decwin[m + 32 * r], for the window sums of several rows at once */
+_Alignas(32) double decwinT[33][SYNTH_ROWS];
 static double cos64[16], cos32[8], cos16[4], cos8[2], cos4[1];
 double *pnts[] = { cos64, cos32, cos16, cos8, cos4 };
 
@@ -77,7 +79,7 @@ const double dewin[512] =
 
 void make_decode_tables(long scaleval)
 {
-    int i, j, k, kr, divv;
+    int i, j, k, kr, divv, m, r;
     double *table, *costab;
 
     for (i = 0; i < 5; i++)
@@ -124,4 +126,12 @@ void make_decode_tables(long scaleval)
             scaleval = - scaleval;
         }
     }
+
+    for (m = 0; m < 33; m++)
+    {
+        for (r = 0; r < SYNTH_ROWS; r++)
+        {
+            decwinT[m][r] = m + 32 * r < 512 + 32 ? decwin[m + 32 * r] : 0;
+        }
+    }
 }
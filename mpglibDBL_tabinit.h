@@ -21,6 +21,7 @@
 #include "mpglibDBL_mpg123.h"
 
 extern double decwin[512 + 32];
+extern double decwinT[33][SYNTH_ROWS];
 extern double *pnts[5];
 
 void make_decode_tables(long scale);
@@ -0,0 +1,6 @@
+#pragma once
+
+/* Built by mpglibDBL_mktables when mp3gain is compiled */
+
+extern const double ispow[8207];                /* i^(4/3) */
+extern const double gainpow2[256 + 118 + 4];    /* 2^(-(i+210)/4), indexed from -256 */